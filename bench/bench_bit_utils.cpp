@@ -0,0 +1,68 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <random>
+#include <vector>
+
+#include "SimpleTimer.h"
+#include "bit_utils.h"
+
+using namespace libpbs::utils;
+using only_for_benchmark::SimpleTimer;
+
+/**
+ * Throughput benchmark (MB/s of packed output) for packing and unpacking
+ * arrays of fixed-width values, the way decoding messages carry their
+ * m-bit positions: byte-at-a-time BitWriter/BitReader against
+ * BitPacker::WriteN()/BitUnpacker::ReadN().
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"Bit Packing Benchmark"};
+  size_t n = 1000000;
+  app.add_option("-n,--values", n, "Number of values");
+  std::vector<unsigned> widths{7, 12, 14, 16, 20, 32};
+  app.add_option("-w,--widths", widths, "Widths (in bits) to benchmark");
+  unsigned seed = 20200801u;
+  app.add_option("--seed", seed, "Random seed");
+  CLI11_PARSE(app, argc, argv);
+
+  SimpleTimer timer;
+  fmt::print("{:>6} {:>14} {:>14} {:>14} {:>14}\n", "bits", "write (MB/s)",
+             "WriteN (MB/s)", "read (MB/s)", "ReadN (MB/s)");
+  for (unsigned bits : widths) {
+    std::mt19937_64 gen(seed);
+    std::vector<uint64_t> values(n), parsed(n);
+    for (auto &val : values) val = gen() & ((uint64_t(1) << bits) - 1);
+    std::vector<uint8_t> buf(Bits2Bytes(bits * n));
+    double mb = buf.size() / 1e6;
+
+    timer.restart();
+    BitWriter writer(buf.data());
+    for (auto val : values) writer.Write<uint64_t>(val, bits);
+    writer.Flush();
+    double write_us = timer.elapsed();
+
+    timer.restart();
+    BitReader reader(buf.data());
+    for (auto &val : parsed) val = reader.Read<uint64_t>(bits);
+    double read_us = timer.elapsed();
+    if (parsed != values) fmt::print("BitReader mismatch\n");
+
+    timer.restart();
+    BitPacker packer(buf.data(), buf.size());
+    packer.WriteN(values.data(), n, bits);
+    packer.Flush();
+    double pack_us = timer.elapsed();
+
+    timer.restart();
+    BitUnpacker unpacker(buf.data(), buf.size());
+    unpacker.ReadN(parsed.data(), n, bits);
+    double unpack_us = timer.elapsed();
+    if (parsed != values) fmt::print("BitUnpacker mismatch\n");
+
+    fmt::print("{:>6} {:>14.1f} {:>14.1f} {:>14.1f} {:>14.1f}\n", bits,
+               mb / write_us * 1e6, mb / pack_us * 1e6, mb / read_us * 1e6,
+               mb / unpack_us * 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "SimpleTimer.h"
+#include "pbs.h"
+
+using namespace libpbs;
+using only_for_benchmark::SimpleTimer;
+
+/**
+ * Scaling benchmark for the BCH decoding step on Bob's side
+ * (ParityBitmapSketch::decode()) for d = 10^4 .. 10^6. Alice holds d extra
+ * elements, so every group has about `avg_diffs_per_group` bit errors to
+ * decode.
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"PBS Decoding Benchmark"};
+  std::vector<size_t> diffs{10000, 100000, 1000000};
+  app.add_option("-d,--diffs", diffs, "Cardinalities of the set difference");
+  size_t common_sz = 100000;
+  app.add_option("--common-size", common_sz, "Number of common elements");
+  unsigned max_threads = std::thread::hardware_concurrency();
+  app.add_option("--max-threads", max_threads, "Largest number of threads");
+  unsigned seed = 20200721u;
+  app.add_option("--seed", seed, "Random seed");
+  CLI11_PARSE(app, argc, argv);
+
+  SimpleTimer timer;
+  fmt::print("{:>10} {:>8} {:>14} {:>10}\n", "d", "threads", "decode (us)",
+             "speedup");
+  for (size_t d : diffs) {
+    std::mt19937_64 gen(seed);
+    std::vector<uint64_t> common(common_sz), extra(d);
+    for (auto &key : common) key = gen();
+    for (auto &key : extra) key = gen();
+
+    ParityBitmapSketch alice(d);
+    alice.add(common.begin(), common.end());
+    alice.add(extra.begin(), extra.end());
+    auto [alice_enc, alice_hint] = alice.encode();
+    (void)alice_hint;
+
+    double serial_us = 0;
+    for (unsigned num_threads = 1; num_threads <= std::max(max_threads, 1u);
+         num_threads *= 2) {
+      ParityBitmapSketch bob(d);
+      bob.setNumThreads(num_threads);
+      bob.add(common.begin(), common.end());
+      bob.encode();
+      std::vector<uint64_t> xors, checksums;
+      timer.restart();
+      bob.decode(*alice_enc, xors, checksums);
+      double us = timer.elapsed();
+      if (num_threads == 1) serial_us = us;
+      fmt::print("{:>10} {:>8} {:>14.1f} {:>10.2f}\n", d, num_threads, us,
+                 serial_us / us);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <random>
+#include <vector>
+
+#include "pbs.h"
+
+using namespace libpbs;
+
+/**
+ * Size benchmark for the first-round decoding message (the return path from
+ * Bob to Alice) in the fixed-width and the compact format, d = 10^3 .. 10^5.
+ * Bytes per difference count every decoded bin position.
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"PBS Decoding Message Format Benchmark"};
+  std::vector<size_t> diffs{1000, 10000, 100000};
+  app.add_option("-d,--diffs", diffs, "Cardinalities of the set difference");
+  size_t common_sz = 100000;
+  app.add_option("--common-size", common_sz, "Number of common elements");
+  unsigned seed = 20200802u;
+  app.add_option("--seed", seed, "Random seed");
+  CLI11_PARSE(app, argc, argv);
+
+  fmt::print("{:>8} {:>12} {:>14} {:>14} {:>12} {:>12} {:>8}\n", "d",
+             "positions", "fixed (B)", "compact (B)", "fixed B/d",
+             "compact B/d", "ratio");
+  for (size_t d : diffs) {
+    std::mt19937_64 gen(seed);
+    std::vector<uint64_t> common(common_sz), extra(d);
+    for (auto &key : common) key = gen();
+    for (auto &key : extra) key = gen();
+
+    ParityBitmapSketch alice(d), bob(d);
+    alice.add(common.begin(), common.end());
+    alice.add(extra.begin(), extra.end());
+    bob.add(common.begin(), common.end());
+    auto [alice_enc, alice_hint] = alice.encode();
+    (void)alice_hint;
+    bob.encode();
+    std::vector<uint64_t> xors, checksums;
+    auto msg = bob.decode(*alice_enc, xors, checksums);
+
+    size_t positions = msg->decoded_differences.size();
+    msg->format = PbsDecodingFormat::FIXED_WIDTH;
+    size_t fixed_bytes = msg->serializedSize();
+    msg->format = PbsDecodingFormat::COMPACT;
+    size_t compact_bytes = msg->serializedSize();
+    fmt::print("{:>8} {:>12} {:>14} {:>14} {:>12.3f} {:>12.3f} {:>8.3f}\n", d,
+               positions, fixed_bytes, compact_bytes,
+               double(fixed_bytes) / positions,
+               double(compact_bytes) / positions,
+               double(compact_bytes) / fixed_bytes);
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "SimpleTimer.h"
+#include "bench_utils.h"
+#include "pbs.h"
+
+using namespace libpbs;
+using only_for_benchmark::SimpleTimer;
+
+/**
+ * Scaling benchmark for ParityBitmapSketch::encode(): the same sketch is
+ * encoded with 1, 2, 4, ... threads and the speedup against the serial path is
+ * reported. Adding the elements one by one and in bulk is timed as well,
+ * together with the memory held by the element groups (resident memory
+ * growth over add() and encode()), and so is restoring an encoded sketch
+ * from a snapshot file.
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"PBS Encoding Benchmark"};
+  size_t d = 100000;
+  app.add_option("-d,--diffs", d, "Cardinality of the set difference");
+  size_t set_sz = 1000000;
+  app.add_option("--set-size", set_sz, "Number of elements in the set");
+  unsigned max_threads = std::thread::hardware_concurrency();
+  app.add_option("--max-threads", max_threads, "Largest number of threads");
+  size_t repeats = 5;
+  app.add_option("--repeats", repeats, "Repeats for each number of threads");
+  unsigned seed = 20200721u;
+  app.add_option("--seed", seed, "Random seed");
+  CLI11_PARSE(app, argc, argv);
+
+  std::mt19937_64 gen(seed);
+  std::vector<uint64_t> keys(set_sz);
+  for (auto &key : keys) key = gen();
+
+  SimpleTimer timer;
+  for (int bulk = 0; bulk < 2; ++bulk) {
+    ParityBitmapSketch pbs(d);
+    auto rss_before = only_for_benchmark::ResidentMemoryKB();
+    timer.restart();
+    if (bulk)
+      pbs.add(keys.data(), keys.size());
+    else
+      for (auto key : keys) pbs.add(key);
+    double add_us = timer.elapsed();
+    pbs.encode();
+    double us = timer.elapsed();
+    auto rss_after = only_for_benchmark::ResidentMemoryKB();
+    fmt::print(
+        "{} add: {:.1f} us ({:.1f} MB/s), add + encode: {:.1f} us, memory "
+        "growth: {} KB\n",
+        bulk ? "bulk" : "single", add_us,
+        keys.size() * sizeof(uint64_t) / add_us, us, rss_after - rss_before);
+  }
+
+  {
+    const std::string path = "pbs_snapshot_bench.bin";
+    ParityBitmapSketch pbs(d);
+    pbs.add(keys.data(), keys.size());
+    pbs.encode();
+    timer.restart();
+    pbs.save(path);
+    double save_us = timer.elapsed();
+    timer.restart();
+    auto restored = ParityBitmapSketch::load(path);
+    auto [enc, hint] = restored.encode();
+    double load_us = timer.elapsed();
+    (void)hint;
+    fmt::print("snapshot save: {:.1f} us, load + first encode: {:.1f} us\n",
+               save_us, load_us);
+    std::remove(path.c_str());
+  }
+
+  double serial_us = 0;
+  fmt::print("{:>8} {:>14} {:>10}\n", "threads", "encode (us)", "speedup");
+  for (unsigned num_threads = 1; num_threads <= std::max(max_threads, 1u);
+       num_threads *= 2) {
+    double total_us = 0;
+    for (size_t k = 0; k < repeats; ++k) {
+      ParityBitmapSketch pbs(d);
+      pbs.setNumThreads(num_threads);
+      pbs.add(keys.data(), keys.size());
+      timer.restart();
+      auto [enc, hint] = pbs.encode();
+      total_us += timer.elapsed();
+      (void)hint;
+    }
+    double avg_us = total_us / repeats;
+    if (num_threads == 1) serial_us = avg_us;
+    fmt::print("{:>8} {:>14.1f} {:>10.2f}\n", num_threads, avg_us,
+               serial_us / avg_us);
+  }
+  return 0;
+}
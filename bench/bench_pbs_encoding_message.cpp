@@ -0,0 +1,116 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "SimpleTimer.h"
+#include "pbs_encoding_message.h"
+#include "pbs_params.h"
+
+using namespace libpbs;
+using only_for_benchmark::SimpleTimer;
+
+namespace {
+// the previous write_bad(): serialize into a temporary buffer, copy the whole
+// bytes and the remaining bits one sketch at a time
+void LegacyWrite(const PbsEncodingMessage &msg, uint8_t *to) {
+  uint32_t sketch_sz = msg.field_sz * msg.capacity;
+  uint32_t sketch_bytes = sketch_sz / 8, remainder = sketch_sz % 8;
+  std::fill(to, to + msg.serializedSize(), 0);
+  auto *buf = (uint8_t *)malloc(sketch_bytes + 1);
+  utils::BitWriter writer(to + sketch_bytes * msg.num_groups);
+  for (uint32_t i = 0; i < msg.num_groups; ++i) {
+    memset(buf, 0, sketch_bytes + 1);
+    minisketch_serialize(msg.getSketches()[i], buf);
+    memcpy(to + i * sketch_bytes, buf, sketch_bytes);
+    writer.Write<uint8_t>(buf[sketch_bytes], remainder);
+  }
+  writer.Flush();
+  free(buf);
+}
+
+// the previous parse_bad()
+void LegacyParse(PbsEncodingMessage &msg, const uint8_t *from) {
+  uint32_t sketch_sz = msg.field_sz * msg.capacity;
+  uint32_t sketch_bytes = sketch_sz / 8, remainder = sketch_sz % 8;
+  auto *buf = (uint8_t *)malloc(sketch_bytes + 1);
+  utils::BitReader reader(from + sketch_bytes * msg.num_groups);
+  for (uint32_t i = 0; i < msg.num_groups; ++i) {
+    memcpy(buf, from + i * sketch_bytes, sketch_bytes);
+    buf[sketch_bytes] = reader.Read<uint8_t>(remainder);
+    minisketch_deserialize(msg.getSketches()[i], buf);
+  }
+  free(buf);
+}
+}  // namespace
+
+/**
+ * Round-trip throughput benchmark (MB/s of serialized message) of encoding
+ * messages for every (m, t) pair pbsutils::PbsParam::bestBchParam() can
+ * return (m in [M_MIN, M_MAX], t in [m, min(MAX_BALLS, 2^m - 2, 5 delta)]).
+ * Pairs with m * t not a multiple of 8 compare the in-place writer and the
+ * stack-buffer parser against the previous malloc-and-BitWriter versions.
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"PBS Encoding Message Round-Trip Benchmark"};
+  size_t num_groups = 2000;
+  app.add_option("-g,--groups", num_groups, "Number of groups per message");
+  double delta = 5;
+  app.add_option("--delta", delta,
+                 "Average number of differences per group");
+  size_t repeats = 20;
+  app.add_option("-r,--repeats", repeats, "Round trips per (m, t) pair");
+  unsigned seed = 20200803u;
+  app.add_option("--seed", seed, "Random seed");
+  CLI11_PARSE(app, argc, argv);
+
+  SimpleTimer timer;
+  std::mt19937_64 gen(seed);
+  fmt::print("{:>4} {:>4} {:>10} {:>14} {:>14} {:>14} {:>14}\n", "m", "t",
+             "bytes", "old write", "new write", "old parse", "new parse");
+  for (size_t m = pbsutils::M_MIN; m <= pbsutils::M_MAX; ++m) {
+    size_t t_max = std::min(pbsutils::MAX_BALLS,
+                            std::min((size_t(1) << m) - 2,
+                                     size_t(std::ceil(5 * delta))));
+    for (size_t t = m; t <= t_max; ++t) {
+      PbsEncodingMessage msg(m, t, num_groups);
+      for (auto sketch : msg.getSketches())
+        for (int i = 0; i < 5; ++i)
+          minisketch_add_uint64(sketch, 1 + gen() % ((1u << m) - 1));
+      PbsEncodingMessage parsed(m, t, num_groups);
+      std::vector<uint8_t> buf(msg.serializedSize()), legacy(buf.size());
+      double mb = buf.size() * repeats / 1e6;
+      bool aligned = m * t % 8 == 0;
+
+      timer.restart();
+      for (size_t r = 0; r < repeats; ++r) msg.write(buf.data());
+      double write_us = timer.elapsed();
+      timer.restart();
+      for (size_t r = 0; r < repeats; ++r) parsed.parse(buf.data(), buf.size());
+      double parse_us = timer.elapsed();
+
+      if (aligned) {
+        fmt::print("{:>4} {:>4} {:>10} {:>14} {:>14.1f} {:>14} {:>14.1f}\n", m,
+                   t, buf.size(), "-", mb / write_us * 1e6, "-",
+                   mb / parse_us * 1e6);
+        continue;
+      }
+      timer.restart();
+      for (size_t r = 0; r < repeats; ++r) LegacyWrite(msg, legacy.data());
+      double legacy_write_us = timer.elapsed();
+      timer.restart();
+      for (size_t r = 0; r < repeats; ++r) LegacyParse(parsed, legacy.data());
+      double legacy_parse_us = timer.elapsed();
+      if (legacy != buf) fmt::print("layout mismatch: m {}, t {}\n", m, t);
+
+      fmt::print("{:>4} {:>4} {:>10} {:>14.1f} {:>14.1f} {:>14.1f} {:>14.1f}\n",
+                 m, t, buf.size(), mb / legacy_write_us * 1e6,
+                 mb / write_us * 1e6, mb / legacy_parse_us * 1e6,
+                 mb / parse_us * 1e6);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include <CLI/CLI.hpp>
+#include <boost/filesystem.hpp>
+#include <thread>
+#include <vector>
+
+#include "SimpleTimer.h"
+#include "pbs_params.h"
+
+using only_for_benchmark::SimpleTimer;
+using pbsutils::BestBchParam;
+using pbsutils::PbsParam;
+
+/**
+ * Cold-path benchmark of the BCH parameter search: for each number of
+ * threads, PbsParam::searchBchParam() is run for every d with empty memory
+ * and disk caches (the benchmark works in a scratch directory, so the disk
+ * cache it clears is its own). The parameters found are checked to be the
+ * same for every number of threads.
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"PBS Parameter Search Benchmark"};
+  std::vector<size_t> ds{100, 1000, 10000};
+  app.add_option("-d,--diffs", ds, "Cardinalities of the set difference");
+  double delta = 5;
+  app.add_option("--delta", delta,
+                 "Average number of differences per group");
+  size_t r = 3;
+  app.add_option("-r,--rounds", r, "Maximum number of rounds");
+  size_t c = 3;
+  app.add_option("-c,--groups-when-bch-fail", c,
+                 "Number of groups to partition when BCH decoding failed");
+  double target = 0.99;
+  app.add_option("--target", target, "Target success probability");
+  std::vector<unsigned> thread_counts{1, 2, 4, 0};
+  app.add_option("-t,--threads", thread_counts,
+                 "Numbers of threads (0 for all hardware threads)");
+  CLI11_PARSE(app, argc, argv);
+
+  // the disk cache is DEFAULT_CACHE_DIR ("../cache/") relative to the scratch
+  // directory's "bin"
+  auto scratch = boost::filesystem::temp_directory_path() /
+                 boost::filesystem::unique_path("pbs-param-search-%%%%-%%%%");
+  boost::filesystem::create_directories(scratch / "bin");
+  if (chdir((scratch / "bin").c_str()) != 0) {
+    fmt::print(stderr, "Failed to enter {}\n", scratch.string());
+    return 1;
+  }
+
+  fmt::print("hardware threads: {}\n", std::thread::hardware_concurrency());
+  fmt::print("{:>8} {:>8} {:>4} {:>4} {:>12} {:>10}\n", "d", "threads", "m",
+             "t", "time (ms)", "speedup");
+  SimpleTimer timer;
+  for (size_t d : ds) {
+    double serial_us = 0;
+    BestBchParam first{};
+    for (size_t k = 0; k < thread_counts.size(); ++k) {
+      boost::filesystem::remove_all(scratch / "cache");
+      pbsutils::get_disk_cache().reopen();
+      BestBchParam param{};
+      timer.restart();
+      PbsParam::searchBchParam(d, delta, r, c, target, param,
+                               thread_counts[k]);
+      double us = timer.elapsed();
+      if (k == 0) {
+        serial_us = us;
+        first = param;
+      } else if (param.m != first.m || param.t != first.t) {
+        fmt::print("parameters differ: d {}, threads {}\n", d,
+                   thread_counts[k]);
+      }
+      fmt::print("{:>8} {:>8} {:>4} {:>4} {:>12.1f} {:>10.2f}\n", d,
+                 libpbs::utils::ResolveNumThreads(thread_counts[k]), param.m,
+                 param.t, us / 1e3, serial_us / us);
+    }
+  }
+  boost::filesystem::remove_all(scratch);
+  return 0;
+}
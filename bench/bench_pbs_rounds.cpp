@@ -0,0 +1,101 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "SimpleTimer.h"
+#include "pbs.h"
+#include "sketch_pool.h"
+
+using namespace libpbs;
+using only_for_benchmark::SimpleTimer;
+
+namespace {
+// number of heap allocations made so far (by any thread)
+std::atomic<size_t> num_allocations{0};
+}  // namespace
+
+// out of line, so that the compiler does not pair the free() calls below with
+// new-expressions it can see through
+[[gnu::noinline]] void *operator new(size_t sz) {
+  ++num_allocations;
+  if (void *ptr = std::malloc(sz == 0 ? 1 : sz)) return ptr;
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+[[gnu::noinline]] void operator delete(void *ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+/**
+ * Allocation benchmark for the rounds of PBS: the same pair of sets is
+ * reconciled several times, with every encoding message written to a buffer
+ * and parsed on the other side. For each round, the number of sketches the
+ * pool had to create and the number of heap allocations (operator new) made by
+ * encoding, serializing, parsing and decoding are reported. Once the pool is
+ * warm, no sketch should be created.
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"PBS Allocations per Round Benchmark"};
+  size_t d = 1000;
+  app.add_option("-d,--diffs", d, "Cardinality of the set difference");
+  size_t common_sz = 100000;
+  app.add_option("--common-size", common_sz, "Number of common elements");
+  size_t reconciliations = 3;
+  app.add_option("--reconciliations", reconciliations,
+                 "Number of times to reconcile the sets");
+  unsigned seed = 20200721u;
+  app.add_option("--seed", seed, "Random seed");
+  CLI11_PARSE(app, argc, argv);
+
+  std::mt19937_64 gen(seed);
+  std::vector<uint64_t> alice_keys(common_sz), bob_keys;
+  for (auto &key : alice_keys) key = gen();
+  bob_keys = alice_keys;
+  for (size_t i = 0; i < d; ++i)
+    (i % 2 ? alice_keys : bob_keys).push_back(gen());
+
+  auto &pool = utils::SketchPool::Global();
+  SimpleTimer timer;
+  fmt::print("{:>8} {:>6} {:>18} {:>18} {:>12}\n", "reconc.", "round",
+             "sketches created", "heap allocations", "time (us)");
+  for (size_t r = 1; r <= reconciliations; ++r) {
+    ParityBitmapSketch alice(d), bob(d);
+    alice.add(alice_keys.data(), alice_keys.size());
+    bob.add(bob_keys.data(), bob_keys.size());
+    std::vector<uint64_t> xors, checksums;
+    std::vector<uint8_t> buffer;
+    bool done = false;
+    for (size_t round = 1; !done; ++round) {
+      size_t created = pool.numCreated(), allocations = num_allocations;
+      timer.restart();
+      auto [enc, hint] = alice.encode();
+      buffer.resize(enc->serializedSize());
+      enc->write(buffer.data());
+      if (round == 1) {
+        bob.encode();
+      } else {
+        std::vector<uint32_t> no_exceptions;
+        const auto &groups =
+            hint ? hint->groups_with_exceptions : no_exceptions;
+        bob.encodeWithHint(groups.begin(), groups.end());
+      }
+      PbsEncodingMessage received(enc->field_sz, enc->capacity,
+                                  enc->num_groups);
+      received.parse(buffer.data(), buffer.size());
+      auto dec = bob.decode(received, xors, checksums);
+      done = alice.decodeCheck(*dec, xors, checksums);
+      double us = timer.elapsed();
+      fmt::print("{:>8} {:>6} {:>18} {:>18} {:>12.1f}\n", r, round,
+                 pool.numCreated() - created, num_allocations - allocations,
+                 us);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <random>
+#include <vector>
+
+#include "SimpleTimer.h"
+#include "syndrome_encoder.h"
+
+using namespace libpbs::utils;
+using only_for_benchmark::SimpleTimer;
+
+/**
+ * Encoding benchmark for BCH sketches of parity bitmaps, m = 6 .. 14: adding
+ * every odd bin with minisketch_add_uint64() (what PBS used to do) against
+ * SyndromeEncoder (syndromes from the bitmap, then loaded into the sketch).
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"BCH Syndrome Encoder Benchmark"};
+  uint32_t t = 8;
+  app.add_option("-t,--capacity", t, "BCH capacity");
+  size_t num_bins_set = 50;
+  app.add_option("--bins-set", num_bins_set, "Odd bins per bitmap");
+  size_t num_bitmaps = 10000;
+  app.add_option("--bitmaps", num_bitmaps, "Number of bitmaps to encode");
+  unsigned seed = 20200731u;
+  app.add_option("--seed", seed, "Random seed");
+  CLI11_PARSE(app, argc, argv);
+
+  SimpleTimer timer;
+  fmt::print("{:>4} {:>18} {:>18} {:>10}\n", "m", "minisketch (us)",
+             "encoder (us)", "speedup");
+  for (uint32_t m = 6; m <= 14; ++m) {
+    uint32_t n = (1u << m) - 1u;
+    std::mt19937_64 gen(seed);
+    std::vector<uint8_t> bitmaps(num_bitmaps * n, 0);
+    for (size_t i = 0; i < num_bitmaps; ++i)
+      for (size_t k = 0; k < num_bins_set; ++k)
+        bitmaps[i * n + 1 + gen() % (n - 1)] ^= 1u;
+
+    minisketch *sketch = minisketch_create(m, 0, t);
+    std::vector<uint8_t> buf(minisketch_serialized_size(sketch));
+    timer.restart();
+    for (size_t i = 0; i < num_bitmaps; ++i) {
+      const uint8_t *bitmap = &bitmaps[i * n];
+      for (uint64_t k = 0; k < n; ++k)
+        if (bitmap[k]) minisketch_add_uint64(sketch, k);
+    }
+    double minisketch_us = timer.elapsed();
+
+    SyndromeEncoder encoder(m, t);
+    std::vector<uint16_t> syndromes(t);
+    timer.restart();
+    for (size_t i = 0; i < num_bitmaps; ++i) {
+      encoder.encode(&bitmaps[i * n], n, syndromes.data());
+      encoder.load(syndromes.data(), buf.data(), sketch);
+    }
+    double encoder_us = timer.elapsed();
+    minisketch_destroy(sketch);
+
+    fmt::print("{:>4} {:>18.1f} {:>18.1f} {:>10.2f}\n", m, minisketch_us,
+               encoder_us, minisketch_us / encoder_us);
+  }
+  return 0;
+}
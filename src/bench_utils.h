@@ -1,6 +1,9 @@
 #ifndef BENCH_UTILS_H_
 #define BENCH_UTILS_H_
+#include <unistd.h>
+
 #include <cstring>
+#include <fstream>
 #include <iterator>
 #include <random>
 #include <string>
@@ -78,5 +81,17 @@ inline bool is_equal(const HashMapContainer &a, const HashMapContainer &b) {
   return true;
 }
 
+/**
+ * @brief Resident memory of this process (Linux only)
+ *
+ * @return    resident set size in KB, 0 if unavailable
+ */
+inline size_t ResidentMemoryKB() {
+  std::ifstream statm("/proc/self/statm");
+  size_t total_pages = 0, resident_pages = 0;
+  if (!(statm >> total_pages >> resident_pages)) return 0;
+  return resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 }  // end namespace only_for_benchmark
 #endif  // BENCH_UTILS_H_
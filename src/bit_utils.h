@@ -3,6 +3,8 @@
 #define _BIT_UTILS_H_
 
 #include <cinttypes>
+#include <cstring>
+#include <stdexcept>
 #include <type_traits>
 #include <cmath>
 #include <tsl/ordered_set.h>
@@ -10,6 +12,9 @@
 namespace libpbs::utils {
 namespace constants {
 constexpr std::size_t BITS_IN_ONE_BYTE = 8;
+// longest unary quotient of a Golomb-Rice code; larger quotients are escaped
+// and followed by the value in 64 bits
+constexpr unsigned RICE_ESCAPE = 24;
 }
 
 inline uint32_t UIntXMax(uint32_t bits) { return (1u << bits) - 1u; }
@@ -112,6 +117,270 @@ class BitReader {
     return val;
   }
 };
+
+/**
+ * @brief Convert between native and little-endian byte order
+ */
+template <typename UInteger>
+inline UInteger ToLittleEndian(UInteger val) {
+  static_assert(std::is_unsigned_v<UInteger>, "UInteger must be unsigned");
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  if constexpr (sizeof(UInteger) == 2) return __builtin_bswap16(val);
+  if constexpr (sizeof(UInteger) == 4) return __builtin_bswap32(val);
+  if constexpr (sizeof(UInteger) == 8) return __builtin_bswap64(val);
+#endif
+  return val;
+}
+
+/**
+ * @brief Bit packer writing the same stream as BitWriter, 64 bits at a time
+ *
+ * Values are collected in a 64-bit accumulator which is stored with a single
+ * unaligned 8-byte store whenever it is full, so a value costs a shift, an OR
+ * and (rarely) a store, regardless of its width. WriteN() packs a whole array;
+ * for byte-sized widths on a byte boundary it degenerates into a narrowing
+ * copy which compilers vectorize.
+ *
+ * Unlike BitWriter, the packer knows the size of its buffer and throws
+ * std::length_error instead of writing past its end.
+ */
+class BitPacker {
+ public:
+  /**
+   * @brief Constructor
+   *
+   * @param output      buffer to write
+   * @param size        size of the buffer (in bytes)
+   */
+  BitPacker(uint8_t *output, size_t size)
+      : begin_(output), out_(output), end_(output + size) {}
+
+  /**
+   * @brief Append the lowest `bits` bits of `val`
+   *
+   * @param val     value to write
+   * @param bits    number of bits (0 .. 64)
+   */
+  inline void Write(uint64_t val, unsigned bits) {
+    if (bits == 0) return;
+    if (bits < 64) val &= (uint64_t(1) << bits) - 1;
+    acc_ |= val << num_bits_;
+    num_bits_ += bits;
+    if (num_bits_ >= 64) {
+      store_(acc_);
+      num_bits_ -= 64;
+      // bits of `val` that did not fit into the full accumulator
+      acc_ = num_bits_ > 0 ? val >> (bits - num_bits_) : 0;
+    }
+  }
+
+  /**
+   * @brief Append a Golomb-Rice code of `val`
+   *
+   * The quotient `val >> k` is written in unary (ones ended by a zero) and
+   * the remainder in `k` bits. Quotients of constants::RICE_ESCAPE or more
+   * are written as RICE_ESCAPE ones followed by `val` itself in 64 bits.
+   *
+   * @param val     value to write
+   * @param k       Rice parameter (0 .. 63)
+   */
+  inline void WriteRice(uint64_t val, unsigned k) {
+    uint64_t q = val >> k;
+    if (q >= constants::RICE_ESCAPE) {
+      Write((uint64_t(1) << constants::RICE_ESCAPE) - 1,
+            constants::RICE_ESCAPE);
+      Write(val, 64);
+      return;
+    }
+    // q ones and the terminating zero in one go
+    Write((uint64_t(1) << q) - 1, q + 1);
+    Write(val, k);
+  }
+
+  /**
+   * @brief Number of bits WriteRice() spends on `val`
+   *
+   * @param val     value to write
+   * @param k       Rice parameter (0 .. 63)
+   * @return        number of bits
+   */
+  static inline size_t RiceBits(uint64_t val, unsigned k) {
+    uint64_t q = val >> k;
+    if (q >= constants::RICE_ESCAPE) return constants::RICE_ESCAPE + 64;
+    return q + 1 + k;
+  }
+
+  /**
+   * @brief Append `n` values of `bits` bits each
+   *
+   * @tparam UInteger   unsigned integer type
+   * @param values      values to write
+   * @param n           number of values
+   * @param bits        number of bits for each value (0 .. 64)
+   */
+  template <typename UInteger>
+  void WriteN(const UInteger *values, size_t n, unsigned bits) {
+    if (num_bits_ == 0) {
+      switch (bits) {
+        case 8: return copyNarrowed_<uint8_t>(values, n);
+        case 16: return copyNarrowed_<uint16_t>(values, n);
+        case 32: return copyNarrowed_<uint32_t>(values, n);
+        case 64: return copyNarrowed_<uint64_t>(values, n);
+        default: break;
+      }
+    }
+    for (size_t i = 0; i < n; ++i) Write(values[i], bits);
+  }
+
+  /**
+   * @brief Write out the pending bits (the last byte is zero-padded)
+   */
+  inline void Flush() {
+    size_t bytes = Bits2Bytes(num_bits_);
+    if (out_ + bytes > end_) throw std::length_error("BitPacker: buffer full");
+    for (size_t i = 0; i < bytes; ++i) *out_++ = uint8_t(acc_ >> (8 * i));
+    acc_ = 0;
+    num_bits_ = 0;
+  }
+
+  // number of bytes written so far (complete only after Flush())
+  [[nodiscard]] size_t BytesWritten() const noexcept { return out_ - begin_; }
+
+ private:
+  inline void store_(uint64_t word) {
+    if (out_ + sizeof(word) > end_)
+      throw std::length_error("BitPacker: buffer full");
+    word = ToLittleEndian(word);
+    std::memcpy(out_, &word, sizeof(word));
+    out_ += sizeof(word);
+  }
+
+  template <typename Narrow, typename UInteger>
+  void copyNarrowed_(const UInteger *values, size_t n) {
+    if (out_ + n * sizeof(Narrow) > end_)
+      throw std::length_error("BitPacker: buffer full");
+    for (size_t i = 0; i < n; ++i) {
+      auto v = ToLittleEndian(static_cast<Narrow>(values[i]));
+      std::memcpy(out_ + i * sizeof(Narrow), &v, sizeof(Narrow));
+    }
+    out_ += n * sizeof(Narrow);
+  }
+
+  uint8_t *begin_;
+  uint8_t *out_;
+  uint8_t *end_;
+  uint64_t acc_ = 0;
+  unsigned num_bits_ = 0;
+};
+
+/**
+ * @brief Bit unpacker for streams written by BitWriter or BitPacker
+ *
+ * Each value is extracted from one unaligned 8-byte load at its byte
+ * position, so there is no per-byte loop or carried state besides the bit
+ * position. Bytes past the end of the buffer read as zero. ReadN() unpacks a
+ * whole array, with a vectorizable widening copy for byte-sized widths on a
+ * byte boundary.
+ */
+class BitUnpacker {
+ public:
+  /**
+   * @brief Constructor
+   *
+   * @param input       buffer to read
+   * @param size        size of the buffer (in bytes)
+   */
+  BitUnpacker(const uint8_t *input, size_t size) : in_(input), size_(size) {}
+
+  /**
+   * @brief Read the next `bits` bits
+   *
+   * @param bits    number of bits (0 .. 64)
+   * @return        the value
+   */
+  inline uint64_t Read(unsigned bits) {
+    if (bits == 0) return 0;
+    // a load at any bit offset holds at least 57 bits
+    if (bits > 56) {
+      uint64_t low = Read(32);
+      return low | (Read(bits - 32) << 32u);
+    }
+    uint64_t word = load_(pos_ >> 3u) >> (pos_ & 7u);
+    pos_ += bits;
+    return word & ((uint64_t(1) << bits) - 1);
+  }
+
+  /**
+   * @brief Read a value written by BitPacker::WriteRice()
+   *
+   * @param k       Rice parameter (0 .. 63)
+   * @return        the value
+   */
+  inline uint64_t ReadRice(unsigned k) {
+    // the unary part is at most RICE_ESCAPE ones, so one load covers it
+    uint64_t word = load_(pos_ >> 3u) >> (pos_ & 7u);
+    unsigned q = ~word == 0 ? 64 : __builtin_ctzll(~word);
+    if (q >= constants::RICE_ESCAPE) {
+      pos_ += constants::RICE_ESCAPE;
+      return Read(64);
+    }
+    pos_ += q + 1;
+    return (uint64_t(q) << k) | Read(k);
+  }
+
+  /**
+   * @brief Read `n` values of `bits` bits each
+   *
+   * @tparam UInteger   unsigned integer type (wide enough for `bits`)
+   * @param values      where to store the values
+   * @param n           number of values
+   * @param bits        number of bits for each value (0 .. 64)
+   */
+  template <typename UInteger>
+  void ReadN(UInteger *values, size_t n, unsigned bits) {
+    if ((pos_ & 7u) == 0 && (pos_ >> 3u) + n * bits / 8 <= size_) {
+      switch (bits) {
+        case 8: return copyWidened_<uint8_t>(values, n);
+        case 16: return copyWidened_<uint16_t>(values, n);
+        case 32: return copyWidened_<uint32_t>(values, n);
+        case 64: return copyWidened_<uint64_t>(values, n);
+        default: break;
+      }
+    }
+    for (size_t i = 0; i < n; ++i)
+      values[i] = static_cast<UInteger>(Read(bits));
+  }
+
+  // number of bits read so far
+  [[nodiscard]] size_t BitsRead() const noexcept { return pos_; }
+
+ private:
+  inline uint64_t load_(size_t byte) const {
+    uint64_t word = 0;
+    if (byte + sizeof(word) <= size_) {
+      std::memcpy(&word, in_ + byte, sizeof(word));
+      return ToLittleEndian(word);
+    }
+    for (size_t i = 0; byte + i < size_ && i < sizeof(word); ++i)
+      word |= uint64_t(in_[byte + i]) << (8 * i);
+    return word;
+  }
+
+  template <typename Narrow, typename UInteger>
+  void copyWidened_(UInteger *values, size_t n) {
+    const uint8_t *from = in_ + (pos_ >> 3u);
+    for (size_t i = 0; i < n; ++i) {
+      Narrow v;
+      std::memcpy(&v, from + i * sizeof(Narrow), sizeof(Narrow));
+      values[i] = static_cast<UInteger>(ToLittleEndian(v));
+    }
+    pos_ += n * sizeof(Narrow) * 8;
+  }
+
+  const uint8_t *in_;
+  size_t size_;
+  size_t pos_ = 0;
+};
 }  // namespace libpbs
 
 #endif  // BIT_UTILS_H_
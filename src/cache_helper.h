@@ -1,133 +1,325 @@
 #ifndef CACHE_HELPER_H_
 #define CACHE_HELPER_H_
 
+#include <fcntl.h>
 #include <fmt/format.h>
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
-#include <boost/filesystem.hpp>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <array>
-#include <fstream>
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <cstring>
+#include <eigen3/Eigen/Dense>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <string>
-
-#include "eigen_boost_serialization.hpp"
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-variable"
-#include <stlcache/stlcache.hpp>
-#pragma GCC diagnostic pop
+#include <unordered_map>
+#include <vector>
 
 #define YELLOW "\033[33m" /* Yellow */
 #define DEFAULT_CACHE_DIR "../cache/"
 
 /// constants and functions that will not exposed
 namespace {
-const char* cache_file_pat_ = "multiple_round_m2d_{}_{}_{}_{}.eigen3";
-constexpr unsigned max_cache_ = 1024;
-inline void make_sure_cache_dir_exists() {
-  boost::filesystem::path dir(DEFAULT_CACHE_DIR);
-  if (!boost::filesystem::exists(dir)) boost::filesystem::create_directories(dir);
-}
+const char* cache_file_name_ = "multiple_round_m2d.cache";
 }  // namespace
 
 /// utility functions to be exposed
 namespace pbsutils {
 using key_t = std::array<size_t, 4>;
 using value_t = Eigen::MatrixXd;
-using cache_t = stlcache::cache<key_t, value_t, stlcache::policy_lru>;
 
 /**
- * @brief Get memory cache
+ * @brief Append-only store of matrices in one memory-mapped file
  *
- * @return  memory cache
- */
-inline cache_t& get_memcache() {
-  static cache_t _my_memcache(max_cache_);
-  return _my_memcache;
-}
-
-/**
- * @brief Write memory cache
+ * The file is a sequence of records, each a header (magic, key, rows, cols)
+ * followed by the raw column-major doubles. The headers are the index: they
+ * are read once when the store is opened, then only those of the records
+ * appended since (by this or another process). Lookups return an Eigen::Map
+ * over the mapping, so a cached matrix is neither deserialized nor copied.
  *
- * @param key       key value associated with the element to cache
- * @param val       element to cache
- */
-inline void memcache_write(const key_t& key, const value_t& val) {
-  get_memcache().insert(key, val);
-}
-
-/**
- * @brief  Check memory cache
+ * A record never changes once it is complete, so views stay valid for the
+ * lifetime of the store. Appenders hold an exclusive flock() and write the
+ * magic of a record last, and readers scan under a shared one, so a
+ * half-written record (e.g., of a crashed writer) is never indexed and is
+ * overwritten by the next append. A file that cannot be created or written
+ * only disables it: matrices are still kept in memory. The store is
+ * thread-safe, lookups of indexed keys share the lock.
  *
- * @param key      key value of the element to check for
- * @return         whether an element associated with this key exists
+ * The file is mapped in windows of at least MAP_WINDOW_BYTES_, reaching past
+ * its end, so records appended later usually land in the current window and
+ * need no new mapping. Since views have to stay valid, windows are only
+ * unmapped when the store is destroyed: a long-lived process keeps the whole
+ * file (and one window per reopen()) mapped, i.e., address space grows with
+ * the file. The file only grows with the distinct matrices in use.
  */
-inline bool memcache_check(const key_t& key) {
-  return get_memcache().check(key);
-}
+class MappedMatrixStore {
+ public:
+  using view_t = Eigen::Map<const value_t>;
 
-/**
- * @brief Fetch memory cache
- *
- * Note that please make sure the element associated with this key do exist
- * (using memcache_check) before calling this function.
- *
- * @param key   key value of the element to fetch for
- * @return      the element associated with this key
- */
-inline value_t memcache_fetch(const key_t& key) {
-  return get_memcache().fetch(key);
-}
+  /**
+   * @brief Constructor (the file is opened on first use)
+   *
+   * @param path    path of the cache file
+   */
+  explicit MappedMatrixStore(std::string path) : path_(std::move(path)) {}
+
+  MappedMatrixStore(const MappedMatrixStore&) = delete;
+  MappedMatrixStore& operator=(const MappedMatrixStore&) = delete;
+
+  ~MappedMatrixStore() {
+    for (const auto& mapping : mappings_)
+      ::munmap(mapping.first, mapping.second);
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  /**
+   * @brief Look up a matrix
+   *
+   * @param key   key value of the matrix to look up
+   * @return      view of the matrix, if found
+   */
+  std::optional<view_t> find(const key_t& key) {
+    {  // indexed keys only share the lock
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      auto it = index_.find(key);
+      if (it != index_.end()) return view_(it->second);
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    open_();
+    if (fd_ >= 0) {  // appended by another process since?
+      ::flock(fd_, LOCK_SH);
+      scan_();
+      ::flock(fd_, LOCK_UN);
+    }
+    auto it = index_.find(key);
+    if (it == index_.end()) return std::nullopt;
+    return view_(it->second);
+  }
+
+  /**
+   * @brief Store a matrix (appended to the file if the key is new)
+   *
+   * @param key   key value associated with the matrix
+   * @param val   matrix to store
+   * @return      view of the stored matrix (the one stored first, if the key
+   *              was already there)
+   */
+  view_t insert(const key_t& key, const value_t& val) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    open_();
+    if (fd_ >= 0 && writable_) {
+      ::flock(fd_, LOCK_EX);
+      scan_();
+      if (index_.find(key) == index_.end()) append_(key, val);
+      ::flock(fd_, LOCK_UN);
+    }
+    auto it = index_.find(key);
+    if (it == index_.end()) {  // no usable file
+      owned_.emplace_back(new double[val.size()]);
+      std::copy(val.data(), val.data() + val.size(), owned_.back().get());
+      it = index_.insert({key, {owned_.back().get(), size_t(val.rows()),
+                                size_t(val.cols())}})
+               .first;
+    }
+    return view_(it->second);
+  }
+
+  /**
+   * @brief Forget the index and open the file again on next use (e.g.,
+   * after it was removed); views handed out stay valid
+   */
+  void reopen() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+    opened_ = false;
+    writable_ = false;
+    scanned_ = 0;
+    window_ = nullptr;
+    window_base_ = window_end_ = 0;
+    index_.clear();
+  }
+
+ private:
+  // "PBSM2D" and the version of the layout
+  static constexpr uint64_t RECORD_MAGIC_ = 0x5042534D32440001ull;
+  // bounds for rows and cols of a header to be trusted
+  static constexpr uint64_t MAX_DIM_ = uint64_t(1) << 24u;
+  // minimum size of a mapping (address space only, nothing is read ahead)
+  static constexpr uint64_t MAP_WINDOW_BYTES_ = uint64_t(64) << 20u;
+
+  struct RecordHead {
+    uint64_t magic;
+    uint64_t key[4];
+    uint64_t rows;
+    uint64_t cols;
+  };
+
+  struct Location {
+    const double* data;
+    size_t rows;
+    size_t cols;
+  };
+
+  struct KeyHash {
+    size_t operator()(const key_t& key) const {
+      size_t h = 0;
+      for (size_t k : key) h = h * 0x9E3779B97F4A7C15ull + std::hash<size_t>{}(k);
+      return h;
+    }
+  };
+
+  static view_t view_(const Location& loc) {
+    return view_t(loc.data, loc.rows, loc.cols);
+  }
+
+  void open_() {
+    if (opened_) return;
+    opened_ = true;
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(
+        boost::filesystem::path(path_).parent_path(), ec);
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    writable_ = fd_ >= 0;
+    if (fd_ < 0) fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+
+  // maps and indexes the complete records after scanned_ (file locked)
+  void scan_() {
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) return;
+    uint64_t size = st.st_size;
+    if (size < scanned_ + sizeof(RecordHead)) return;
+    if (size > window_end_) {  // records past the current window
+      uint64_t page = ::sysconf(_SC_PAGESIZE);
+      uint64_t base = scanned_ / page * page;
+      uint64_t length = std::max(size - base, MAP_WINDOW_BYTES_);
+      void* addr = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd_, base);
+      if (addr == MAP_FAILED) return;
+      mappings_.emplace_back(addr, length);
+      window_ = static_cast<const uint8_t*>(addr);
+      window_base_ = base;
+      window_end_ = base + length;
+    }
+
+    uint64_t pos = scanned_;
+    while (pos + sizeof(RecordHead) <= size) {
+      RecordHead head;
+      std::memcpy(&head, window_ + (pos - window_base_), sizeof(head));
+      if (head.magic != RECORD_MAGIC_ || head.rows > MAX_DIM_ ||
+          head.cols > MAX_DIM_)
+        break;
+      uint64_t end =
+          pos + sizeof(head) + head.rows * head.cols * sizeof(double);
+      if (end > size) break;
+      index_.insert(
+          {{head.key[0], head.key[1], head.key[2], head.key[3]},
+           {reinterpret_cast<const double*>(window_ + (pos - window_base_) +
+                                            sizeof(head)),
+            head.rows, head.cols}});
+      pos = end;
+    }
+    scanned_ = pos;
+  }
+
+  // appends a record at the end of the complete ones (file locked)
+  void append_(const key_t& key, const value_t& val) {
+    RecordHead head{0, {key[0], key[1], key[2], key[3]},
+                    uint64_t(val.rows()), uint64_t(val.cols())};
+    size_t data_bytes = val.size() * sizeof(double);
+    uint64_t end = scanned_ + sizeof(head) + data_bytes;
+    // a failed write leaves the record unmarked, to be overwritten
+    if (pwrite_(&head, sizeof(head), scanned_) &&
+        pwrite_(val.data(), data_bytes, scanned_ + sizeof(head)) &&
+        ::ftruncate(fd_, end) == 0 &&
+        pwrite_(&RECORD_MAGIC_, sizeof(RECORD_MAGIC_), scanned_))
+      scan_();
+  }
+
+  bool pwrite_(const void* data, size_t n, uint64_t offset) {
+    const auto* from = static_cast<const uint8_t*>(data);
+    while (n > 0) {
+      ssize_t written = ::pwrite(fd_, from, n, offset);
+      if (written <= 0) return false;
+      from += written;
+      offset += written;
+      n -= written;
+    }
+    return true;
+  }
+
+  const std::string path_;
+  std::shared_mutex mutex_;
+  int fd_ = -1;
+  bool opened_ = false;
+  bool writable_ = false;
+  // end of the complete records indexed so far
+  uint64_t scanned_ = 0;
+  // the latest mapping, of the file range [window_base_, window_end_)
+  const uint8_t* window_ = nullptr;
+  uint64_t window_base_ = 0;
+  uint64_t window_end_ = 0;
+  // all mappings, released with the store
+  std::vector<std::pair<void*, size_t>> mappings_;
+  // matrices without a usable file
+  std::vector<std::unique_ptr<double[]>> owned_;
+  std::unordered_map<key_t, Location, KeyHash> index_;
+};
 
 /**
- * @brief Release the memory allocated for the memory cache
+ * @brief Get disk cache (DEFAULT_CACHE_DIR/multiple_round_m2d.cache)
  *
+ * @return  disk cache
  */
-inline void memcache_clear() {
-  get_memcache().clear();
+inline MappedMatrixStore& get_disk_cache() {
+  static auto* _my_disk_cache =
+      new MappedMatrixStore(std::string(DEFAULT_CACHE_DIR) + cache_file_name_);
+  return *_my_disk_cache;
 }
+
 /**
- * @brief Get the filename for disk cache
+ * @brief Look up disk cache, without copying the element
  *
- * @param key   key value of the element of which the filename to get
- * @return      filename for disk cache for the element associated with this key
+ * @param key   key value of the element to look up
+ * @return      view of the element, if found
  */
-inline std::string get_cache_filename(const key_t& key) {
-  make_sure_cache_dir_exists();
-  return std::string(DEFAULT_CACHE_DIR) +
-      fmt::format(cache_file_pat_, key[0], key[1], key[2], key[3]);
+inline std::optional<MappedMatrixStore::view_t> disk_cache_find(
+    const key_t& key) {
+  return get_disk_cache().find(key);
 }
 
 /**
- * @brief Save content to disk cache (file on disk)
+ * @brief Save content to disk cache
  *
  * @param key    key value associated with the element to cache
  * @param val    value to cache
+ * @return       view of the cached element
  */
-inline void save_cache(const key_t& key, const value_t& val) {
-  auto fn = get_cache_filename(key);
-  if (boost::filesystem::remove(fn)) {
-    std::cout << YELLOW << "Overwriting existing cache file\n";
-  }
-  std::ofstream fout(fn);
-  boost::archive::binary_oarchive ar(fout);
-  ar& val;
+inline MappedMatrixStore::view_t save_cache(const key_t& key,
+                                            const value_t& val) {
+  return get_disk_cache().insert(key, val);
 }
 
 /**
- * @brief Load cache from disk
+ * @brief Load cache from disk (a copy, see disk_cache_find())
  *
  * @param key  key value associated with the element to load
  * @param val  value to load
  * @return     whether an element associated with this key exists
  */
 inline bool load_cache(const key_t& key, value_t& val) {
-  auto fn = get_cache_filename(key);
-  std::ifstream fin(fn);
-  if (!fin.is_open()) return false;
-  boost::archive::binary_iarchive ar(fin);
-  ar& val;
+  auto view = get_disk_cache().find(key);
+  if (!view) return false;
+  val = *view;
   return true;
 }
 
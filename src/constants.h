@@ -14,6 +14,10 @@ constexpr unsigned RETIRES = 5;
 using Key = int32_t;
 using Value = std::string;
 
+/// share of the PBS failure budget left to false positives of its truncated
+/// checksums (both hosts derive the same checksum width from it)
+constexpr double PBS_CHECKSUM_FAILURE_SHARE = 0.1;
+
 /// make sure the estimate is at least as large as the
 /// ground truth with at least a probability of 0.99
 #define ESTIMATE_SM99(estimate) static_cast<size_t>(std::ceil((INFLATION_RATIO * estimate)))
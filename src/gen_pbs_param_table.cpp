@@ -0,0 +1,94 @@
+#include <fmt/format.h>
+
+#include <CLI/CLI.hpp>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "pbs_params.h"
+
+using pbsutils::BestBchParam;
+using pbsutils::PbsParam;
+
+namespace {
+// d = 1, 2, ..., dense_max, then growing by (at least) `ratio` up to max_d
+std::vector<size_t> MakeGrid(size_t dense_max, size_t max_d, double ratio) {
+  std::vector<size_t> grid;
+  for (size_t d = 1; d <= std::min(dense_max, max_d); ++d) grid.push_back(d);
+  while (!grid.empty() && grid.back() < max_d)
+    grid.push_back(std::min(
+        max_d, std::max(grid.back() + 1,
+                        size_t(std::ceil(grid.back() * ratio)))));
+  return grid;
+}
+}  // namespace
+
+/**
+ * Generator of the precomputed BCH parameter tables (pbs_param_table.inc,
+ * see pbs_param_table.h): runs PbsParam::searchBchParam() for every d of the
+ * grid and every target success probability, and writes the results as
+ * constexpr arrays. Doubles are written in hexadecimal, so the tables hold
+ * exactly what the search returns.
+ */
+int main(int argc, char **argv) {
+  CLI::App app{"PBS Parameter Table Generator"};
+  std::string output = "pbs_param_table.inc";
+  app.add_option("-o,--output", output, "File to write");
+  std::vector<double> targets{0.99, pbsutils::ONE_IN_240};
+  app.add_option("--target", targets, "Target success probabilities");
+  double delta = 5;
+  app.add_option("--delta", delta,
+                 "Average number of differences per group");
+  size_t r = 3;
+  app.add_option("-r,--rounds", r, "Maximum number of rounds");
+  size_t c = 3;
+  app.add_option("-c,--groups-when-bch-fail", c,
+                 "Number of groups to partition when BCH decoding failed");
+  size_t dense_max = 1000;
+  app.add_option("--dense-max", dense_max, "Largest d of the dense grid");
+  size_t max_d = 100000;
+  app.add_option("--max-d", max_d, "Largest d in the tables");
+  double ratio = 1.02;
+  app.add_option("--ratio", ratio, "Growth of d beyond the dense grid");
+  CLI11_PARSE(app, argc, argv);
+  if (targets.empty() || ratio <= 1) {
+    std::cerr << "Need at least one target and a ratio above 1\n";
+    return 1;
+  }
+
+  auto grid = MakeGrid(dense_max, max_d, ratio);
+  std::string out =
+      "// generated by gen_pbs_param_table, do not edit\n"
+      "// (make pbs_param_table regenerates it)\n"
+      "namespace pbsutils::param_table {\n";
+  std::string tables;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    out += fmt::format(
+        "// target {}, delta {}, r {}, c {}\n"
+        "inline constexpr PbsParamTableEntry ENTRIES_{}[] = {{\n",
+        targets[i], delta, r, c, i);
+    for (size_t d : grid) {
+      BestBchParam param{};
+      double ub =
+          PbsParam::searchBchParam(d, delta, r, c, targets[i], param);
+      out += fmt::format("    {{{}, {}, {}, {:a}}},\n", d, param.m, param.t,
+                         ub);
+      if (d % 100 == 0)
+        std::cerr << fmt::format("target {}: d = {}\n", targets[i], d);
+    }
+    out += "};\n";
+    tables += fmt::format("    {{{:a}, {:a}, {}, {}, ENTRIES_{}, {}}},\n",
+                          targets[i], delta, r, c, i, grid.size());
+  }
+  out += "inline constexpr PbsParamTable TABLES[] = {\n" + tables + "};\n" +
+         "}  // namespace pbsutils::param_table\n";
+
+  std::ofstream ofp(output);
+  if (!ofp.is_open()) {
+    std::cerr << "Failed to open file " << output << "\n";
+    return 1;
+  }
+  ofp << out;
+  return ofp.good() ? 0 : 1;
+}
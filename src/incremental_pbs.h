@@ -0,0 +1,266 @@
+/**
+ * @file incremental_pbs.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Parity Bitmap Sketch state maintained under set mutations
+ * @version 0.1
+ * @date 2020-07-27
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef INCREMENTAL_PARITY_BITMAP_SKETCH_H_
+#define INCREMENTAL_PARITY_BITMAP_SKETCH_H_
+
+#include <minisketch.h>
+
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pbs.h"
+
+namespace libpbs {
+/**
+ * @brief Long-lived PBS state for a set that changes between reconciliations
+ *
+ * Keeps the first-round state of every group (the BCH sketch of its parity
+ * bitmap, the XOR of each bin and the checksum) up to date as elements are
+ * inserted or erased. Since parity, XOR and BCH syndromes are all self-inverse,
+ * insert and erase are the same toggle: each costs one group hash, one bin
+ * hash, one sketch update and one hash table update, independent of the set
+ * size. Later rounds need the actual elements of some groups, so the elements
+ * are also kept per group (erased by moving the last element of the group into
+ * their slot), and the hash table maps each element to its slot.
+ *
+ * encode() then produces the first-round encoding message in time linear in
+ * the number of groups, together with a BasicParityBitmapSketch that continues
+ * the reconciliation (decode() for Bob, decodeCheck() for Alice) exactly as if
+ * it had been built from scratch with add() and encode(). That sketch reads
+ * the elements of a group from this one only when a later round needs them.
+ *
+ * Fingerprinted key types are not supported, as the fingerprint-to-key table
+ * of the returned sketch would have to be copied for every encoding.
+ *
+ * @tparam Key        key type
+ * @tparam Traits     key traits (see KeyTraits)
+ */
+template <typename Key, typename Traits = KeyTraits<Key>>
+class BasicIncrementalParityBitmapSketch {
+  static_assert(!Traits::is_fingerprint,
+                "fingerprinted keys are not supported by incremental PBS");
+
+ public:
+  using Pbs = BasicParityBitmapSketch<Key, Traits>;
+  using word_t = typename Pbs::word_t;
+  using checksum_t = typename Pbs::checksum_t;
+
+  /**
+   * @brief Constructor
+   *
+   * Takes the same parameters as BasicParityBitmapSketch, and both sides of a
+   * reconciliation must use the same ones.
+   *
+   * @param num_diffs                     number of distinct elements (an
+   * accurate estimate or exact)
+   * @param avg_diffs_per_group           average number of distinct elements
+   * per group
+   * @param target_success_prob           target success probability (within
+   * `max_rounds`)
+   * @param max_rounds                    maximum number of rounds (for
+   * achieving the target success probability)
+   * @param num_groups_when_bch_fail      number of sub-groups to be further
+   * split when BCH decoding failed
+   * @param seed                          random seed
+   */
+  BasicIncrementalParityBitmapSketch(
+      uint32_t num_diffs,
+      float avg_diffs_per_group = DEFAULT_AVG_DIFFS_PER_GROUP,
+      double target_success_prob = DEFAULT_TARGET_SUCCESS_PROB,
+      unsigned max_rounds = DEFAULT_MAX_ROUNDS,
+      unsigned num_groups_when_bch_fail = DEFAULT_NUM_GROUPS_WHEN_BCH_FAIL,
+      uint64_t seed = DEFAULT_SEED_G)
+      : state_(num_diffs, avg_diffs_per_group, target_success_prob,
+               max_rounds, num_groups_when_bch_fail, seed),
+        groups_(state_.num_groups_) {
+    state_.pbs_encoding_ = std::make_shared<PbsEncodingMessage>(
+        state_.bch_m_, state_.bch_t_, state_.num_groups_);
+  }
+
+  /**
+   * @brief Send checksums as truncated hashes
+   *
+   * See BasicParityBitmapSketch::setChecksumBits(). The maintained checksums
+   * are the full XORs either way, so only the sketches returned by later
+   * encode() calls are affected.
+   *
+   * @param bits      width of the checksums (1 to the width of checksum_t)
+   */
+  void setChecksumBits(unsigned bits) { state_.setChecksumBits(bits); }
+
+  /**
+   * @brief Use the narrowest checksums within a share of the failure budget
+   *
+   * See BasicParityBitmapSketch::setChecksumBitsWithin().
+   *
+   * @param share     share of the failure budget allowed for false positives
+   *                  of the checksums
+   */
+  void setChecksumBitsWithin(double share) {
+    state_.setChecksumBitsWithin(share);
+  }
+
+  [[nodiscard]] unsigned checksumBits() const noexcept {
+    return state_.checksumBits();
+  }
+
+  /**
+   * @brief Insert an element into the set, or erase it if it is there
+   *
+   * @param element   element to be toggled
+   */
+  void toggle(const Key &element) {
+    word_t word = Traits::toWord(element);
+    size_t gid = state_.getGroupId_(word);
+    toggle_(gid, word);
+
+    auto &group = groups_[gid];
+    auto [it, inserted] = members_.try_emplace(word, group.size());
+    if (inserted) {
+      group.push_back(word);
+      return;
+    }
+    // erase: the last element of the group moves into the freed slot
+    uint32_t slot = it->second;
+    members_.erase(it);
+    if (slot + 1 != group.size()) {
+      group[slot] = group.back();
+      members_[group[slot]] = slot;
+    }
+    group.pop_back();
+  }
+
+  /**
+   * @brief Insert an element (which must not be in the set yet)
+   *
+   * The same as toggle(): inserting an element that is already in the set
+   * erases it.
+   *
+   * @param element   element to be inserted
+   */
+  void insert(const Key &element) { toggle(element); }
+
+  /**
+   * @brief Batch inserting elements
+   *
+   * @tparam Iterator
+   * @param first, last    	the range of elements to insert
+   */
+  template <typename Iterator>
+  void insert(Iterator first, Iterator last) {
+    for (auto it = first; it != last; ++it) toggle(static_cast<Key>(*it));
+  }
+
+  /**
+   * @brief Erase an element (which must be in the set)
+   *
+   * The same as toggle(): erasing an element that is not in the set inserts
+   * it.
+   *
+   * @param element   element to be erased
+   */
+  void erase(const Key &element) { toggle(element); }
+
+  /**
+   * @brief Whether an element is in the set
+   *
+   * @param element   element to be checked
+   * @return          whether it is in the set
+   */
+  [[nodiscard]] bool contains(const Key &element) const {
+    return members_.count(Traits::toWord(element)) > 0;
+  }
+
+  /**
+   * @brief Encoding for the first round
+   *
+   * Copies the sketches, bin XORs and checksums of all groups, but none of
+   * the elements: the returned PBS instance reads the elements of a group
+   * from this one when a later round needs them. Hence this instance must
+   * outlive it and must not be changed until its reconciliation is done.
+   *
+   * @return    a pair of a PBS instance carrying the first-round state (to
+   * continue the reconciliation with) and the PBS encoding message for the
+   * first round
+   */
+  std::pair<std::unique_ptr<Pbs>, std::shared_ptr<PbsEncodingMessage>>
+  encode() const {
+    auto pbs = std::make_unique<Pbs>(
+        state_.num_diffs_, state_.avg_diffs_per_group_,
+        state_.target_success_prob_, state_.max_rounds_,
+        state_.num_groups_when_bch_fail_, state_.group_partition_seed_);
+
+    size_t num_groups = state_.num_groups_;
+    pbs->checksum_bits_ = state_.checksum_bits_;
+    pbs->groups_pending_ = false;
+    pbs->group_source_ = [groups = &groups_](size_t gid) {
+      const auto &group = (*groups)[gid];
+      return std::make_pair(group.data(), group.size());
+    };
+    pbs->xors_ = state_.xors_;
+    pbs->checksums_ = state_.checksums_;
+
+    auto encoding = std::make_shared<PbsEncodingMessage>(
+        state_.bch_m_, state_.bch_t_, num_groups);
+    // copy the sketches into the ones the message borrowed from the pool
+    auto &sketches = encoding->getSketches();
+    std::vector<unsigned char> buf(
+        minisketch_serialized_size(state_.pbs_encoding_->getSketch(0)));
+    for (size_t gid = 0; gid < num_groups; ++gid) {
+      minisketch_serialize(state_.pbs_encoding_->getSketch(gid), buf.data());
+      minisketch_deserialize(sketches[gid], buf.data());
+    }
+    pbs->pbs_encoding_ = encoding;
+    return {std::move(pbs), encoding};
+  }
+
+  // number of elements in the set
+  [[nodiscard]] size_t size() const noexcept { return members_.size(); }
+
+  [[nodiscard]] size_t bchParameterM() const noexcept { return state_.bch_m_; }
+
+  [[nodiscard]] size_t bchParameterT() const noexcept { return state_.bch_t_; }
+
+  [[nodiscard]] size_t numberOfGroups() const noexcept {
+    return state_.num_groups_;
+  }
+
+ private:
+  /**
+   * @brief Flip `word` in or out of the state of group `gid`
+   *
+   * @param gid       group id of word
+   * @param word      word of the element to be inserted or erased
+   */
+  void toggle_(size_t gid, word_t word) {
+    size_t bid = state_.getBinId_(word);
+    minisketch_add_uint64(state_.pbs_encoding_->getSketch(gid), bid);
+    state_.xors_[gid * state_.bch_n_ + bid] ^= word;
+    state_.checksums_[gid] ^= static_cast<checksum_t>(word);
+  }
+
+  // parameters, hash seeds, bin XORs, checksums and sketches of the first
+  // round; never used for reconciling itself
+  Pbs state_;
+  // elements of each group, in no particular order
+  std::vector<std::vector<word_t>> groups_;
+  // slot of each element in its group
+  std::unordered_map<word_t, uint32_t> members_;
+};
+
+// incremental PBS over 64-bit keys
+using IncrementalParityBitmapSketch = BasicIncrementalParityBitmapSketch<uint64_t>;
+}  // namespace libpbs
+
+#endif  // INCREMENTAL_PARITY_BITMAP_SKETCH_H_
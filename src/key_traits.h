@@ -0,0 +1,108 @@
+/**
+ * @file key_traits.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Key traits for Parity Bitmap Sketch
+ * @version 0.1
+ * @date 2020-07-29
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef PBS_KEY_TRAITS_H_
+#define PBS_KEY_TRAITS_H_
+
+#include <xxh3.h>
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+/**
+ * @brief The macro for hash functions
+ */
+#define MY_HASH_FN(key, seed) XXH3_64bits_withSeed(&key, sizeof(key), seed)
+
+namespace libpbs {
+namespace {
+// seed for fingerprinting keys wider than 64 bits
+constexpr uint64_t FINGERPRINT_SEED = 0x46696e6765725052LU;
+}  // namespace
+
+/**
+ * @brief Key traits for BasicParityBitmapSketch
+ *
+ * PBS works on fixed-width unsigned words: elements are stored, XOR-ed into
+ * bins and reconciled as `word_type`, and group checksums are accumulated as
+ * `checksum_type` (at most as wide as `word_type`; narrower checksums are
+ * truncated XORs). A traits class provides
+ *
+ *   - word_type, checksum_type
+ *   - is_fingerprint: whether toWord() is lossy, i.e., keys are reconciled
+ *     through fingerprints that have to be mapped back to keys
+ *   - toWord(key): the word for a key
+ *   - hash(word, seed): the 64-bit hash used for groups, bins and splits
+ *
+ * @tparam Key        key type
+ * @tparam Enable     for SFINAE
+ */
+template <typename Key, typename Enable = void>
+struct KeyTraits;
+
+/**
+ * @brief Integer keys (up to 64 bits) are reconciled as themselves
+ */
+template <typename Key>
+struct KeyTraits<Key, std::enable_if_t<std::is_integral_v<Key> &&
+                                       sizeof(Key) <= sizeof(uint64_t)>> {
+  using word_type = std::make_unsigned_t<Key>;
+  using checksum_type = word_type;
+  static constexpr bool is_fingerprint = false;
+
+  static word_type toWord(const Key &key) noexcept {
+    return static_cast<word_type>(key);
+  }
+
+  static uint64_t hash(word_type word, uint64_t seed) noexcept {
+    return MY_HASH_FN(word, seed);
+  }
+};
+
+/**
+ * @brief 128-bit keys (e.g., content ids) are reconciled through 64-bit
+ * fingerprints
+ */
+template <>
+struct KeyTraits<unsigned __int128> {
+  using word_type = uint64_t;
+  using checksum_type = uint64_t;
+  static constexpr bool is_fingerprint = true;
+
+  static word_type toWord(const unsigned __int128 &key) noexcept {
+    return MY_HASH_FN(key, FINGERPRINT_SEED);
+  }
+
+  static uint64_t hash(word_type word, uint64_t seed) noexcept {
+    return MY_HASH_FN(word, seed);
+  }
+};
+
+/**
+ * @brief Byte-string keys are reconciled through 64-bit fingerprints
+ */
+template <>
+struct KeyTraits<std::string> {
+  using word_type = uint64_t;
+  using checksum_type = uint64_t;
+  static constexpr bool is_fingerprint = true;
+
+  static word_type toWord(const std::string &key) noexcept {
+    return XXH3_64bits_withSeed(key.data(), key.size(), FINGERPRINT_SEED);
+  }
+
+  static uint64_t hash(word_type word, uint64_t seed) noexcept {
+    return MY_HASH_FN(word, seed);
+  }
+};
+}  // namespace libpbs
+
+#endif  // PBS_KEY_TRAITS_H_
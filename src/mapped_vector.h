@@ -0,0 +1,249 @@
+/**
+ * @file mapped_vector.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Memory-mapped files and vectors that can live inside them
+ * @version 0.1
+ * @date 2020-07-28
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef MAPPED_VECTOR_H_
+#define MAPPED_VECTOR_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace libpbs::utils {
+/**
+ * @brief A private (copy-on-write) memory mapping of a whole file
+ *
+ * Pages are read from the file on first access; writes go to private copies
+ * of the touched pages and never reach the file.
+ */
+class MappedFile {
+ public:
+  /**
+   * @brief Map a file
+   *
+   * @param path    path of the file to map
+   */
+  explicit MappedFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open file: " + path);
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot stat file: " + path);
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void *addr = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          fd, 0);
+      if (addr == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Cannot map file: " + path);
+      }
+      data_ = static_cast<uint8_t *>(addr);
+    }
+    ::close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr) ::munmap(data_, size_);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  [[nodiscard]] uint8_t *data() const noexcept { return data_; }
+
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+
+ private:
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/**
+ * @brief A vector of trivially copyable values that can borrow memory
+ *
+ * Behaves like (the subset of) std::vector used by the PBS state, but can also
+ * be pointed at memory it does not own, e.g., a section of a MappedFile, and
+ * used in place. Writes within the current size go straight to the borrowed
+ * memory; the first reallocation moves the values to memory owned by the
+ * vector. Erasing a prefix of borrowed memory only advances the view.
+ *
+ * The owner of the borrowed memory must keep it alive as long as the vector
+ * refers to it.
+ *
+ * @tparam T    value type
+ */
+template <typename T>
+class MappableVector {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "MappableVector only holds trivially copyable values");
+
+ public:
+  using value_type = T;
+  using size_type = size_t;
+  using iterator = T *;
+  using const_iterator = const T *;
+
+  MappableVector() = default;
+
+  explicit MappableVector(size_t n, T value = T()) { resize(n, value); }
+
+  MappableVector(const MappableVector &other) {
+    reallocate_(other.size_);
+    std::copy_n(other.data_, other.size_, data_);
+    size_ = other.size_;
+  }
+
+  MappableVector(MappableVector &&other) noexcept { swap(other); }
+
+  MappableVector &operator=(MappableVector other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  ~MappableVector() { release_(); }
+
+  /**
+   * @brief Refer to `n` values at `ptr` instead of the current contents
+   *
+   * @param ptr     first value
+   * @param n       number of values
+   */
+  void borrow(T *ptr, size_t n) {
+    release_();
+    data_ = ptr;
+    size_ = capacity_ = n;
+    owned_ = false;
+  }
+
+  // whether the values live in borrowed memory
+  [[nodiscard]] bool borrowed() const noexcept { return !owned_; }
+
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+
+  [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
+
+  T *data() noexcept { return data_; }
+
+  [[nodiscard]] const T *data() const noexcept { return data_; }
+
+  T &operator[](size_t i) noexcept { return data_[i]; }
+
+  const T &operator[](size_t i) const noexcept { return data_[i]; }
+
+  T &back() noexcept { return data_[size_ - 1]; }
+
+  iterator begin() noexcept { return data_; }
+
+  iterator end() noexcept { return data_ + size_; }
+
+  [[nodiscard]] const_iterator begin() const noexcept { return data_; }
+
+  [[nodiscard]] const_iterator end() const noexcept { return data_ + size_; }
+
+  void reserve(size_t n) {
+    if (n > capacity_) reallocate_(n);
+  }
+
+  void resize(size_t n, T value = T()) {
+    if (n > capacity_) reallocate_(std::max(n, 2 * capacity_));
+    if (n > size_) std::fill(data_ + size_, data_ + n, value);
+    size_ = n;
+  }
+
+  void assign(size_t n, T value) {
+    size_ = 0;
+    resize(n, value);
+  }
+
+  void push_back(T value) {
+    if (size_ == capacity_) reallocate_(std::max<size_t>(1, 2 * capacity_));
+    data_[size_++] = value;
+  }
+
+  void clear() noexcept { size_ = 0; }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    size_t pos = first - data_, n = last - first;
+    if (pos == 0 && !owned_) {
+      data_ += n;
+      size_ -= n;
+      capacity_ -= n;
+      return data_;
+    }
+    std::copy(data_ + pos + n, data_ + size_, data_ + pos);
+    size_ -= n;
+    return data_ + pos;
+  }
+
+  template <typename ForwardIt>
+  iterator insert(const_iterator pos, ForwardIt first, ForwardIt last) {
+    size_t at = pos - data_, n = std::distance(first, last);
+    if (size_ + n > capacity_)
+      reallocate_(std::max(size_ + n, 2 * capacity_));
+    std::copy_backward(data_ + at, data_ + size_, data_ + size_ + n);
+    std::copy(first, last, data_ + at);
+    size_ += n;
+    return data_ + at;
+  }
+
+  void swap(MappableVector &other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(owned_, other.owned_);
+  }
+
+ private:
+  /**
+   * @brief Move the values to newly allocated (owned) memory
+   *
+   * @param capacity    number of values to allocate space for
+   */
+  void reallocate_(size_t capacity) {
+    T *fresh = nullptr;
+    if (capacity > 0) {
+      fresh = static_cast<T *>(std::malloc(capacity * sizeof(T)));
+      if (fresh == nullptr) throw std::bad_alloc();
+      std::copy_n(data_, size_, fresh);
+    }
+    release_();
+    data_ = fresh;
+    capacity_ = capacity;
+    owned_ = true;
+  }
+
+  // free owned memory (keeps size_)
+  void release_() noexcept {
+    if (owned_) std::free(data_);
+    data_ = nullptr;
+    capacity_ = 0;
+    owned_ = true;
+  }
+
+  T *data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+  bool owned_ = true;
+};
+}  // namespace libpbs::utils
+
+#endif  // MAPPED_VECTOR_H_
@@ -13,21 +13,31 @@
 #include <minisketch.h>
 #include <xxh3.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <numeric>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "key_traits.h"
+#include "mapped_vector.h"
 #include "pbs_decoding_message.h"
 #include "pbs_encoding_hint_message.h"
 #include "pbs_encoding_message.h"
 #include "pbs_params.h"
-
-/**
- * @brief The macro for hash functions
- */
-#define MY_HASH_FN(key, seed) XXH3_64bits_withSeed(&key, sizeof(key), seed)
+#include "syndrome_encoder.h"
+#include "thread_utils.h"
 
 namespace libpbs {
 namespace {
@@ -46,19 +56,58 @@ constexpr double DEFAULT_TARGET_SUCCESS_PROB = TARGET_SUCCESS_PROB;
 constexpr uint64_t DEFAULT_SEED_G = 0x6d496e536b65LU;
 constexpr uint64_t SEED_OFFSET = 142857;
 constexpr uint64_t BCH_FAILURE_PARTITION_SEED = 0x5A8923ALU;
+// seed for hashing truncated checksums
+constexpr uint64_t CHECKSUM_SEED = 0x436865636b73LU;
+// fewest groups worth handing to a separate thread
+constexpr size_t MIN_GROUPS_PER_THREAD = 64;
+// number of keys hashed per block by the bulk add()
+constexpr size_t ADD_HASH_BLOCK = 256;
+// with more groups than this, elements are partitioned in two radix passes
+// so that each scatter pass only writes to a cache-friendly number of streams
+constexpr size_t RADIX_DIRECT_MAX_GROUPS = 4096;
+constexpr unsigned RADIX_FIRST_PASS_BITS = 8;
+
+// snapshot file format
+constexpr char PBS_SNAPSHOT_MAGIC[8] = {'P', 'B', 'S', 'S', 'N', 'A', 'P', 0};
+constexpr uint32_t PBS_SNAPSHOT_VERSION = 3;
+constexpr uint32_t PBS_SNAPSHOT_BYTE_ORDER = 0x01020304;
+// sections start at multiples of this (in bytes)
+constexpr uint64_t PBS_SNAPSHOT_ALIGNMENT = 64;
 }  // namespace
 
 using key_t = uint64_t;
 using bitmap_t = std::vector<uint8_t>;
 
+template <typename Key, typename Traits>
+class BasicIncrementalParityBitmapSketch;
+
 /**
  * @brief ParityBitmapSketch class
  *
+ * Elements are reconciled as fixed-width words given by the key traits:
+ * narrower keys move and store narrower XORs and checksums. For keys that are
+ * reconciled through fingerprints (e.g., 128-bit ids or strings), reconciled
+ * words of local keys can be mapped back with findKey().
+ *
+ * @tparam Key        key type
+ * @tparam Traits     key traits (see KeyTraits)
  */
-class ParityBitmapSketch {
+template <typename Key, typename Traits = KeyTraits<Key>>
+class BasicParityBitmapSketch {
   enum class PbsRole { Alice, Bob, Undetermined };
+  // seeds the first round from its maintained state
+  template <typename K, typename T>
+  friend class BasicIncrementalParityBitmapSketch;
 
  public:
+  // element (and XOR) type
+  using word_t = typename Traits::word_type;
+  // checksum type
+  using checksum_t = typename Traits::checksum_type;
+  static_assert(std::is_unsigned_v<word_t> && std::is_unsigned_v<checksum_t> &&
+                    sizeof(checksum_t) <= sizeof(word_t),
+                "words and checksums must be unsigned, checksums no wider");
+
   /**
    * @brief Constructor
    *
@@ -75,7 +124,7 @@ class ParityBitmapSketch {
    * split when BCH decoding failed
    * @param seed                          random seed
    */
-  ParityBitmapSketch(
+  BasicParityBitmapSketch(
       uint32_t num_diffs,
       float avg_diffs_per_group = DEFAULT_AVG_DIFFS_PER_GROUP,
       double target_success_prob = DEFAULT_TARGET_SUCCESS_PROB,
@@ -94,7 +143,6 @@ class ParityBitmapSketch {
         num_groups_remaining_(num_groups_),
         round_count_(0),
         role_(PbsRole::Undetermined),
-        groups_(num_groups_),
         to_original_group_id_(num_groups_),
         pbs_encoding_(nullptr),
         pbs_decoding_(nullptr),
@@ -109,13 +157,42 @@ class ParityBitmapSketch {
   /**
    * @brief  Add a single element
    *
-   * Please add all elements before calling encoding.
+   * Please add all elements before calling encoding. Elements are only
+   * partitioned into groups when encoding starts.
    *
    * @param element   element to be added
    */
-  void add(uint64_t element) {
-    auto gid = getGroupId_(element);
-    groups_[gid].push_back(element);
+  void add(const Key &element) {
+    if (!groups_pending_)
+      throw std::logic_error("Please add all elements before encoding");
+    word_t word = toWord_(element);
+    group_keys_.push_back(word);
+    pending_gids_.push_back(getGroupId_(word));
+  }
+
+  /**
+   * @brief Bulk adding elements stored contiguously
+   *
+   * Keys are converted to words and then hashed block by block into a
+   * separate group id array, so that the hashing loop has no dependency
+   * between iterations.
+   *
+   * @param keys      pointer to the first element
+   * @param n         number of elements
+   */
+  void add(const Key *keys, size_t n) {
+    if (!groups_pending_)
+      throw std::logic_error("Please add all elements before encoding");
+    size_t base = group_keys_.size();
+    group_keys_.resize(base + n);
+    pending_gids_.resize(base + n);
+    word_t *words = group_keys_.data() + base;
+    uint32_t *gids = pending_gids_.data() + base;
+    for (size_t first = 0; first < n; first += ADD_HASH_BLOCK) {
+      size_t last = std::min(n, first + ADD_HASH_BLOCK);
+      for (size_t i = first; i < last; ++i) words[i] = toWord_(keys[i]);
+      for (size_t i = first; i < last; ++i) gids[i] = getGroupId_(words[i]);
+    }
   }
 
   /**
@@ -126,7 +203,20 @@ class ParityBitmapSketch {
    */
   template <typename Iterator>
   void add(Iterator first, Iterator last) {
-    for (auto it = first; it != last; ++it) add(static_cast<uint64_t>(*it));
+    if constexpr (Traits::is_fingerprint) {
+      for (auto it = first; it != last; ++it) add(*it);
+    } else {
+      Key block[ADD_HASH_BLOCK];
+      size_t n = 0;
+      for (auto it = first; it != last; ++it) {
+        block[n++] = static_cast<Key>(*it);
+        if (n == ADD_HASH_BLOCK) {
+          add(block, n);
+          n = 0;
+        }
+      }
+      add(block, n);
+    }
   }
 
   /**
@@ -139,18 +229,19 @@ class ParityBitmapSketch {
             std::shared_ptr<PbsEncodingHintMessage>>
   encode() {
     std::shared_ptr<PbsEncodingHintMessage> hint(nullptr);
+    if (encoding_restored_ && round_count_ == 0) {
+      encoding_restored_ = false;
+      return {pbs_encoding_, hint};
+    }
+    buildGroups_();
     pbs_encoding_ = std::make_shared<PbsEncodingMessage>(bch_m_, bch_t_,
                                                          num_groups_remaining_);
-    for (size_t gid = 0; gid < num_groups_remaining_; ++gid)
-      doEncode_(gid, pbs_encoding_->getSketch(gid));
+    doEncodeAll_();
 
 #ifdef DEBUG_PBS
-    if (!groups_.front().empty()) {
-      for (size_t i = 0; i < groups_.size(); ++i)
-        if (bch_t_ < groups_[i].size())
-          printf("G#%lu: group size %lu | t = %zu\n", i, groups_[i].size(),
-                 bch_t_);
-    }
+    for (size_t i = 0; i < num_groups_remaining_; ++i)
+      if (bch_t_ < groupSize_(i))
+        printf("G#%lu: group size %lu | t = %zu\n", i, groupSize_(i), bch_t_);
 #endif
 
     if (!groups_exp_I_or_II_.empty()) {
@@ -173,6 +264,25 @@ class ParityBitmapSketch {
                           msg.groups_with_exceptions.end());
   }
 
+  /**
+   * @brief Encoding with the hint returned by Alice's encode()
+   *
+   * Alice sends no hint when none of the groups of the last round had
+   * exceptions (e.g., only BCH decoding failed), which is the same as an
+   * empty one.
+   *
+   * @param msg       PBS decoding hint message (could be null)
+   * @return          a shared pointer to a PBS encoding message
+   */
+  std::shared_ptr<PbsEncodingMessage> encodeWithHint(
+      const PbsEncodingHintMessage *msg) {
+    if (msg == nullptr) {
+      const uint32_t *none = nullptr;
+      return encodeWithHint(none, none);
+    }
+    return encodeWithHint(*msg);
+  }
+
   /**
    * @brief Encoding with hint (needed when handling exceptions)
    *
@@ -197,13 +307,15 @@ class ParityBitmapSketch {
     pbs_encoding_ =
         std::make_shared<PbsEncodingMessage>(bch_m_, bch_t_, num_groups);
 
-    xors_.resize(xors_.size() + num_groups_I_or_II * bch_n_, 0u);
-    checksums_.resize(checksums_.size() + num_groups_I_or_II, 0u);
+    next_xors_.resize(next_xors_.size() + num_groups_I_or_II * bch_n_, 0u);
+    next_checksums_.resize(next_checksums_.size() + num_groups_I_or_II, 0u);
 
     for (auto it = first; it != last; ++it) {
-      auto old_gid = *it;
-      groups_.push_back(std::move(groups_.at(old_gid)));
-      to_original_group_id_.push_back(to_original_group_id_[old_gid]);
+      size_t old_gid = *it;
+      if (old_gid >= num_groups_remaining_)
+        throw std::out_of_range("gid is out of range");
+      appendGroup_(old_gid, nullptr, nullptr);
+      next_to_original_group_id_.push_back(to_original_group_id_[old_gid]);
     }
     groups_bch_failed_.clear();
     // remove all successful groups (and its associated all info)
@@ -213,9 +325,7 @@ class ParityBitmapSketch {
       throw std::runtime_error(
           fmt::format("number of groups mismatched: expected {}, got {}",
                       num_groups, num_groups_remaining_));
-    size_t i = 0;
-    for (size_t gid = 0; gid < num_groups_remaining_; ++gid)
-      doEncode_(gid, pbs_encoding_->getSketch(i++));
+    doEncodeAll_();
 
     return pbs_encoding_;
   }
@@ -230,8 +340,8 @@ class ParityBitmapSketch {
    * @return                     a shared pointer to PBS decoding message
    */
   std::shared_ptr<PbsDecodingMessage> decode(const PbsEncodingMessage &other,
-                                             std::vector<key_t> &xors,
-                                             std::vector<key_t> &checksums) {
+                                             std::vector<word_t> &xors,
+                                             std::vector<checksum_t> &checksums) {
     if (role_ == PbsRole::Alice)
       throw std::logic_error("Alice can not do decode");
     assert(other.num_groups == num_groups_remaining_);
@@ -241,7 +351,7 @@ class ParityBitmapSketch {
                                                          num_groups_remaining_);
     pbs_decoding_->setWith(pbs_encoding_->getSketches().begin(),
                            pbs_encoding_->getSketches().end(),
-                           other.getSketches().cbegin());
+                           other.getSketches().cbegin(), num_threads_);
     size_t offset = 0, gid = 0;
     xors.clear();
     checksums.clear();
@@ -253,7 +363,7 @@ class ParityBitmapSketch {
           xors.push_back(xors_[gid * bch_n_ + bid]);
         }
         offset += p;
-        checksums.push_back(checksums_[gid]);
+        checksums.push_back(wireChecksum_(checksums_[gid]));
       } else {
         // BCH decoding failed
         groups_bch_failed_.push_back(gid);
@@ -279,8 +389,29 @@ class ParityBitmapSketch {
    * exception)
    */
   bool decodeCheck(const PbsDecodingMessage &msg,
-                   const std::vector<key_t> &xors,
-                   const std::vector<key_t> &checksums) {
+                   const std::vector<word_t> &xors,
+                   const std::vector<checksum_t> &checksums) {
+    return decodeCheck(msg, xors.data(), xors.size(), checksums.data(),
+                       checksums.size());
+  }
+
+  /**
+   * @brief Check whether there are exceptions in all groups
+   *
+   * Same as above, but reads XORs and checksums from plain arrays, e.g., views
+   * into a received round frame (see pbs_round_frame.h).
+   *
+   * @param msg             PBS decoding message instance
+   * @param xors            XORs associated with the PBS decoding message
+   * @param num_xors        number of XORs
+   * @param checksums       checksums associated with the PBS decoding message
+   * @param num_checksums   number of checksums
+   * @return                whether there is no exceptions (true -- no
+   * exception)
+   */
+  bool decodeCheck(const PbsDecodingMessage &msg, const word_t *xors,
+                   size_t num_xors, const checksum_t *checksums,
+                   size_t num_checksums) {
     if (role_ == PbsRole::Bob)
       throw std::logic_error("Bob can not do decode check");
     assert(msg.num_groups == num_groups_remaining_);
@@ -303,11 +434,11 @@ class ParityBitmapSketch {
       }
     }
 
-    if (xor_sz > xors.size() || checksum_sz > checksums.size())
+    if (xor_sz > num_xors || checksum_sz > num_checksums)
       throw std::runtime_error(
           fmt::format("xors: expected size {}, but got size {}\n\tchecksums: "
                       "expected size {}, but got size {}\n\tmore info: \n\t\t# of diffs: {}\n\t\tdiffs: {}",
-                      xor_sz, xors.size(), checksum_sz, checksums.size(),
+                      xor_sz, num_xors, checksum_sz, num_checksums,
                       fmt::join(msg.decoded_num_differences.cbegin(),msg.decoded_num_differences.end(), " "),
                       fmt::join(msg.decoded_differences.cbegin(), msg.decoded_differences.cend(), " ")));
 
@@ -332,12 +463,13 @@ class ParityBitmapSketch {
   }
 
   // get elements reconciled in this round
-  [[nodiscard]] const std::vector<key_t> &differencesLastRound() const {
+  [[nodiscard]] const std::vector<word_t> &differencesLastRound() const {
     return recovered_.back();
   }
 
   // get all reconciled elements
-  [[nodiscard]] const std::vector<std::vector<key_t>> &differencesAll() const {
+  [[nodiscard]] const std::vector<std::vector<word_t>> &differencesAll()
+      const {
     return recovered_;
   }
 
@@ -360,7 +492,336 @@ class ParityBitmapSketch {
     return hint_max_range_;
   }
 
+  /**
+   * @brief Map a reconciled word back to a local key
+   *
+   * For key types reconciled through fingerprints, only fingerprints of local
+   * keys (added to this instance) can be mapped back; the keys behind the
+   * other fingerprints are only held by the other host, which has to send
+   * them. For the other key types, every word is the key itself.
+   *
+   * @param word      reconciled word, e.g., from differencesLastRound()
+   * @param key       the key (if found)
+   * @return          whether the key is found
+   */
+  bool findKey(word_t word, Key &key) const {
+    if constexpr (Traits::is_fingerprint) {
+      auto it = keys_by_fingerprint_.find(word);
+      if (it == keys_by_fingerprint_.end()) return false;
+      key = it->second;
+    } else {
+      key = static_cast<Key>(word);
+    }
+    return true;
+  }
+
+  /**
+   * @brief Set the number of threads used for encoding and decoding
+   *
+   * Groups are split into contiguous chunks, one per thread. The resulting
+   * messages are bit-identical to the single-threaded ones.
+   *
+   * @param num_threads   number of threads (0 means all hardware threads, 1
+   * means no extra threads)
+   */
+  void setNumThreads(unsigned num_threads) noexcept {
+    num_threads_ = num_threads;
+  }
+
+  [[nodiscard]] unsigned numThreads() const noexcept { return num_threads_; }
+
+  /**
+   * @brief Send checksums as truncated hashes
+   *
+   * By default, the checksum of a group is the XOR of its elements, sent at
+   * full width. With `bits` narrower than checksum_t, the checksum sent is
+   * the lowest `bits` bits of a hash of that XOR instead, which lets a group
+   * with unrecovered elements pass the check with probability 2^-bits (see
+   * pbsutils::PbsParam::checksumFailureUB()). The BCH parameters do not
+   * change, so these false positives come on top of the failure probability
+   * for the target success probability. Both hosts have to use the same
+   * width, and it has to be set before encoding.
+   *
+   * @param bits      width of the checksums (1 to the width of checksum_t)
+   */
+  void setChecksumBits(unsigned bits) {
+    if (!groups_pending_ || round_count_ != 0)
+      throw std::logic_error("Please set the checksum width before encoding");
+    if (bits == 0 || bits > 8 * sizeof(checksum_t))
+      throw std::invalid_argument(
+          fmt::format("Invalid checksum width: {}", bits));
+    checksum_bits_ = bits;
+  }
+
+  [[nodiscard]] unsigned checksumBits() const noexcept {
+    return checksum_bits_;
+  }
+
+  /**
+   * @brief Use the narrowest checksums within a share of the failure budget
+   *
+   * @param share     share of the failure budget (1 - target success
+   *                  probability) allowed for false positives of the
+   *                  checksums, on top of that of BCH
+   */
+  void setChecksumBitsWithin(double share) {
+    unsigned bits = pbsutils::PbsParam::minChecksumBits(
+        num_diffs_, max_rounds_, share * (1 - target_success_prob_));
+    setChecksumBits(std::min<unsigned>(bits, 8 * sizeof(checksum_t)));
+  }
+
+  /**
+   * @brief Save the state to a snapshot file
+   *
+   * Only the state before the first round of decoding can be saved, i.e.,
+   * after adding all elements and optionally after encoding. The snapshot
+   * holds the configuration, the element groups, the bin XORs, the checksums,
+   * the group id mapping, the round metadata and (if encoded) the encoding
+   * message. It is written to a temporary file and then renamed, so no reader
+   * ever sees a partial snapshot.
+   *
+   * @param path      path of the snapshot file
+   */
+  void save(const std::string &path) {
+    static_assert(!Traits::is_fingerprint,
+                  "fingerprint-to-key tables are not saved in snapshots");
+    if (round_count_ != 0)
+      throw std::logic_error(
+          "Only the state before the first round of decoding can be saved");
+    static_assert(sizeof(size_t) == sizeof(uint64_t),
+                  "snapshots store size_t as 64-bit integers");
+    buildGroups_();
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, PBS_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = PBS_SNAPSHOT_VERSION;
+    header.byte_order = PBS_SNAPSHOT_BYTE_ORDER;
+    header.num_diffs = num_diffs_;
+    header.target_success_prob = target_success_prob_;
+    header.avg_diffs_per_group = avg_diffs_per_group_;
+    header.max_rounds = max_rounds_;
+    header.num_groups_when_bch_fail = num_groups_when_bch_fail_;
+    header.bch_m = bch_m_;
+    header.bch_t = bch_t_;
+    header.round_count = round_count_;
+    header.word_bytes = sizeof(word_t);
+    header.checksum_bytes = sizeof(checksum_t);
+    header.checksum_bits = checksum_bits_;
+    header.seed = group_partition_seed_;
+    header.num_groups = num_groups_;
+    header.num_groups_remaining = num_groups_remaining_;
+    header.hint_max_range = hint_max_range_;
+
+    std::string encoding;
+    if (pbs_encoding_ != nullptr) {
+      encoding.resize(pbs_encoding_->serializedSize());
+      pbs_encoding_->write((uint8_t *)&encoding[0]);
+    }
+    const char *sections[SNAPSHOT_NUM_SECTIONS] = {
+        (const char *)group_keys_.data(),
+        (const char *)group_offsets_.data(),
+        (const char *)xors_.data(),
+        (const char *)checksums_.data(),
+        (const char *)to_original_group_id_.data(),
+        encoding.data()};
+    header.section_bytes[SNAPSHOT_KEYS] = group_keys_.size() * sizeof(word_t);
+    header.section_bytes[SNAPSHOT_OFFSETS] =
+        group_offsets_.size() * sizeof(size_t);
+    header.section_bytes[SNAPSHOT_XORS] = xors_.size() * sizeof(word_t);
+    header.section_bytes[SNAPSHOT_CHECKSUMS] =
+        checksums_.size() * sizeof(checksum_t);
+    header.section_bytes[SNAPSHOT_ORIGINAL_GIDS] =
+        to_original_group_id_.size() * sizeof(size_t);
+    header.section_bytes[SNAPSHOT_ENCODING] = encoding.size();
+    uint64_t offset = alignSnapshotOffset_(sizeof(header));
+    for (size_t i = 0; i < SNAPSHOT_NUM_SECTIONS; ++i) {
+      header.section_offset[i] = offset;
+      offset = alignSnapshotOffset_(offset + header.section_bytes[i]);
+    }
+
+    std::string tmp_path = path + ".tmp";
+    {
+      std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+      if (!out) throw std::runtime_error("Cannot create file: " + tmp_path);
+      out.write((const char *)&header, sizeof(header));
+      uint64_t written = sizeof(header);
+      const char padding[PBS_SNAPSHOT_ALIGNMENT] = {};
+      for (size_t i = 0; i < SNAPSHOT_NUM_SECTIONS; ++i) {
+        out.write(padding, header.section_offset[i] - written);
+        out.write(sections[i], header.section_bytes[i]);
+        written = header.section_offset[i] + header.section_bytes[i];
+      }
+      if (!out) throw std::runtime_error("Cannot write file: " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+      throw std::runtime_error("Cannot rename " + tmp_path + " to " + path);
+  }
+
+  /**
+   * @brief Restore the state saved by save()
+   *
+   * The snapshot file is memory-mapped (privately, so the file itself never
+   * changes) and the element groups, bin XORs, checksums and the group id
+   * mapping are used in place. Only the encoding message is parsed. If the
+   * snapshot was taken after encoding, the next encode() returns the restored
+   * message.
+   *
+   * @param path      path of the snapshot file
+   * @return          the restored PBS instance
+   */
+  static BasicParityBitmapSketch load(const std::string &path) {
+    static_assert(!Traits::is_fingerprint,
+                  "fingerprint-to-key tables are not saved in snapshots");
+    auto file = std::make_shared<utils::MappedFile>(path);
+    SnapshotHeader header{};
+    if (file->size() < sizeof(header))
+      throw std::runtime_error("Not a PBS snapshot: " + path);
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, PBS_SNAPSHOT_MAGIC, sizeof(header.magic)) !=
+        0)
+      throw std::runtime_error("Not a PBS snapshot: " + path);
+    if (header.version != PBS_SNAPSHOT_VERSION ||
+        header.byte_order != PBS_SNAPSHOT_BYTE_ORDER)
+      throw std::runtime_error(
+          fmt::format("Unsupported PBS snapshot (version {}): {}",
+                      header.version, path));
+    if (header.word_bytes != sizeof(word_t) ||
+        header.checksum_bytes != sizeof(checksum_t))
+      throw std::runtime_error("PBS snapshot of another key type: " + path);
+    if (header.checksum_bits == 0 ||
+        header.checksum_bits > 8 * sizeof(checksum_t) ||
+        header.bch_m < pbsutils::M_MIN || header.bch_m > pbsutils::M_MAX ||
+        header.bch_t == 0 || header.bch_t > pbsutils::MAX_BALLS)
+      throw std::runtime_error("Corrupted PBS snapshot: " + path);
+    // snapshots are only taken before the first round of decoding, when all
+    // groups are still there (and the number of groups follows from d)
+    if (header.round_count != 0 ||
+        header.num_diffs > std::numeric_limits<uint32_t>::max() ||
+        !(header.avg_diffs_per_group > 0) ||
+        header.num_groups != static_cast<uint64_t>(
+                                 std::ceil((float)header.num_diffs /
+                                           header.avg_diffs_per_group)) ||
+        header.num_groups_remaining != header.num_groups ||
+        header.hint_max_range != header.num_groups)
+      throw std::runtime_error("Corrupted PBS snapshot: " + path);
+    for (size_t i = 0; i < SNAPSHOT_NUM_SECTIONS; ++i) {
+      if (header.section_offset[i] % PBS_SNAPSHOT_ALIGNMENT != 0 ||
+          header.section_offset[i] > file->size() ||
+          header.section_bytes[i] > file->size() - header.section_offset[i])
+        throw std::runtime_error("Corrupted PBS snapshot: " + path);
+    }
+
+    BasicParityBitmapSketch pbs(header);
+    pbs.snapshot_ = file;
+    auto borrow = [&](auto &array, size_t section) {
+      using value_t = typename std::decay_t<decltype(array)>::value_type;
+      array.borrow(
+          reinterpret_cast<value_t *>(file->data() +
+                                      header.section_offset[section]),
+          header.section_bytes[section] / sizeof(value_t));
+    };
+    borrow(pbs.group_keys_, SNAPSHOT_KEYS);
+    borrow(pbs.group_offsets_, SNAPSHOT_OFFSETS);
+    borrow(pbs.xors_, SNAPSHOT_XORS);
+    borrow(pbs.checksums_, SNAPSHOT_CHECKSUMS);
+    borrow(pbs.to_original_group_id_, SNAPSHOT_ORIGINAL_GIDS);
+    size_t num_groups = pbs.num_groups_remaining_;
+    if (pbs.group_offsets_.size() != num_groups + 1 ||
+        pbs.group_offsets_.back() != pbs.group_keys_.size() ||
+        pbs.xors_.size() != num_groups * pbs.bch_n_ ||
+        pbs.checksums_.size() != num_groups ||
+        pbs.to_original_group_id_.size() != num_groups)
+      throw std::runtime_error("Corrupted PBS snapshot: " + path);
+    // group_offsets_ index group_keys_
+    if (pbs.group_offsets_[0] != 0 ||
+        !std::is_sorted(pbs.group_offsets_.begin(), pbs.group_offsets_.end()))
+      throw std::runtime_error("Corrupted PBS snapshot: " + path);
+
+    size_t encoding_bytes = header.section_bytes[SNAPSHOT_ENCODING];
+    if (encoding_bytes > 0) {
+      pbs.pbs_encoding_ = std::make_shared<PbsEncodingMessage>(
+          pbs.bch_m_, pbs.bch_t_, num_groups);
+      if (pbs.pbs_encoding_->parse(
+              file->data() + header.section_offset[SNAPSHOT_ENCODING],
+              encoding_bytes) != (ssize_t)encoding_bytes)
+        throw std::runtime_error("Corrupted PBS snapshot: " + path);
+      pbs.encoding_restored_ = true;
+    }
+    return pbs;
+  }
+
  private:
+  // sections of a snapshot file, in file order
+  enum SnapshotSection : size_t {
+    SNAPSHOT_KEYS = 0,
+    SNAPSHOT_OFFSETS,
+    SNAPSHOT_XORS,
+    SNAPSHOT_CHECKSUMS,
+    SNAPSHOT_ORIGINAL_GIDS,
+    SNAPSHOT_ENCODING,
+    SNAPSHOT_NUM_SECTIONS
+  };
+
+  // fixed-size header at the beginning of a snapshot file
+  struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t num_diffs;
+    double target_success_prob;
+    float avg_diffs_per_group;
+    uint32_t max_rounds;
+    uint32_t num_groups_when_bch_fail;
+    uint32_t bch_m;
+    uint32_t bch_t;
+    uint32_t round_count;
+    // widths (in bytes) of elements and checksums
+    uint32_t word_bytes;
+    uint32_t checksum_bytes;
+    // width of the checksums sent (see setChecksumBits())
+    uint32_t checksum_bits;
+    uint32_t reserved;
+    uint64_t seed;
+    uint64_t num_groups;
+    uint64_t num_groups_remaining;
+    uint64_t hint_max_range;
+    // where each section starts and how many bytes it takes
+    uint64_t section_offset[SNAPSHOT_NUM_SECTIONS];
+    uint64_t section_bytes[SNAPSHOT_NUM_SECTIONS];
+  };
+
+  /**
+   * @brief Constructor for restoring from a snapshot (see load())
+   *
+   * @param header    header of the snapshot file
+   */
+  explicit BasicParityBitmapSketch(const SnapshotHeader &header)
+      : avg_diffs_per_group_(header.avg_diffs_per_group),
+        target_success_prob_(header.target_success_prob),
+        max_rounds_(header.max_rounds),
+        num_groups_when_bch_fail_(header.num_groups_when_bch_fail),
+        group_partition_seed_(header.seed),
+        parity_encoding_seed_(header.seed + SEED_OFFSET),
+        bch_m_(header.bch_m),
+        bch_n_((1u << header.bch_m) - 1),
+        bch_t_(header.bch_t),
+        num_diffs_(header.num_diffs),
+        num_groups_(header.num_groups),
+        num_groups_remaining_(header.num_groups_remaining),
+        round_count_(header.round_count),
+        role_(PbsRole::Undetermined),
+        groups_pending_(false),
+        pbs_encoding_(nullptr),
+        pbs_decoding_(nullptr),
+        hint_max_range_(header.hint_max_range),
+        checksum_bits_(header.checksum_bits) {}
+
+  // round up to the next section boundary of a snapshot file
+  static uint64_t alignSnapshotOffset_(uint64_t offset) {
+    return (offset + PBS_SNAPSHOT_ALIGNMENT - 1) / PBS_SNAPSHOT_ALIGNMENT *
+           PBS_SNAPSHOT_ALIGNMENT;
+  }
+
   // average number of differences (the elements that only one of the sets A, B
   // has) in each group
   float avg_diffs_per_group_;
@@ -397,28 +858,63 @@ class ParityBitmapSketch {
   // role (Alice or Bob)
   PbsRole role_;
 
-  // element groups
-  std::vector<std::vector<key_t>> groups_;
+  // element groups in compressed-sparse-row layout: elements of group `gid`
+  // are group_keys_[group_offsets_[gid]], ..., group_keys_[group_offsets_[gid
+  // + 1] - 1]. Groups for the next round are built in the next_* generation.
+  utils::MappableVector<word_t> group_keys_;
+  utils::MappableVector<size_t> group_offsets_;
+  // whether group_keys_ still holds added elements not partitioned yet
+  bool groups_pending_ = true;
+  // elements of a group of the first round, read on demand instead of from
+  // group_keys_ (set by BasicIncrementalParityBitmapSketch::encode() and
+  // dropped once the groups are in group_keys_)
+  std::function<std::pair<const word_t *, size_t>(size_t)> group_source_;
+  // group ids of the added elements not partitioned yet
+  std::vector<uint32_t> pending_gids_;
   // map new group id to old group id
-  std::vector<size_t> to_original_group_id_;
+  utils::MappableVector<size_t> to_original_group_id_;
 
   /* PBS messages */
   std::shared_ptr<PbsEncodingMessage> pbs_encoding_;
   std::shared_ptr<PbsDecodingMessage> pbs_decoding_;
   // for PBS encoding hint message
   size_t hint_max_range_;
+  // width of the checksums sent (see setChecksumBits())
+  unsigned checksum_bits_ = 8 * sizeof(checksum_t);
 
   // XOR of all elements in each bin
-  std::vector<key_t> xors_;
+  utils::MappableVector<word_t> xors_;
   // checksum (XOR of all elements) for a group
-  std::vector<key_t> checksums_;
+  utils::MappableVector<checksum_t> checksums_;
+
+  // the next generation: groups created during this round (sub-groups of
+  // BCH failures and groups with exceptions), laid out like the ones above
+  // and swapped in when the round completes
+  utils::MappableVector<word_t> next_group_keys_;
+  utils::MappableVector<size_t> next_group_offsets_{1, 0};
+  utils::MappableVector<size_t> next_to_original_group_id_;
+  utils::MappableVector<word_t> next_xors_;
+  utils::MappableVector<checksum_t> next_checksums_;
 
   // groups where exceptions happened
   std::vector<size_t> groups_exp_I_or_II_;
   std::vector<size_t> groups_bch_failed_;
 
   // recovered elements
-  std::vector<std::vector<key_t>> recovered_;
+  std::vector<std::vector<word_t>> recovered_;
+  // local keys by their fingerprints (only for fingerprinted key types)
+  std::unordered_map<word_t, Key> keys_by_fingerprint_;
+
+  // number of threads for encoding and BCH decoding (1 -- serial)
+  unsigned num_threads_ = 1;
+
+  // snapshot file the state is mapped from (see load())
+  std::shared_ptr<utils::MappedFile> snapshot_;
+  // whether pbs_encoding_ was restored from a snapshot and not returned yet
+  bool encoding_restored_ = false;
+
+  // table-driven BCH encoder (set up on first use; see doEncodeAll_())
+  utils::SyndromeEncoder syndrome_encoder_;
 
   /**
    * @brief Calculate the near-optimal BCH parameters for PBS
@@ -426,23 +922,42 @@ class ParityBitmapSketch {
    */
   void calcBchParams_() {
     pbsutils::BestBchParam bch_param{};
-    pbsutils::PbsParam::bestBchParam(num_diffs_, avg_diffs_per_group_,
-                                     max_rounds_, num_groups_when_bch_fail_,
-                                     target_success_prob_, bch_param);
+    pbsutils::PbsParam::bestBchParam(
+        num_diffs_, avg_diffs_per_group_, max_rounds_,
+        num_groups_when_bch_fail_, target_success_prob_, bch_param);
     // TODO: release caches
     bch_m_ = bch_param.m;
     bch_n_ = (1u << bch_param.m) - 1;
     bch_t_ = bch_param.t;
   }
 
+  /**
+   * @brief Convert a key to the word reconciled by PBS
+   *
+   * @param key       key to be converted
+   * @return          the word (fingerprints are recorded for findKey())
+   */
+  word_t toWord_(const Key &key) {
+    word_t word = Traits::toWord(key);
+    if constexpr (Traits::is_fingerprint) keys_by_fingerprint_.emplace(word, key);
+    return word;
+  }
+
   /**
    * @brief Get which group `element` is partitioned to
    *
    * @param element       element to be checked
    * @return              group id
    */
-  [[nodiscard]] inline uint64_t getGroupId_(uint64_t element) const {
-    return MY_HASH_FN(element, group_partition_seed_) % num_groups_;
+  [[nodiscard]] inline uint64_t getGroupId_(word_t element) const {
+    // multiply-shift range reduction: the high word of hash * num_groups_ is
+    // uniform on [0, num_groups_) and needs no division. Note that this is a
+    // different partition than the previous hash % num_groups_, so both
+    // peers have to run a version with the same partition to reconcile.
+    return (static_cast<unsigned __int128>(
+                Traits::hash(element, group_partition_seed_)) *
+            num_groups_) >>
+           64;
   }
 
   /**
@@ -452,11 +967,11 @@ class ParityBitmapSketch {
    * @param element   element to be checked
    * @return          bin id
    */
-  [[nodiscard]] inline uint64_t getBinId_(uint64_t element) const {
+  [[nodiscard]] inline uint64_t getBinId_(word_t element) const {
     /// Note that here we do not use the bin with id 0
     /// since minisketch now does not support 0
     /// Note also that the seed needs to be changed for each round
-    return MY_HASH_FN(element, parity_encoding_seed_ + round_count_) %
+    return Traits::hash(element, parity_encoding_seed_ + round_count_) %
                (bch_n_ - 1) +
            1;
   }
@@ -466,22 +981,54 @@ class ParityBitmapSketch {
    *
    * @param gid                  group id
    * @param sketch               the minisketch for this group
-   * @param init_before_set      whether need initialize before set the values
+   * @param bitmap               all-zero parity bitmap to work in (left
+   * all-zero on return)
+   * @param syndromes            scratch for the syndromes (bch_t_ entries)
+   * @param buf                  scratch for a serialized sketch
    */
-  void doEncode_(size_t gid, minisketch *sketch) {
-    bitmap_t bitmap(bch_n_, 0u);
+  void doEncode_(size_t gid, minisketch *sketch, bitmap_t &bitmap,
+                 uint16_t *syndromes, uint8_t *buf) {
     size_t xor_start = gid * bch_n_;
 
-    for (const auto elm : groups_[gid]) {
+    for (size_t k = group_offsets_[gid]; k < group_offsets_[gid + 1]; ++k) {
+      auto elm = group_keys_[k];
       size_t loc = getBinId_(elm);
       bitmap[loc] ^= 1u;
       xors_[xor_start + loc] ^= elm;
-      checksums_[gid] ^= elm;
+      checksums_[gid] ^= static_cast<checksum_t>(elm);
     }
 
-    for (uint64_t k = 0; k < bch_n_; ++k) {
-      if (bitmap[k]) minisketch_add_uint64(sketch, k);
+    if (utils::SyndromeEncoder::Supports(bch_m_)) {
+      syndrome_encoder_.encode(bitmap.data(), bch_n_, syndromes);
+      syndrome_encoder_.load(syndromes, buf, sketch);
+    } else {
+      for (uint64_t k = 0; k < bch_n_; ++k) {
+        if (bitmap[k]) minisketch_add_uint64(sketch, k);
+      }
     }
+    std::fill(bitmap.begin(), bitmap.end(), 0u);
+  }
+
+  /**
+   * @brief Encode all groups of the current round
+   *
+   * Each group only touches its own sketch, its own slice of `xors_` and its
+   * own entry of `checksums_`, so groups can be encoded concurrently.
+   */
+  void doEncodeAll_() {
+    if (utils::SyndromeEncoder::Supports(bch_m_) &&
+        syndrome_encoder_.fieldSize() != bch_m_)
+      syndrome_encoder_ = utils::SyndromeEncoder(bch_m_, bch_t_);
+    utils::ParallelFor(
+        num_groups_remaining_, num_threads_, MIN_GROUPS_PER_THREAD,
+        [this](size_t first, size_t last) {
+          bitmap_t bitmap(bch_n_, 0u);
+          std::vector<uint16_t> syndromes(bch_t_);
+          std::vector<uint8_t> buf(utils::Bits2Bytes(bch_m_ * bch_t_));
+          for (size_t gid = first; gid < last; ++gid)
+            doEncode_(gid, pbs_encoding_->getSketch(gid), bitmap,
+                      syndromes.data(), buf.data());
+        });
   }
 
   /**
@@ -491,17 +1038,30 @@ class ParityBitmapSketch {
    */
   inline void threeWaySplit_(size_t gid) {
     // BCH decoding failed
-    size_t old_size = groups_.size();
-    groups_.resize(old_size + num_groups_when_bch_fail_);
+#ifdef DEBUG_PBS
+    size_t old_size = next_group_offsets_.size() - 1;
+#endif
+    auto [group, sz] = groupElements_(gid);
+    size_t base = next_group_keys_.size();
 
-    for (size_t k = 0; k < groups_[gid].size(); ++k) {
+    // counting pass, then scatter the sub-groups to the next generation
+    std::vector<uint32_t> sub_gids(sz);
+    std::vector<size_t> cursor(num_groups_when_bch_fail_ + 1, 0);
+    for (size_t k = 0; k < sz; ++k) {
       // Note that, seed should be different from group_partition_seed_,
       // otherwise all elements would map to the same bin again
-      size_t index = MY_HASH_FN(groups_[gid][k],
-                                BCH_FAILURE_PARTITION_SEED + round_count_) %
-                     num_groups_when_bch_fail_;
-      groups_[old_size + index].push_back(groups_[gid][k]);
+      word_t elm = group[k];
+      sub_gids[k] =
+          Traits::hash(elm, BCH_FAILURE_PARTITION_SEED + round_count_) %
+          num_groups_when_bch_fail_;
+      ++cursor[sub_gids[k] + 1];
     }
+    std::partial_sum(cursor.begin(), cursor.end(), cursor.begin());
+    for (size_t i = 1; i <= num_groups_when_bch_fail_; ++i)
+      next_group_offsets_.push_back(base + cursor[i]);
+    next_group_keys_.resize(base + sz);
+    for (size_t k = 0; k < sz; ++k)
+      next_group_keys_[base + cursor[sub_gids[k]]++] = group[k];
 
 #ifdef DEBUG_PBS
     printf(
@@ -509,16 +1069,35 @@ class ParityBitmapSketch {
         (role_ == PbsRole::Alice ? "Alice" : "Bob"), gid, round_count_,
         old_size, group_partition_seed_ + round_count_);
     for (size_t i = 0; i < num_groups_when_bch_fail_; ++i) {
-      printf(" %lu - ", groups_[old_size + i].size());
+      printf(" %lu - ", next_group_offsets_[old_size + i + 1] -
+                            next_group_offsets_[old_size + i]);
     }
     printf("\n");
 #endif
-    xors_.resize(xors_.size() + num_groups_when_bch_fail_ * bch_n_, 0);
-    checksums_.resize(checksums_.size() + num_groups_when_bch_fail_, 0);
-    to_original_group_id_.resize(
-        to_original_group_id_.size() + num_groups_when_bch_fail_,
+    next_xors_.resize(next_xors_.size() + num_groups_when_bch_fail_ * bch_n_,
+                      0);
+    next_checksums_.resize(next_checksums_.size() + num_groups_when_bch_fail_,
+                           0);
+    next_to_original_group_id_.resize(
+        next_to_original_group_id_.size() + num_groups_when_bch_fail_,
         to_original_group_id_[gid]);
   }
+  /**
+   * @brief The checksum of a group as sent to the other host
+   *
+   * Full-width checksums are the XOR of the group itself; narrower ones are
+   * hashed first, so that even structured keys (e.g., consecutive integers)
+   * collide with probability 2^-checksum_bits_.
+   *
+   * @param checksum      XOR of all elements in the group
+   * @return              the checksum to send (or compare against)
+   */
+  [[nodiscard]] checksum_t wireChecksum_(checksum_t checksum) const noexcept {
+    if (checksum_bits_ >= 8 * sizeof(checksum_t)) return checksum;
+    uint64_t hash = Traits::hash(checksum, CHECKSUM_SEED);
+    return static_cast<checksum_t>(hash & ((uint64_t(1) << checksum_bits_) - 1));
+  }
+
   /**
    * @brief Check whether there are exceptions in a group
    *
@@ -529,13 +1108,15 @@ class ParityBitmapSketch {
    * @param checksum             checksum
    */
   void doDecodeCheck_(std::size_t gid, ssize_t p, const uint64_t *bin_id_start,
-                      const key_t *a_xor, key_t checksum) {
-    std::vector<key_t> recovered;
-    key_t b_checksum = checksums_[gid];
+                      const word_t *a_xor, checksum_t checksum) {
+    std::vector<word_t> recovered;
+    checksum_t b_checksum = checksums_[gid];
     size_t b_xor_start = bch_n_ * gid;
     for (ssize_t i = 0; i < p; ++i) {
       size_t bid = bin_id_start[i];
-      auto elm = a_xor[i] ^ xors_[b_xor_start + bid];
+      // bins are 1 .. bch_n_ - 1, anything else comes from a corrupt message
+      if (bid == 0 || bid >= bch_n_) continue;
+      word_t elm = a_xor[i] ^ xors_[b_xor_start + bid];
       size_t expected_gid = to_original_group_id_[gid];
       size_t obtained_gid = getGroupId_(elm);
       size_t obtained_bid = getBinId_(elm);
@@ -544,34 +1125,34 @@ class ParityBitmapSketch {
         // Note that even if it turned out to be a fake, our algorithm can
         // automatically fixes it in later rounds
         recovered.push_back(elm);
-        b_checksum ^= elm;
+        b_checksum ^= static_cast<checksum_t>(elm);
       }
     }
     // insert into results
     recovered_[round_count_].insert(recovered_[round_count_].end(),
                                     recovered.begin(), recovered.end());
     // checksum verification
-    if (checksum != b_checksum) {
+    if (checksum != wireChecksum_(b_checksum)) {
       // type (I) and/or (II) exception happened
       // Note that, here we actually should change this corresponding group
       // to the set difference between it and the recovered set.
       // However, we simply appended all recovered elements into this group,
       // because all our encoding operators are XOR-like, which means the common
       // elements will be automatically cancelled out.
-      groups_[gid].insert(groups_[gid].end(), recovered.begin(),
-                          recovered.end());
+      appendGroup_(gid, recovered.data(), recovered.data() + recovered.size());
 #ifdef DEBUG_PBS
       printf(
           "%s: group id %lu | group size %lu | decoded %lu | # of groups %lu\n",
-          (role_ == PbsRole::Alice ? "Alice" : "Bob"), gid, groups_[gid].size(),
-          recovered.size(), groups_.size());
+          (role_ == PbsRole::Alice ? "Alice" : "Bob"), gid,
+          next_group_offsets_.back() -
+              next_group_offsets_[next_group_offsets_.size() - 2],
+          recovered.size(), next_group_offsets_.size() - 1);
 #endif
       // notice this encoder this group needs further handling
       // groups_to_be_handled_.push_back(gid);
-      groups_.push_back(std::move(groups_[gid]));
-      to_original_group_id_.push_back(to_original_group_id_[gid]);
-      xors_.resize(xors_.size() + bch_n_, 0u);
-      checksums_.push_back(0u);
+      next_to_original_group_id_.push_back(to_original_group_id_[gid]);
+      next_xors_.resize(next_xors_.size() + bch_n_, 0u);
+      next_checksums_.push_back(0u);
       groups_exp_I_or_II_.push_back(gid);
     }
   }
@@ -579,21 +1160,145 @@ class ParityBitmapSketch {
   /**
    * @brief Update internal states
    *
+   * Groups still to be reconciled were built in the next generation during
+   * this round, so the completed groups are dropped by swapping the
+   * generations. The old generation is cleared and keeps its buffers for the
+   * round after, so no element is moved here.
    */
   inline void removeCompletedGroups_() {
     // recoding old size
     if (role_ == PbsRole::Alice) hint_max_range_ = num_groups_remaining_;
-    // remove all groups in which reconciliation has completed
-    groups_.erase(groups_.begin(), groups_.begin() + num_groups_remaining_);
-    xors_.erase(xors_.begin(), xors_.begin() + bch_n_ * num_groups_remaining_);
-    checksums_.erase(checksums_.begin(),
-                     checksums_.begin() + num_groups_remaining_);
-    to_original_group_id_.erase(
-        to_original_group_id_.begin(),
-        to_original_group_id_.begin() + num_groups_remaining_);
-    num_groups_remaining_ = groups_.size();
+    group_source_ = nullptr;
+    group_keys_.swap(next_group_keys_);
+    group_offsets_.swap(next_group_offsets_);
+    to_original_group_id_.swap(next_to_original_group_id_);
+    xors_.swap(next_xors_);
+    checksums_.swap(next_checksums_);
+    next_group_keys_.clear();
+    next_group_offsets_.assign(1, 0);
+    next_to_original_group_id_.clear();
+    next_xors_.clear();
+    next_checksums_.clear();
+    num_groups_remaining_ = group_offsets_.size() - 1;
+  }
+
+  /**
+   * @brief Partition all added elements into groups
+   *
+   * A counting pass over the group ids sizes every group, then the elements
+   * are scattered into one contiguous array. With many groups the scatter
+   * goes through two radix passes (high bits of the group id first), so that
+   * each pass writes to at most a few thousand places at a time. Both passes
+   * are stable, hence the layout is the same as with a single pass.
+   *
+   * Groups read on demand (see group_source_) are copied into the arena.
+   */
+  void buildGroups_() {
+    if (group_source_) {
+      group_offsets_.assign(1, 0);
+      for (size_t gid = 0; gid < num_groups_remaining_; ++gid) {
+        auto [group, sz] = group_source_(gid);
+        group_keys_.insert(group_keys_.end(), group, group + sz);
+        group_offsets_.push_back(group_keys_.size());
+      }
+      group_source_ = nullptr;
+      return;
+    }
+    if (!groups_pending_) return;
+    groups_pending_ = false;
+    group_offsets_.assign(num_groups_ + 1, 0);
+    for (auto gid : pending_gids_) ++group_offsets_[gid + 1];
+    std::partial_sum(group_offsets_.begin(), group_offsets_.end(),
+                     group_offsets_.begin());
+
+    utils::MappableVector<word_t> partitioned;
+    if (num_groups_ <= RADIX_DIRECT_MAX_GROUPS) {
+      partitioned.resize(group_keys_.size());
+      scatterByGroup_(group_keys_.data(), pending_gids_.data(),
+                      group_keys_.size(), 0, partitioned.data());
+    } else {
+      // first pass: split by the top bits of the group id, which yields
+      // buckets of consecutive groups; second pass: scatter each bucket
+      unsigned shift = 0;
+      while (((num_groups_ - 1) >> shift) >= (1u << RADIX_FIRST_PASS_BITS))
+        ++shift;
+      size_t num_buckets = ((num_groups_ - 1) >> shift) + 1;
+      std::vector<size_t> bucket_offsets(num_buckets + 1);
+      for (size_t b = 0; b <= num_buckets; ++b)
+        bucket_offsets[b] = group_offsets_[std::min(b << shift, num_groups_)];
+
+      std::vector<word_t> bucket_keys(group_keys_.size());
+      std::vector<uint32_t> bucket_gids(group_keys_.size());
+      std::vector<size_t> cursor(bucket_offsets.begin(),
+                                 bucket_offsets.end() - 1);
+      for (size_t i = 0; i < group_keys_.size(); ++i) {
+        size_t pos = cursor[pending_gids_[i] >> shift]++;
+        bucket_keys[pos] = group_keys_[i];
+        bucket_gids[pos] = pending_gids_[i];
+      }
+      utils::MappableVector<word_t>().swap(group_keys_);
+      std::vector<uint32_t>().swap(pending_gids_);
+
+      partitioned.resize(bucket_keys.size());
+      for (size_t b = 0; b < num_buckets; ++b) {
+        size_t first = bucket_offsets[b];
+        scatterByGroup_(bucket_keys.data() + first, bucket_gids.data() + first,
+                        bucket_offsets[b + 1] - first, b << shift,
+                        partitioned.data());
+      }
+    }
+    group_keys_.swap(partitioned);
+    std::vector<uint32_t>().swap(pending_gids_);
+  }
+
+  /**
+   * @brief Stable scatter of elements into their groups
+   *
+   * @param keys            elements to scatter
+   * @param gids            their group ids, all >= `first_gid`
+   * @param n               number of elements
+   * @param first_gid       smallest group id among `gids`
+   * @param out             the group arena (indexed by group_offsets_)
+   */
+  void scatterByGroup_(const word_t *keys, const uint32_t *gids, size_t n,
+                       size_t first_gid, word_t *out) const {
+    if (n == 0) return;
+    size_t last_gid = *std::max_element(gids, gids + n) + 1;
+    std::vector<size_t> cursor(group_offsets_.begin() + first_gid,
+                               group_offsets_.begin() + last_gid);
+    for (size_t i = 0; i < n; ++i) out[cursor[gids[i] - first_gid]++] = keys[i];
+  }
+
+
+  /**
+   * @brief Append a copy of a group (plus some extra elements) as a new group
+   * of the next generation
+   *
+   * @param gid                   group to copy
+   * @param extra_first, extra_last    extra elements to append (could be null)
+   */
+  void appendGroup_(size_t gid, const word_t *extra_first,
+                    const word_t *extra_last) {
+    auto [group, sz] = groupElements_(gid);
+    next_group_keys_.insert(next_group_keys_.end(), group, group + sz);
+    next_group_keys_.insert(next_group_keys_.end(), extra_first, extra_last);
+    next_group_offsets_.push_back(next_group_keys_.size());
+  }
+
+  // number of elements in a group
+  [[nodiscard]] inline size_t groupSize_(size_t gid) const {
+    return group_offsets_[gid + 1] - group_offsets_[gid];
+  }
+
+  // elements of a group: pointer to the first one and how many there are
+  [[nodiscard]] std::pair<const word_t *, size_t> groupElements_(
+      size_t gid) const {
+    if (group_source_) return group_source_(gid);
+    return {group_keys_.data() + group_offsets_[gid], groupSize_(gid)};
   }
 };
 
+// PBS over 64-bit keys
+using ParityBitmapSketch = BasicParityBitmapSketch<uint64_t>;
 }  // end namespace libpbs
 #endif  // PARITY_BITMAP_SKETCH_H_
@@ -17,16 +17,43 @@
 
 #include <minisketch.h>
 
+#include <algorithm>
+#include <array>
 #include <cmath>
 #include <iterator>
+#include <optional>
+#include <stdexcept>
 #include <tuple>
 #include <type_traits>
 #include <vector>
 
 #include "bit_utils.h"
 #include "pbs_message.h"
+#include "thread_utils.h"
 
 namespace libpbs {
+namespace {
+// fewest groups worth handing to a separate decoding thread
+constexpr size_t MIN_GROUPS_PER_DECODING_THREAD = 16;
+// bits for the Rice parameter of the counts in the compact format
+constexpr unsigned COMPACT_COUNT_K_BITS = 2;
+// bits for the Rice parameter of the position gaps in the compact format
+constexpr unsigned COMPACT_GAP_K_BITS = 5;
+}
+
+/**
+ * @brief Serialization formats of PbsDecodingMessage
+ *
+ * The format is not part of the message itself; the receiver asks for one and
+ * both sides construct the message with it.
+ */
+enum class PbsDecodingFormat : uint8_t {
+  // each count in ceil(log2(t + 2)) bits, each position in field_sz bits
+  FIXED_WIDTH = 0,
+  // Golomb-Rice coded counts (relative to their typical value) and, for each
+  // group, Golomb-Rice coded gaps between the sorted positions
+  COMPACT = 1
+};
 
 /**
  * \brief  The PbsDecodingMessage class.
@@ -42,6 +69,17 @@ namespace libpbs {
  * Note that number of differences being -1 indicates that the `capacity` is not enough
  * for the BCH decoder to correctly decode the encoded message.
  *
+ * The positions of each group are kept in ascending order: setWith() (i.e.,
+ * doDecoding()) sorts them, whatever order minisketch returns them in, and
+ * parse() reads them that way. PbsDecodingFormat::COMPACT codes the gaps
+ * between them, so it relies on (and checks) this order, and the XORs Bob
+ * sends along (one per position, in the order of `decoded_differences`) line
+ * up with the positions Alice parses in either format.
+ *
+ * In the compact format, serializedSize() keeps the layout it computes for the
+ * next write(), so the message must not be changed (nor serialized from
+ * another thread) in between.
+ *
  */
 class PbsDecodingMessage : public PbsMessage {
  public:
@@ -61,6 +99,8 @@ class PbsDecodingMessage : public PbsMessage {
   std::vector<ssize_t> decoded_num_differences;
   // decoded elements ("bit error positions")
   std::vector<uint64_t> decoded_differences;
+  // serialization format
+  PbsDecodingFormat format;
 
   /**
    * @brief Constructor
@@ -68,8 +108,10 @@ class PbsDecodingMessage : public PbsMessage {
    * @param m            2^m -1 is the block length of BCH codes
    * @param t            error-correcting capacity of BCH codes
    * @param g            number of groups
+   * @param f            serialization format
    */
-  PbsDecodingMessage(uint32_t m, uint32_t t, size_t g)
+  PbsDecodingMessage(uint32_t m, uint32_t t, size_t g,
+                     PbsDecodingFormat f = PbsDecodingFormat::FIXED_WIDTH)
       : PbsMessage(PbsMessageType::DECODING),
         field_sz(m),
         capacity(t),
@@ -77,21 +119,29 @@ class PbsDecodingMessage : public PbsMessage {
         sizeof_each_d(utils::CeilLog2(capacity + 2)),
         decoding_failure_flag(utils::UIntXMax(sizeof_each_d)),
         decoded_num_differences(g),
-        decoded_differences(g * capacity) {}
+        decoded_differences(g * capacity),
+        format(f) {}
   ~PbsDecodingMessage() override = default;
 
   /**
    * @brief Set this message.
    *
+   * Each group is decoded into its own `capacity`-sized slot of
+   * `decoded_differences`, so groups can be decoded concurrently. The slots
+   * are compacted in group order afterwards, which makes the result (and its
+   * serialization) independent of the number of threads.
+   *
    * @tparam WritableIterator                 writable iterator type
    * @tparam ReadOnlyIterator                 readonly iterator type
    * @param sketch_a_first, sketch_a_last     range of the sketches from one host (the merged result will
    *                                          be writen to)
    * @param sketch_b_first                    the beginning of the sketch range from another host
+   * @param num_threads                       number of threads for decoding (0 means all hardware
+   *                                          threads)
    */
   template<typename WritableIterator, typename ReadOnlyIterator>
   void setWith(WritableIterator sketch_a_first, WritableIterator sketch_a_last,
-               ReadOnlyIterator sketch_b_first) {
+               ReadOnlyIterator sketch_b_first, unsigned num_threads = 1) {
     static_assert(
         std::is_same_v<
             typename std::iterator_traits<WritableIterator>::value_type,
@@ -103,16 +153,32 @@ class PbsDecodingMessage : public PbsMessage {
             minisketch *>,
         "ReadOnlyIterator should have a value_type of minisketch*");
 
-    size_t g = 0, offset = 0;
-    WritableIterator sketch_a_it = sketch_a_first;
-    ReadOnlyIterator sketch_b_it = sketch_b_first;
-    for (; sketch_a_it != sketch_a_last; ++sketch_a_it, ++sketch_b_it) {
-      decoded_num_differences[g] =
-          doDecoding(*sketch_a_it, *sketch_b_it, &decoded_differences[offset]);
-      if (decoded_num_differences[g] > 0) offset += decoded_num_differences[g];
-      ++g;
+    size_t g = std::distance(sketch_a_first, sketch_a_last);
+    decoded_num_differences.resize(g);
+    decoded_differences.resize(g * capacity);
+    utils::ParallelFor(g, num_threads, MIN_GROUPS_PER_DECODING_THREAD,
+                       [&](size_t first, size_t last) {
+                         auto sketch_a_it = std::next(sketch_a_first, first);
+                         auto sketch_b_it = std::next(sketch_b_first, first);
+                         for (size_t i = first; i < last;
+                              ++i, ++sketch_a_it, ++sketch_b_it)
+                           decoded_num_differences[i] = doDecoding(
+                               *sketch_a_it, *sketch_b_it,
+                               &decoded_differences[i * capacity]);
+                       });
+
+    // compact the per-group slots in order (offset never passes the slot)
+    size_t offset = 0;
+    for (size_t i = 0; i < g; ++i) {
+      auto p = decoded_num_differences[i];
+      if (p <= 0) continue;
+      if (offset != i * capacity)
+        std::copy_n(decoded_differences.begin() + i * capacity, p,
+                    decoded_differences.begin() + offset);
+      offset += p;
     }
     decoded_differences.resize(offset);
+    compact_layout_.reset();
   }
 
   /**
@@ -123,12 +189,15 @@ class PbsDecodingMessage : public PbsMessage {
    * @return                sizes being parsed, returns -1 if failed
    */
   ssize_t parse(const uint8_t *from, size_t msg_sz) override {
-    utils::BitReader reader(from);
+    compact_layout_.reset();
+    if (format == PbsDecodingFormat::COMPACT)
+      return parseCompact_(from, msg_sz);
+    utils::BitUnpacker reader(from, msg_sz);
 
     size_t count = 0;
     // read d part
     for (auto &decode_each_d : decoded_num_differences) {
-      auto d = reader.Read<uint32_t>(sizeof_each_d);
+      auto d = static_cast<uint32_t>(reader.Read(sizeof_each_d));
       if (d == decoding_failure_flag)
         decode_each_d = -1;
       else {
@@ -142,9 +211,8 @@ class PbsDecodingMessage : public PbsMessage {
     if (total_bytes > msg_sz) return -1;
 
     // read difference parts
-    for (auto &diff : decoded_differences) {
-      diff = reader.Read<uint64_t>(field_sz);
-    }
+    reader.ReadN(decoded_differences.data(), decoded_differences.size(),
+                 field_sz);
     return total_bytes;
   }
 
@@ -155,18 +223,18 @@ class PbsDecodingMessage : public PbsMessage {
    * @return      number of written bytes
    */
   ssize_t write(uint8_t *to) const override {
-    utils::BitWriter writer(to);
+    if (format == PbsDecodingFormat::COMPACT) return writeCompact_(to);
+    utils::BitPacker writer(to, serializedSize());
     // write d part
     for (const auto &decode_each_d : decoded_num_differences) {
       auto d = decode_each_d < 0 ? decoding_failure_flag
                                  : static_cast<uint32_t>(decode_each_d);
-      writer.Write<uint32_t>(d, sizeof_each_d);
+      writer.Write(d, sizeof_each_d);
     }
 
     // write difference parts
-    for (const auto &decode_each_difference : decoded_differences) {
-      writer.Write<uint64_t>(decode_each_difference, field_sz);
-    }
+    writer.WriteN(decoded_differences.data(), decoded_differences.size(),
+                  field_sz);
     // tell writer I am finished
     writer.Flush();
 
@@ -179,12 +247,197 @@ class PbsDecodingMessage : public PbsMessage {
    * @return  serialized size (in bytes)
    */
   [[nodiscard]] ssize_t serializedSize() const override {
+    if (format == PbsDecodingFormat::COMPACT) {
+      if (!compact_layout_) compact_layout_ = compactLayout_();
+      return utils::Bits2Bytes(compact_layout_->bits);
+    }
     size_t total_bits =
         sizeof_each_d * num_groups + field_sz * decoded_differences.size();
     return utils::Bits2Bytes(total_bits);
   }
 
  private:
+  /**
+   * @brief Parameters of a message in the compact format
+   *
+   * The message starts with a header of `center` (sizeof_each_d bits),
+   * `count_k` (COMPACT_COUNT_K_BITS bits) and `gap_k` (COMPACT_GAP_K_BITS
+   * bits). Then, for each group, the count (capacity + 1 for a BCH decoding
+   * failure) minus `center`, zigzag-mapped to unsigned and Rice coded with
+   * `count_k`. Then, for each group, the gaps between consecutive sorted
+   * positions (starting from 0, minus one since positions are distinct),
+   * Rice coded with `gap_k`.
+   */
+  struct CompactLayout {
+    uint32_t center;
+    unsigned count_k;
+    unsigned gap_k;
+    // total size of the message (in bits)
+    size_t bits;
+  };
+
+  // count as coded in the compact format
+  [[nodiscard]] uint32_t compactCount_(ssize_t d) const {
+    return d < 0 ? capacity + 1 : static_cast<uint32_t>(d);
+  }
+
+  // zigzag mapping of count - center to unsigned
+  static uint64_t ZigZag_(int64_t v) {
+    return v >= 0 ? uint64_t(v) << 1u : (uint64_t(-v) << 1u) - 1;
+  }
+
+  /**
+   * @brief Call `fn` with each gap of the compact format, group by group
+   *
+   * @tparam Fn     callable taking the gap (uint64_t)
+   * @param fn      callback
+   */
+  template <typename Fn>
+  void forEachGap_(Fn fn) const {
+    auto it = decoded_differences.begin();
+    for (auto d : decoded_num_differences) {
+      uint64_t prev = 0;
+      for (ssize_t i = 0; i < d; ++i, ++it) {
+        fn(*it - prev - 1);
+        prev = *it;
+      }
+    }
+  }
+
+  /**
+   * @brief Pick the parameters of the compact format for this message
+   *
+   * The counts are centered at their rounded mean (over groups decoded
+   * successfully), and each Rice parameter is the cheapest one among the
+   * candidates around the mean of its values.
+   *
+   * @return    the layout
+   */
+  [[nodiscard]] CompactLayout compactLayout_() const {
+    CompactLayout layout{0, 0, 0,
+                         sizeof_each_d + COMPACT_COUNT_K_BITS +
+                             COMPACT_GAP_K_BITS};
+    size_t decoded_groups = 0, total = 0;
+    for (auto d : decoded_num_differences) {
+      if (d < 0) continue;
+      ++decoded_groups;
+      total += d;
+    }
+    if (decoded_groups > 0)
+      layout.center = (total + decoded_groups / 2) / decoded_groups;
+
+    std::array<size_t, 1u << COMPACT_COUNT_K_BITS> count_bits{};
+    for (auto d : decoded_num_differences) {
+      auto z = ZigZag_(int64_t(compactCount_(d)) - int64_t(layout.center));
+      for (unsigned k = 0; k < count_bits.size(); ++k)
+        count_bits[k] += utils::BitPacker::RiceBits(z, k);
+    }
+    layout.count_k = std::min_element(count_bits.begin(), count_bits.end()) -
+                     count_bits.begin();
+    layout.bits += count_bits[layout.count_k];
+
+    // the gaps of a group add up to its largest (i.e., last) position minus
+    // its count
+    uint64_t gap_sum = 0;
+    auto it = decoded_differences.begin();
+    for (auto d : decoded_num_differences) {
+      if (d <= 0) continue;
+      uint64_t prev = 0;
+      for (ssize_t i = 0; i < d; ++i, ++it) {
+        if (*it <= prev)
+          throw std::invalid_argument(
+              "positions of a group must be nonzero and increasing");
+        prev = *it;
+      }
+      gap_sum += prev - d;
+    }
+    size_t num_gaps = decoded_differences.size();
+    if (num_gaps == 0) return layout;
+    auto mean_gap = gap_sum / num_gaps;
+    unsigned k_mid = mean_gap > 0 ? utils::CeilLog2(mean_gap + 1) - 1 : 0;
+    unsigned k_first = k_mid > 0 ? k_mid - 1 : 0;
+    unsigned k_max = (1u << COMPACT_GAP_K_BITS) - 1;
+    std::array<size_t, 3> gap_bits{};
+    forEachGap_([&](uint64_t gap) {
+      for (unsigned i = 0; i < gap_bits.size(); ++i)
+        gap_bits[i] += utils::BitPacker::RiceBits(
+            gap, std::min(k_first + i, k_max));
+    });
+    auto best = std::min_element(gap_bits.begin(), gap_bits.end());
+    layout.gap_k = std::min<unsigned>(k_first + (best - gap_bits.begin()),
+                                      k_max);
+    layout.bits += *best;
+    return layout;
+  }
+
+  /**
+   * @brief Write in the compact format
+   *
+   * @param to    buffer to write
+   * @return      number of written bytes
+   */
+  ssize_t writeCompact_(uint8_t *to) const {
+    auto layout = compact_layout_ ? *compact_layout_ : compactLayout_();
+    compact_layout_.reset();
+    size_t total_bytes = utils::Bits2Bytes(layout.bits);
+    utils::BitPacker writer(to, total_bytes);
+    writer.Write(layout.center, sizeof_each_d);
+    writer.Write(layout.count_k, COMPACT_COUNT_K_BITS);
+    writer.Write(layout.gap_k, COMPACT_GAP_K_BITS);
+    for (auto d : decoded_num_differences)
+      writer.WriteRice(
+          ZigZag_(int64_t(compactCount_(d)) - int64_t(layout.center)),
+          layout.count_k);
+    forEachGap_([&](uint64_t gap) { writer.WriteRice(gap, layout.gap_k); });
+    writer.Flush();
+    return total_bytes;
+  }
+
+  /**
+   * @brief Parse from a buffer in the compact format
+   *
+   * @param from            buffer to parse
+   * @param msg_sz          buffer size (in bytes)
+   * @return                sizes being parsed, returns -1 if failed
+   */
+  ssize_t parseCompact_(const uint8_t *from, size_t msg_sz) {
+    utils::BitUnpacker reader(from, msg_sz);
+    auto center = static_cast<int64_t>(reader.Read(sizeof_each_d));
+    auto count_k = static_cast<unsigned>(reader.Read(COMPACT_COUNT_K_BITS));
+    auto gap_k = static_cast<unsigned>(reader.Read(COMPACT_GAP_K_BITS));
+
+    size_t count = 0;
+    for (auto &decode_each_d : decoded_num_differences) {
+      uint64_t z = reader.ReadRice(count_k);
+      int64_t d = center + ((z & 1u) ? -int64_t((z + 1) >> 1u)
+                                      : int64_t(z >> 1u));
+      if (d < 0 || d > capacity + 1) return -1;
+      if (d == capacity + 1) {
+        decode_each_d = -1;
+      } else {
+        decode_each_d = static_cast<ssize_t>(d);
+        count += d;
+      }
+    }
+
+    decoded_differences.resize(count);
+    auto it = decoded_differences.begin();
+    // positions are elements of GF(2^field_sz), they index Alice's bins
+    uint64_t max_pos = (uint64_t(1) << field_sz) - 1;
+    for (auto d : decoded_num_differences) {
+      uint64_t prev = 0;
+      for (ssize_t i = 0; i < d; ++i) {
+        uint64_t gap = reader.ReadRice(gap_k);
+        if (gap >= max_pos - prev) return -1;
+        prev += gap + 1;
+        *it++ = prev;
+      }
+    }
+    size_t total_bytes = utils::Bits2Bytes(reader.BitsRead());
+    if (total_bytes > msg_sz) return -1;
+    return total_bytes;
+  }
+
   /**
    * @brief Do BCH decoding.
    *
@@ -196,9 +449,15 @@ class PbsDecodingMessage : public PbsMessage {
   inline ssize_t doDecoding(minisketch *sketch_a, const minisketch *sketch_b,
                             uint64_t *difference_start) const {
     minisketch_merge(sketch_a, sketch_b);
-    return minisketch_decode(sketch_a, capacity, difference_start);
+    ssize_t p = minisketch_decode(sketch_a, capacity, difference_start);
+    // in the order they are sent in the compact format
+    if (p > 1) std::sort(difference_start, difference_start + p);
+    return p;
   }
 
+  // layout computed by serializedSize() for the next write()
+  mutable std::optional<CompactLayout> compact_layout_;
+
 };  // end PbsDecodingMessage
 }  // end namespace libpbs
 
@@ -11,6 +11,7 @@
 #ifndef _PBS_DECODING_HINT_MESSAGE_H_
 #define _PBS_DECODING_HINT_MESSAGE_H_
 
+#include <algorithm>
 #include <numeric>
 #include <stdexcept>
 
@@ -31,23 +32,18 @@ constexpr std::size_t BITS_PER_BLOCK = 8u;
  *
  * About the design choice
  * -----------------------
- * In the current implementation, we only encode the IDs of groups where
- * exceptions happened, each of which has a length of log2 max_range bits.
- * According to our analysis, the probability of the event that a group becomes
- * the ideal case is around 0.96. That is the exception happens with a
- * probability of roughly 0.04. Therefore, the average number of bits using this
- * approach is around 0.04 * max_range * log2 max_range. An alternative approach
- * is to use a bitmap with a length of max_range. To make this approach better
- * than the one we currently use, we should have:
- *             0.04 * max_range * log2 max_range > max_range  ==> max_range >
- * 2^25 In most applications, max_range should be less than 2^25.
+ * We only need the IDs of groups where exceptions happened, which are added
+ * in increasing order. According to our analysis, an exception happens in a
+ * group with a probability of roughly 0.04, so the IDs are sparse and their
+ * gaps are roughly geometric. The message is one of
  *
+ *   - gaps: a 0 bit, the number of IDs (Elias-gamma coded), then the first ID
+ *     and the gaps between consecutive IDs (minus one) Golomb-Rice coded with
+ *     a parameter derived from the number of IDs and max_range
+ *   - bitmap: a 1 bit, then one bit for each of the max_range groups
  *
- *
- * Note that need pay special attention to the cases where bits_each <= 4.
- * Currently, we shift gid by 1 so whenever we encounter a zero, it means
- * termination. Actually, we can also use the property that the group IDs are in
- * increasing order (can save 1 bit per each group ID).
+ * whichever is smaller, so dense hints never cost more than max_range + 1
+ * bits. An empty hint is an empty message.
  *
  * Note that there is no need for the hint of BCH decoding failure.
  *
@@ -73,9 +69,9 @@ class PbsEncodingHintMessage : public PbsMessage {
   ~PbsEncodingHintMessage() override = default;
   // maximum range of group IDs
   std::size_t max_range;
-  // bits for each ID
+  // bits for a plain ID
   std::size_t bits_each;
-  // IDs of groups where exception (I) or (II) happened
+  // IDs of groups where exception (I) or (II) happened (increasing)
   std::vector<uint32_t> groups_with_exceptions;
 
   /**
@@ -86,28 +82,44 @@ class PbsEncodingHintMessage : public PbsMessage {
    * @return                sizes being parsed, returns -1 if failed
    */
   ssize_t parse(const uint8_t *from, size_t msg_sz) override {
+    groups_with_exceptions.clear();
     if (msg_sz == 0) return 0;
-    utils::BitReader reader(from);
-    auto count = msg_sz * 8 / bits_each;
+    utils::BitUnpacker reader(from, msg_sz);
+
+    if (reader.Read(1) == BITMAP_MODE) {
+      if (utils::Bits2Bytes(1 + max_range) > msg_sz) return -1;
+      for (size_t gid = 0; gid < max_range; ++gid)
+        if (reader.Read(1)) groups_with_exceptions.push_back(gid);
+      return utils::Bits2Bytes(reader.BitsRead());
+    }
 
+    // Elias-gamma coded count
+    auto len = reader.ReadRice(0);
+    if (len >= 64) return -1;
+    size_t count = (uint64_t(1) << len) | reader.Read(len);
+    if (count > max_range) return -1;
+    unsigned k = riceParameter_(count);
     groups_with_exceptions.reserve(count);
+    uint64_t gid = 0;
     for (size_t i = 0; i < count; ++i) {
-      auto gid = reader.Read<uint32_t>(bits_each);
-      if (gid == 0 && i > 0) break;
-      if (gid >= max_range) throw std::out_of_range("gid is out of range");
+      gid += reader.ReadRice(k) + (i > 0);
+      if (gid >= max_range) return -1;
       groups_with_exceptions.push_back(gid);
     }
-
-    return msg_sz;
+    size_t total_bytes = utils::Bits2Bytes(reader.BitsRead());
+    if (total_bytes > msg_sz) return -1;
+    return total_bytes;
   }
 
   /**
    * @brief Add a group ID
    *
-   * @param gid     group ID
+   * @param gid     group ID (larger than all IDs added before)
    */
   void addGroupId(uint32_t gid) {
     if (gid >= max_range) throw std::out_of_range("gid is out of range");
+    if (!groups_with_exceptions.empty() && gid <= groups_with_exceptions.back())
+      throw std::invalid_argument("gids must be added in increasing order");
     groups_with_exceptions.push_back(gid);
   }
 
@@ -118,13 +130,35 @@ class PbsEncodingHintMessage : public PbsMessage {
    * @return      number of written bytes
    */
   ssize_t write(uint8_t *to) const override {
-    auto sz = serializedSize();
-    std::fill(to, to + sz, 0);
-    utils::BitWriter writer(to);
+    size_t gap_bits = gapModeBits_();
+    if (gap_bits == 0) return 0;
+    size_t bitmap_bits = 1 + max_range;
+    size_t sz = utils::Bits2Bytes(std::min(gap_bits, bitmap_bits));
+    utils::BitPacker writer(to, sz);
 
-    for (uint32_t gid : groups_with_exceptions)
-      writer.Write<uint32_t>(gid, bits_each);
-    // tell writer that I am completed
+    if (bitmap_bits < gap_bits) {
+      writer.Write(BITMAP_MODE, 1);
+      size_t next = 0;
+      for (uint32_t gid : groups_with_exceptions) {
+        for (; next < gid; ++next) writer.Write(0, 1);
+        writer.Write(1, 1);
+        next = gid + 1;
+      }
+      for (; next < max_range; ++next) writer.Write(0, 1);
+    } else {
+      size_t count = groups_with_exceptions.size();
+      unsigned len = utils::CeilLog2(count + 1) - 1;
+      writer.Write(GAP_MODE, 1);
+      writer.WriteRice(len, 0);
+      writer.Write(count, len);
+      unsigned k = riceParameter_(count);
+      uint64_t prev = 0;
+      for (size_t i = 0; i < count; ++i) {
+        uint32_t gid = groups_with_exceptions[i];
+        writer.WriteRice(gid - prev - (i > 0), k);
+        prev = gid;
+      }
+    }
     writer.Flush();
     return sz;
   }
@@ -135,8 +169,52 @@ class PbsEncodingHintMessage : public PbsMessage {
    * @return    serialized size
    */
   [[nodiscard]] ssize_t serializedSize() const override {
-    auto total_bits = groups_with_exceptions.size() * bits_each;
-    return utils::Bits2Bytes(total_bits);
+    size_t gap_bits = gapModeBits_();
+    if (gap_bits == 0) return 0;
+    return utils::Bits2Bytes(std::min(gap_bits, 1 + max_range));
+  }
+
+ private:
+  static constexpr uint64_t GAP_MODE = 0;
+  static constexpr uint64_t BITMAP_MODE = 1;
+
+  /**
+   * @brief Rice parameter for the gaps of `count` IDs out of max_range
+   *
+   * The gaps of uniformly spread IDs are roughly geometric with mean
+   * max_range / count, for which 2^k of about 0.69 times the mean is close to
+   * optimal.
+   *
+   * @param count   number of IDs
+   * @return        the Rice parameter
+   */
+  [[nodiscard]] unsigned riceParameter_(size_t count) const {
+    uint64_t scaled = max_range * 11 / (16 * count);
+    return scaled > 1 ? utils::CeilLog2(scaled + 1) - 1 : 0;
+  }
+
+  /**
+   * @brief Size of the message in gap mode (in bits)
+   *
+   * Also checks that the IDs are increasing.
+   *
+   * @return    number of bits, 0 for an empty message
+   */
+  [[nodiscard]] size_t gapModeBits_() const {
+    size_t count = groups_with_exceptions.size();
+    if (count == 0) return 0;
+    unsigned len = utils::CeilLog2(count + 1) - 1;
+    size_t bits = 1 + utils::BitPacker::RiceBits(len, 0) + len;
+    unsigned k = riceParameter_(count);
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t gid = groups_with_exceptions[i];
+      if (i > 0 && gid <= prev)
+        throw std::invalid_argument("gids must be in increasing order");
+      bits += utils::BitPacker::RiceBits(gid - prev - (i > 0), k);
+      prev = gid;
+    }
+    return bits;
   }
 };
 }  // end namespace libpbs
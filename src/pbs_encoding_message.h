@@ -13,15 +13,21 @@
 
 #include <minisketch.h>
 
-#include <cstdlib>
 #include <cstring>
 #include <memory>
 #include <vector>
 
 #include "bit_utils.h"
 #include "pbs_message.h"
+#include "sketch_pool.h"
 
 namespace libpbs {
+namespace {
+// largest serialized sketch parse_bad() reassembles on the stack (larger
+// ones, beyond what PbsParam picks, use the heap)
+constexpr size_t MAX_STACK_SKETCH_BYTES = 1024;
+}  // namespace
+
 /**
  * @brief The PbsEncodingMessage class.
  *
@@ -30,6 +36,9 @@ namespace libpbs {
  * for the receiver to decode where his parity bitmaps (bitmaps
  * for his subsets/groups) are different from the sender's.
  *
+ * The sketches are borrowed from utils::SketchPool::Global() and returned to
+ * it when the message is destroyed.
+ *
  */
 class PbsEncodingMessage : public PbsMessage {
  public:
@@ -51,11 +60,14 @@ class PbsEncodingMessage : public PbsMessage {
     create_sketches();
   }
 
-  /// deconstructor (release memory)
+  /// deconstructor (return the sketches to the pool)
   ~PbsEncodingMessage() override {
-    for (auto sketch : sketches_) minisketch_destroy(sketch);
+    utils::SketchPool::Global().release(sketches_.data(), sketches_.size());
   }
 
+  PbsEncodingMessage(const PbsEncodingMessage &) = delete;
+  PbsEncodingMessage &operator=(const PbsEncodingMessage &) = delete;
+
   // field size
   uint32_t field_sz;
   // largest supported range (2^field_sz - 1)
@@ -117,8 +129,9 @@ class PbsEncodingMessage : public PbsMessage {
     uint32_t sketch_sz = field_sz * capacity;
     uint32_t sketch_bytes = sketch_sz / 8;
     uint32_t sketch_bits_remainder = sketch_sz % 8;
-    size_t total_bytes = serializedSize();
-    std::fill(to, to + total_bytes, 0);
+    ssize_t total_bytes = serializedSize();
+    if (total_bytes < 0) return -1;
+    // every byte is overwritten, so there is no need to clear the buffer
     if (sketch_bits_remainder == 0)
       write_good(to, sketch_bytes);
     else
@@ -127,6 +140,94 @@ class PbsEncodingMessage : public PbsMessage {
     return total_bytes;
   }
 
+  /**
+   * @brief Write this message to a chain of buffers
+   *
+   * Same layout as write(). Sketches are serialized in place wherever they
+   * do not span two buffers, the remaining bits (bad cases) are packed
+   * through a second cursor at the start of the remainder section.
+   *
+   * @param sink    buffers to write
+   * @return        the number of bytes written, returns -1 if failed
+   */
+  ssize_t writeScattered(utils::ScatterWriter &sink) const override {
+    ssize_t total_bytes = serializedSize();
+    if (total_bytes < 0 || size_t(total_bytes) > sink.Remaining()) return -1;
+    uint32_t sketch_sz = field_sz * capacity;
+    uint32_t sketch_bytes = sketch_sz / 8;
+    uint32_t sketch_bits_remainder = sketch_sz % 8;
+    uint8_t stack_buf[MAX_STACK_SKETCH_BYTES];
+    std::vector<uint8_t> heap_buf;
+    uint8_t *buf = stack_buf;
+    if (sketch_bytes + 1 > MAX_STACK_SKETCH_BYTES) {
+      heap_buf.resize(sketch_bytes + 1);
+      buf = heap_buf.data();
+    }
+    utils::ScatterWriter remainder = sink;
+    remainder.Advance(size_t(sketch_bytes) * num_groups);
+    // a bad-case sketch spills one byte over its whole bytes, which must not
+    // land on the remainder section (the last sketch)
+    size_t spill = sketch_bits_remainder == 0 ? 0 : 1;
+    for (uint32_t i = 0; i < num_groups; ++i) {
+      uint8_t *window = sink.Window(sketch_bytes + spill);
+      if (window != nullptr && (spill == 0 || i + 1 < num_groups)) {
+        minisketch_serialize(sketches_[i], window);
+        if (spill)
+          remainder.WriteBits(window[sketch_bytes], sketch_bits_remainder);
+        sink.Advance(sketch_bytes);
+      } else {
+        minisketch_serialize(sketches_[i], buf);
+        if (spill)
+          remainder.WriteBits(buf[sketch_bytes], sketch_bits_remainder);
+        sink.Put(buf, sketch_bytes);
+      }
+    }
+    if (spill) {
+      remainder.FlushBits();
+      sink.Advance(total_bytes - size_t(sketch_bytes) * num_groups);
+    }
+    return total_bytes;
+  }
+
+  /**
+   * @brief Parse this message from a chain of buffers (see parse())
+   *
+   * @param source          buffers to parse
+   * @return                sizes being parsed, returns -1 if failed
+   */
+  ssize_t parseGathered(utils::GatherReader &source) override {
+    if (field_sz == 0 || capacity == 0 || num_groups == 0) return -1;
+    uint32_t sketch_sz = field_sz * capacity;
+    size_t total_bytes = utils::Bits2Bytes(size_t(sketch_sz) * num_groups);
+    if (total_bytes > source.Remaining()) return -1;
+    uint32_t sketch_bytes = sketch_sz / 8;
+    uint32_t sketch_bits_remainder = sketch_sz % 8;
+    uint8_t stack_buf[MAX_STACK_SKETCH_BYTES];
+    std::vector<uint8_t> heap_buf;
+    uint8_t *buf = stack_buf;
+    if (sketch_bytes + 1 > MAX_STACK_SKETCH_BYTES) {
+      heap_buf.resize(sketch_bytes + 1);
+      buf = heap_buf.data();
+    }
+    utils::GatherReader remainder = source;
+    remainder.Skip(size_t(sketch_bytes) * num_groups);
+    for (uint32_t i = 0; i < num_groups; ++i) {
+      const uint8_t *window = source.Window(sketch_bytes);
+      if (sketch_bits_remainder == 0 && window != nullptr) {
+        minisketch_deserialize(sketches_[i], window);
+        source.Skip(sketch_bytes);
+        continue;
+      }
+      source.Get(buf, sketch_bytes);
+      if (sketch_bits_remainder)
+        buf[sketch_bytes] =
+            static_cast<uint8_t>(remainder.ReadBits(sketch_bits_remainder));
+      minisketch_deserialize(sketches_[i], buf);
+    }
+    source.Skip(total_bytes - size_t(sketch_bytes) * num_groups);
+    return total_bytes;
+  }
+
   /**
    * @brief Get all sketches
    *
@@ -187,44 +288,65 @@ class PbsEncodingMessage : public PbsMessage {
    * is not divided by 8. For example, if each sketch takes 49 bits, then
    * sketch_bytes is 6 and sketch_bits_remainder is 1.
    *
+   * Every sketch is serialized in place, in one pass. minisketch_serialize()
+   * writes one byte more than the sketch's whole bytes; that byte holds the
+   * remaining bits, which are appended to the remainder section, and lands
+   * where the next sketch starts (so it is overwritten right after). For the
+   * last sketch it lands on the first byte of the remainder section, which
+   * is restored.
+   *
    * @param to                          buffer to write
    * @param sketch_bytes                bytes per sketch
    * @param sketch_bits_remainder       bits for each sketch
    */
   void write_bad(uint8_t *to, uint32_t sketch_bytes,
                  uint32_t sketch_bits_remainder) const {
-    auto *buf = (uint8_t *)malloc(sketch_bytes + 1);
-    uint32_t remainder_pos_start = sketch_bytes * num_groups;
-    utils::BitWriter writer(to + remainder_pos_start);
-    for (uint32_t i = 0; i < num_groups; ++i) {
-      memset(buf, 0, sketch_bytes + 1);
-      minisketch_serialize(sketches_[i], buf);
-      memcpy(to + i * sketch_bytes, buf, sketch_bytes);
-      writer.Write<uint8_t>(buf[sketch_bytes], sketch_bits_remainder);
+    size_t remainder_pos_start = size_t(sketch_bytes) * num_groups;
+    uint8_t *remainder = to + remainder_pos_start;
+    utils::BitPacker packer(
+        remainder, utils::Bits2Bytes(size_t(sketch_bits_remainder) * num_groups));
+    uint8_t *sketch = to;
+    for (uint32_t i = 0; i + 1 < num_groups; ++i, sketch += sketch_bytes) {
+      minisketch_serialize(sketches_[i], sketch);
+      packer.Write(sketch[sketch_bytes], sketch_bits_remainder);
     }
-    // tell writer I am finished
-    writer.Flush();
-    free(buf);
+    uint8_t saved = *remainder;
+    minisketch_serialize(sketches_[num_groups - 1], sketch);
+    packer.Write(sketch[sketch_bytes], sketch_bits_remainder);
+    *remainder = saved;
+    // tell packer I am finished
+    packer.Flush();
   }
 
   /**
    * @brief  Parse bad cases
    *
+   * Each sketch is put back together (its whole bytes and its remaining
+   * bits) in a buffer on the stack and deserialized into its (pooled) sketch.
+   *
    * @param from                          buffer to parse
    * @param sketch_bytes                  bytes per sketch
    * @param sketch_bits_remainder         bits for each sketch
    */
   void parse_bad(const uint8_t *from, uint32_t sketch_bytes,
                  uint8_t sketch_bits_remainder) {
-    auto *buf = (uint8_t *)malloc(sketch_bytes + 1);
-    uint32_t remainder_pos_start = sketch_bytes * num_groups;
-    utils::BitReader reader(from + remainder_pos_start);
+    size_t remainder_pos_start = size_t(sketch_bytes) * num_groups;
+    utils::BitUnpacker unpacker(
+        from + remainder_pos_start,
+        utils::Bits2Bytes(size_t(sketch_bits_remainder) * num_groups));
+    uint8_t stack_buf[MAX_STACK_SKETCH_BYTES];
+    std::vector<uint8_t> heap_buf;
+    uint8_t *buf = stack_buf;
+    if (sketch_bytes + 1 > MAX_STACK_SKETCH_BYTES) {
+      heap_buf.resize(sketch_bytes + 1);
+      buf = heap_buf.data();
+    }
     for (uint32_t i = 0; i < num_groups; ++i) {
-      memcpy(buf, from + i * sketch_bytes, sketch_bytes);
-      buf[sketch_bytes] = reader.Read<uint8_t>(sketch_bits_remainder);
+      std::memcpy(buf, from + size_t(i) * sketch_bytes, sketch_bytes);
+      buf[sketch_bytes] =
+          static_cast<uint8_t>(unpacker.Read(sketch_bits_remainder));
       minisketch_deserialize(sketches_[i], buf);
     }
-    free(buf);
   }
 
   /**
@@ -234,25 +356,18 @@ class PbsEncodingMessage : public PbsMessage {
    * @param sketch_bytes     bytes per sketch
    */
   void parse_good(const uint8_t *from, uint32_t sketch_bytes) {
-    sketches_.clear();
-    auto *buf = (uint8_t *)malloc(sketch_bytes + 1);
-    for (uint32_t i = 0; i < num_groups; ++i) {
-      minisketch *parsed_sketch = minisketch_create(field_sz, 0, capacity);
-      memcpy(buf, from + i * sketch_bytes, sketch_bytes);
-      minisketch_deserialize(parsed_sketch, buf);
-      sketches_.push_back(parsed_sketch);
-    }
-    free(buf);
+    for (uint32_t i = 0; i < num_groups; ++i)
+      minisketch_deserialize(sketches_[i], from + i * sketch_bytes);
   }
 
   /**
-   * @brief Create sketches.
+   * @brief Borrow (all-zero) sketches from the pool.
    *
    */
   void create_sketches() {
-    for (size_t i = 0; i < num_groups; ++i) {
-      sketches_.push_back(minisketch_create(field_sz, 0, capacity));
-    }
+    sketches_.resize(num_groups);
+    utils::SketchPool::Global().acquire(field_sz, capacity, num_groups,
+                                        sketches_.data());
   }
   std::vector<minisketch *> sketches_;
 };
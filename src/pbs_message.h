@@ -14,6 +14,10 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include <vector>
+
+#include "scatter_gather.h"
+
 namespace libpbs {
 /**
  * @brief PBS message types
@@ -57,6 +61,55 @@ class PbsMessage {
    */
   virtual ssize_t serializedSize() const = 0;
 
+  /**
+   * @brief Serialize a PBS message into a chain of buffers.
+   *
+   * The default writes in place when the next serializedSize() bytes of the
+   * sink are contiguous and goes through a temporary buffer otherwise.
+   *
+   * @param sink              Buffers to write.
+   * @return ssize_t          Bytes write.
+   * @retval -1               Serialization failed (nothing is written).
+   */
+  virtual ssize_t writeScattered(utils::ScatterWriter &sink) const {
+    ssize_t total_bytes = serializedSize();
+    if (total_bytes < 0 || size_t(total_bytes) > sink.Remaining()) return -1;
+    if (uint8_t *window = sink.Window(total_bytes)) {
+      if (write(window) != total_bytes) return -1;
+      sink.Advance(total_bytes);
+      return total_bytes;
+    }
+    std::vector<uint8_t> buf(total_bytes);
+    if (write(buf.data()) != total_bytes) return -1;
+    sink.Put(buf.data(), total_bytes);
+    return total_bytes;
+  }
+
+  /**
+   * @brief Deserialize a PBS message from a chain of buffers.
+   *
+   * The default parses in place when the rest of the source is contiguous
+   * and gathers the rest into a temporary buffer otherwise. Only the bytes
+   * read are consumed.
+   *
+   * @param source            Buffers to read.
+   * @return ssize_t          Bytes read.
+   * @retval -1               Deserialization failed (nothing is consumed).
+   */
+  virtual ssize_t parseGathered(utils::GatherReader &source) {
+    size_t msg_sz = source.Remaining();
+    ssize_t bytes_read;
+    if (const uint8_t *window = source.Window(msg_sz)) {
+      bytes_read = parse(window, msg_sz);
+    } else {
+      std::vector<uint8_t> buf(msg_sz);
+      utils::GatherReader(source).Get(buf.data(), msg_sz);
+      bytes_read = parse(buf.data(), msg_sz);
+    }
+    if (bytes_read > 0) source.Skip(bytes_read);
+    return bytes_read;
+  }
+
   PbsMessageType type;
 };
 }  // namespace libpbs
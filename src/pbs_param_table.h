@@ -0,0 +1,97 @@
+/**
+ * @file pbs_param_table.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Precomputed best BCH parameters compiled into the library
+ * @version 0.1
+ * @date 2020-08-05
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef PBS_PARAM_TABLE_H_
+#define PBS_PARAM_TABLE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+
+namespace pbsutils {
+/**
+ * @brief One row of a parameter table: the best BCH parameter for d
+ */
+struct PbsParamTableEntry {
+  // cardinality of the set difference
+  uint64_t d;
+  // n = 2^m - 1 is the block length for this BCH code
+  uint32_t m;
+  // error-correcting capacity of this BCH code
+  uint32_t t;
+  // upper bound for the failure probability when using (m, t)
+  double failure_prob_ub;
+};
+
+/**
+ * @brief Best BCH parameters for a grid of d (in increasing order) and one
+ * configuration (target success probability, delta, r, c)
+ */
+struct PbsParamTable {
+  double target_prob;
+  double delta;
+  size_t r;
+  size_t c;
+  const PbsParamTableEntry *entries;
+  size_t size;
+};
+}  // namespace pbsutils
+
+// generated by gen_pbs_param_table (see the pbs_param_table target), defines
+// pbsutils::param_table::TABLES
+#if !defined(PBS_NO_PARAM_TABLE) && __has_include("pbs_param_table.inc")
+#include "pbs_param_table.inc"
+#define PBS_HAS_PARAM_TABLE 1
+#else
+#define PBS_HAS_PARAM_TABLE 0
+#endif
+
+namespace pbsutils {
+/**
+ * @brief Look up the best BCH parameter in the precomputed tables
+ *
+ * Grid points are used as they are. A d between two grid points (the grid is
+ * sparse for large d) gets the parameter of the next larger one, which is at
+ * least as strong since the failure probability grows with d.
+ *
+ * @param d                     cardinality of the set difference
+ * @param delta                 average number of distinct elements per group
+ * @param r                     maximum number of rounds
+ * @param c                     number of groups to be further partitioned
+ * when BCH decoding failed
+ * @param targetProb            target success probability
+ * @return                      the entry, nullptr if no table covers them
+ */
+inline const PbsParamTableEntry *findInParamTable(size_t d, double delta,
+                                                  size_t r, size_t c,
+                                                  double targetProb) {
+#if PBS_HAS_PARAM_TABLE
+  for (const auto &table : param_table::TABLES) {
+    if (std::abs(table.target_prob - targetProb) >=
+            std::numeric_limits<double>::epsilon() ||
+        table.delta != delta || table.r != r || table.c != c)
+      continue;
+    const auto *last = table.entries + table.size;
+    const auto *it = std::lower_bound(
+        table.entries, last, d,
+        [](const PbsParamTableEntry &entry, size_t d) { return entry.d < d; });
+    if (it != last) return it;
+  }
+#else
+  (void)d, (void)delta, (void)r, (void)c, (void)targetProb;
+#endif
+  return nullptr;
+}
+}  // namespace pbsutils
+
+#endif  // PBS_PARAM_TABLE_H_
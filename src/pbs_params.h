@@ -12,15 +12,29 @@
 #ifndef PBS_PARAMS_H_
 #define PBS_PARAMS_H_
 
-#include <tsl/ordered_map.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
 #include <eigen3/Eigen/Dense>
+#include <cmath>
+#include <mutex>
 #include <numeric>
+#include <shared_mutex>
+#include <limits>
+#include <stdexcept>
 #include <stats.hpp>
+#include <string>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "cache_helper.h"
+#include "pbs_param_table.h"
+#include "thread_utils.h"
 
 namespace pbsutils {
 
@@ -29,52 +43,6 @@ constexpr size_t MAX_BALLS = 200;
 constexpr size_t M_MIN = 6;
 constexpr size_t M_MAX = 14;
 constexpr double ONE_IN_240 = ((double)1.0) / 240.0;
-inline void make_sure_cache_dir_exists() {
-  boost::filesystem::path dir(DEFAULT_CACHE_DIR);
-  if (!boost::filesystem::exists(dir))
-    boost::filesystem::create_directories(dir);
-}
-inline std::string getCachedFilename(double targetProb) {
-  make_sure_cache_dir_exists();
-  if (std::abs(targetProb - 0.99) < std::numeric_limits<double>::epsilon()) {
-    return std::string(DEFAULT_CACHE_DIR) + "best_bch_parameters_99.csv";
-  } else if (std::abs(targetProb - ONE_IN_240) <
-             std::numeric_limits<double>::epsilon()) {
-    return std::string(DEFAULT_CACHE_DIR) + "best_bch_parameters_9958.csv";
-  } else {
-    throw std::runtime_error("Unsupported");
-  }
-}
-
-tsl::ordered_map<size_t, std::tuple<size_t, size_t, double>> &getDirectCache() {
-  static tsl::ordered_map<size_t, std::tuple<size_t, size_t, double>>
-      my_direct_cache;
-  return my_direct_cache;
-}
-
-inline void save2CachedFile(double targetProb) {
-  auto fn = getCachedFilename(targetProb);
-  std::ofstream ofp(fn);
-  if (!ofp.is_open()) throw std::runtime_error("Failed to open file " + fn);
-  for (const auto &kv : getDirectCache()) {
-    ofp << kv.first << " " << std::get<0>(kv.second) << " "
-        << std::get<1>(kv.second) << " " << std::get<2>(kv.second) << "\n";
-  }
-  ofp.close();
-}
-
-inline void loadFromCachedFile(double targetProb) {
-  auto fn = getCachedFilename(targetProb);
-  std::ifstream ifp(fn);
-  if (!ifp.is_open()) return;
-  while (!ifp.eof()) {
-    size_t d, m, t;
-    double prob;
-    ifp >> d >> m >> t >> prob;
-    getDirectCache().insert({d, {m, t, prob}});
-  }
-  ifp.close();
-}
 }  // end namespace
 
 // matrix type of double
@@ -92,6 +60,211 @@ struct BestBchParam {
   size_t t;
 };
 
+/**
+ * @brief Process-wide cache of the best BCH parameters, backed by one
+ * indexed file
+ *
+ * Entries are keyed by the configuration they were searched for (target
+ * success probability, delta, r, c) and d, so any target can be cached side
+ * by side with the others. The file (best_bch_parameters.log) is read once
+ * and indexed in memory. New entries are appended to it (one line each)
+ * rather than rewriting it. The doubles of a key are written in hexadecimal
+ * so that they are matched exactly. Readers and writers take flock() locks
+ * (shared and exclusive), so processes sharing the cache directory never see
+ * each other's lines half-written. Lines that cannot be parsed (e.g., left
+ * by a crashed writer) are skipped. A directory that cannot be created or
+ * written only disables the file: entries are still cached in memory. The
+ * cache is thread-safe, lookups share the lock once the file is loaded.
+ */
+class BchParamCache {
+ public:
+  using Entry = std::tuple<size_t, size_t, double>;
+
+  /**
+   * @brief The configuration a parameter is searched for
+   */
+  struct Config {
+    // target success probability
+    double target_prob;
+    // average number of distinct elements per group
+    double delta;
+    // maximum number of rounds
+    size_t r;
+    // number of groups to be further partitioned when BCH decoding failed
+    size_t c;
+  };
+
+  /**
+   * @brief Constructor
+   *
+   * @param dir     directory of the cache file (with a trailing slash)
+   */
+  explicit BchParamCache(std::string dir)
+      : path_(dir + "best_bch_parameters.log"), dir_(std::move(dir)) {}
+
+  BchParamCache(const BchParamCache &) = delete;
+  BchParamCache &operator=(const BchParamCache &) = delete;
+
+  /**
+   * @brief The cache shared by the whole process (in DEFAULT_CACHE_DIR)
+   *
+   * @return    the global cache
+   */
+  static BchParamCache &Global() {
+    static auto *cache = new BchParamCache(DEFAULT_CACHE_DIR);
+    return *cache;
+  }
+
+  /**
+   * @brief Look up the cached entry for d
+   *
+   * @param config          configuration searched for
+   * @param d               cardinality of the set difference
+   * @param entry           the entry, if found
+   * @return                whether it is found
+   */
+  bool find(const Config &config, size_t d, Entry &entry) {
+    {  // lookups only share the lock once the file is loaded
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      if (loaded_) return find_(config, d, entry);
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    load_();
+    return find_(config, d, entry);
+  }
+
+  /**
+   * @brief Cache the entry for d (appended to the file if it is new)
+   *
+   * @param config          configuration searched for
+   * @param d               cardinality of the set difference
+   * @param entry           the entry
+   */
+  void insert(const Config &config, size_t d, const Entry &entry) {
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      load_();
+      if (!entries_.insert({{config, d}, entry}).second) return;
+    }
+    // lookups do not wait for the file
+    append_(fmt::format("{:a} {:a} {} {} {} {} {} {}\n", config.target_prob,
+                        config.delta, config.r, config.c, d,
+                        std::get<0>(entry), std::get<1>(entry),
+                        std::get<2>(entry)));
+  }
+
+ private:
+  struct Key {
+    Config config;
+    size_t d;
+
+    bool operator==(const Key &other) const {
+      return config.target_prob == other.config.target_prob &&
+             config.delta == other.config.delta &&
+             config.r == other.config.r && config.c == other.config.c &&
+             d == other.d;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      size_t seed = 0;
+      for (size_t v :
+           {std::hash<double>()(key.config.target_prob),
+            std::hash<double>()(key.config.delta), key.config.r, key.config.c,
+            key.d})
+        seed ^= v + 0x9e3779b9 + (seed << 6u) + (seed >> 2u);
+      return seed;
+    }
+  };
+
+  bool find_(const Config &config, size_t d, Entry &entry) const {
+    auto it = entries_.find({config, d});
+    if (it == entries_.end()) return false;
+    entry = it->second;
+    return true;
+  }
+
+  // one line: target delta r c d m t failure_prob_ub
+  static bool parseLine_(const char *line, Key &key, Entry &entry) {
+    char *end = nullptr;
+    auto next_double = [&](double &val) {
+      val = std::strtod(line, &end);
+      bool ok = end != line;
+      line = end;
+      return ok;
+    };
+    auto next_size = [&](size_t &val) {
+      while (std::isspace(static_cast<unsigned char>(*line))) ++line;
+      if (!std::isdigit(static_cast<unsigned char>(*line))) return false;
+      val = std::strtoull(line, &end, 10);
+      line = end;
+      return true;
+    };
+    size_t m, t;
+    double prob;
+    if (!next_double(key.config.target_prob) ||
+        !next_double(key.config.delta) || !next_size(key.config.r) ||
+        !next_size(key.config.c) || !next_size(key.d) || !next_size(m) ||
+        !next_size(t) || !next_double(prob))
+      return false;
+    while (std::isspace(static_cast<unsigned char>(*line))) ++line;
+    if (*line != '\0') return false;
+    entry = {m, t, prob};
+    return true;
+  }
+
+  // reads the file the first time
+  void load_() {
+    if (loaded_) return;
+    loaded_ = true;
+    int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    std::string content;
+    ::flock(fd, LOCK_SH);
+    char buf[4096];
+    for (ssize_t n; (n = ::read(fd, buf, sizeof(buf))) > 0;)
+      content.append(buf, n);
+    ::flock(fd, LOCK_UN);
+    ::close(fd);
+
+    // only complete lines, a missing newline means an interrupted write
+    for (size_t pos = 0, eol; (eol = content.find('\n', pos)) !=
+                               std::string::npos;
+         pos = eol + 1) {
+      Key key{};
+      Entry entry;
+      if (parseLine_(content.substr(pos, eol - pos).c_str(), key, entry))
+        entries_.insert({key, entry});
+    }
+  }
+
+  void append_(const std::string &line) {
+    try {
+      boost::filesystem::create_directories(dir_);
+    } catch (const boost::filesystem::filesystem_error &) {
+      return;
+    }
+    int fd = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0644);
+    if (fd < 0) return;
+    ::flock(fd, LOCK_EX);
+    for (size_t written = 0; written < line.size();) {
+      ssize_t n = ::write(fd, line.data() + written, line.size() - written);
+      if (n <= 0) break;
+      written += n;
+    }
+    ::flock(fd, LOCK_UN);
+    ::close(fd);
+  }
+
+  const std::string path_;
+  const std::string dir_;
+  std::shared_mutex mutex_;
+  bool loaded_ = false;
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+};
+
 /**
  * @brief PbsParam class
  *
@@ -110,77 +283,151 @@ class PbsParam {
    * @param c                     number of groups to be further partitioned
    * when BCH decoding failed
    * @param targetProb            target success probability for PBS to
-   * reconcile all distinct elements in `r` rounds
+   * reconcile all distinct elements in `r` rounds (any value in (0, 1), the
+   * parameter is searched once and then cached, see BchParamCache)
    * @param bch_param             best parameter to be returned
+   * @param checksum_bits         width of the (hashed) group checksums, 0 for
+   * full-width checksums (whose false positives are not accounted for)
    * @return                      upper bound for the failure probability when
-   * using the best parameter
+   * using the best parameter (and checksums of that width)
+   *
+   * The BCH parameter only depends on `targetProb`, so that configurations
+   * with a precomputed table are served from it whatever the checksum width.
+   * False positives of short checksums come on top of the failure
+   * probability of BCH; their share of the budget is picked when sizing the
+   * checksums (see minChecksumBits()).
    */
   static double bestBchParam(size_t d, double delta, size_t r, size_t c,
-                             double targetProb, BestBchParam &bch_param) {
-    {  // load from cache
-      loadFromCachedFile(targetProb);
-      if (getDirectCache().contains(d)) {
-        auto cached_res = getDirectCache().at(d);
-        bch_param.m = std::get<0>(cached_res);
-        bch_param.t = std::get<1>(cached_res);
-        return std::get<2>(cached_res);
-      }
+                             double targetProb, BestBchParam &bch_param,
+                             unsigned checksum_bits = 0) {
+    if (!(targetProb > 0 && targetProb < 1))
+      throw std::invalid_argument(
+          "target success probability must be in (0, 1)");
+    double checksum_fp = checksumFailureUB(d, r, checksum_bits);
+    if (checksum_fp >= 1 - targetProb)
+      throw std::invalid_argument(
+          "checksums too short for the target success probability");
+    // precomputed (see pbs_param_table.h), neither file I/O nor search
+    if (const auto *entry = findInParamTable(d, delta, r, c, targetProb)) {
+      bch_param.m = entry->m;
+      bch_param.t = entry->t;
+      return entry->failure_prob_ub + checksum_fp;
+    }
+    BchParamCache::Config config{targetProb, delta, r, c};
+    BchParamCache::Entry cached_res;
+    if (BchParamCache::Global().find(config, d, cached_res)) {
+      bch_param.m = std::get<0>(cached_res);
+      bch_param.t = std::get<1>(cached_res);
+      return std::get<2>(cached_res) + checksum_fp;
     }
+    double failure_prob_ub =
+        searchBchParam(d, delta, r, c, targetProb, bch_param);
+    BchParamCache::Global().insert(config, d,
+                                   {bch_param.m, bch_param.t, failure_prob_ub});
+    return failure_prob_ub + checksum_fp;
+  }
+
+  /**
+   * @brief Upper bound for the probability that a short checksum hides an
+   * exception
+   *
+   * A group whose checksum is compared while it still has unrecovered
+   * distinct elements passes the check with probability 2^-k (k-bit hashes).
+   * Such a group holds at least one of the d distinct elements, so there are
+   * at most d of them in each of the r rounds (union bound).
+   *
+   * @param d                     cardinality of the set difference
+   * @param r                     maximum number of rounds
+   * @param checksum_bits         width of the checksums (0 for full width)
+   * @return                      the upper bound
+   */
+  static double checksumFailureUB(size_t d, size_t r, unsigned checksum_bits) {
+    if (checksum_bits == 0) return 0;
+    return std::min(1.0, static_cast<double>(d) * r *
+                             std::ldexp(1.0, -static_cast<int>(checksum_bits)));
+  }
+
+  /**
+   * @brief The narrowest checksums within a false-positive budget
+   *
+   * @param d                     cardinality of the set difference
+   * @param r                     maximum number of rounds
+   * @param budget                upper bound for checksumFailureUB()
+   * @return                      width of the checksums (in bits)
+   */
+  static unsigned minChecksumBits(size_t d, size_t r, double budget) {
+    unsigned bits = 1;
+    while (bits < 64 && checksumFailureUB(d, r, bits) > budget) ++bits;
+    return bits;
+  }
+
+  /**
+   * @brief Number of threads parameter searches use (see setSearchThreads())
+   *
+   * @return    number of threads, 0 means all hardware threads
+   */
+  static unsigned searchThreads() { return searchThreads_(); }
+
+  /**
+   * @brief Set the number of threads parameter searches use
+   *
+   * The field sizes are searched in parallel, and so are the terms of
+   * failureProbabilityUB() when there are threads to spare. The result does
+   * not depend on the number of threads.
+   *
+   * @param num_threads     number of threads, 0 means all hardware threads
+   */
+  static void setSearchThreads(unsigned num_threads) {
+    searchThreads_() = num_threads;
+  }
+
+  /**
+   * @brief Search the best BCH parameter (bestBchParam() without caching)
+   *
+   * @param d                     cardinality of the set difference
+   * @param delta                 average number of distinct elements per group
+   * @param r                     maximum number of rounds
+   * @param c                     number of groups to be further partitioned
+   * when BCH decoding failed
+   * @param targetProb            target success probability of BCH decoding
+   * @param bch_param             best parameter to be returned
+   * @param num_threads           number of threads (0 means all hardware
+   * threads)
+   * @return                      upper bound for the failure probability when
+   * using the best parameter
+   */
+  static double searchBchParam(size_t d, double delta, size_t r, size_t c,
+                               double targetProb, BestBchParam &bch_param,
+                               unsigned num_threads = searchThreads()) {
+    const size_t num_fields = M_MAX - M_MIN + 1;
+    unsigned threads = libpbs::utils::ResolveNumThreads(num_threads);
+    unsigned outer = std::min<unsigned>(threads, num_fields);
+    unsigned inner = std::max(1u, threads / outer);
+    std::vector<Candidate_> candidates(num_fields);
+    libpbs::utils::ParallelFor(
+        num_fields, outer, 1, [&](size_t first, size_t last) {
+          for (size_t k = first; k < last; ++k)
+            candidates[k] = searchCapacity_(d, delta, r, c, targetProb,
+                                            M_MIN + k, inner);
+        });
+
+    // in increasing m, as a serial search would
     double best_cost = std::numeric_limits<double>::max(), cost = 0;
     size_t m = 1, t = 1;
     double failure_prob_ub = -1.0;
-
-    for (size_t i = M_MIN; i <= M_MAX; ++i) {
-      auto t_min = i;
-      auto t_max = std::min(
-          MAX_BALLS, std::min((1lu << i) - 2lu, size_t(std::ceil(5 * delta))));
-      auto j = (1lu << i) - 1;
-      auto p_min = 1 - failureProbabilityUB(d, delta, j, r, t_min, c);
-      auto p_max = 1 - failureProbabilityUB(d, delta, j, r, t_max, c);
-
-      if (p_min >= targetProb) {
-        cost = static_cast<double>(t_min) * i;
-        if (cost < best_cost) {
-          best_cost = cost;
-          m = i;
-          t = t_min;
-          failure_prob_ub = 1 - p_min;
-        }
-      } else if (p_max >= targetProb) {
-        size_t t_mid = 0;
-        while (t_max - t_min > 1u) {
-          t_mid = t_min + (t_max - t_min) / 2;
-          auto p = 1 - failureProbabilityUB(d, delta, j, r, t_mid, c);
-          if (p >= targetProb)
-            t_max = t_mid;
-          else
-            t_min = t_mid;
-        }
-        auto p = 1 - failureProbabilityUB(d, delta, j, r, t_min, c);
-        size_t t_tmp = 0;
-        if (p >= targetProb)
-          t_tmp = t_min;
-        else {
-          t_tmp = t_max;
-          p = 1 - failureProbabilityUB(d, delta, j, r, t_max, c);
-        }
-        cost = static_cast<double>(t_tmp) * i;
-        if (cost < best_cost) {
-          best_cost = cost;
-          m = i;
-          t = t_tmp;
-          failure_prob_ub = 1 - p;
-        }
+    for (size_t k = 0; k < num_fields; ++k) {
+      if (!candidates[k].feasible) continue;
+      cost = static_cast<double>(candidates[k].t) * (M_MIN + k);
+      if (cost < best_cost) {
+        best_cost = cost;
+        m = M_MIN + k;
+        t = candidates[k].t;
+        failure_prob_ub = candidates[k].failure_prob_ub;
       }
     }
 
     bch_param.m = m;
     bch_param.t = t;
-
-    {  // save to cache
-      getDirectCache().insert({d, {bch_param.m, bch_param.t, failure_prob_ub}});
-      save2CachedFile(targetProb);
-    }
     return failure_prob_ub;
   }
 
@@ -203,8 +450,9 @@ class PbsParam {
    * probability
    * @return              "times 2 bound" for the failure probability
    */
-  static double computeFailureProbabilityBound(const Mat &mr_m2d, size_t m,
-                                               size_t n, size_t t, size_t r) {
+  static double computeFailureProbabilityBound(
+      const Eigen::Ref<const Mat> &mr_m2d, size_t m, size_t n, size_t t,
+      size_t r) {
     double prob_fail_one_group = 0;
     double prob_tail = 1.0;
     for (size_t i = 0; i < t; ++i) {
@@ -233,29 +481,38 @@ class PbsParam {
    * @param t             error-correcting capacity of BCH code
    * @param c             number of groups to further partiton when BCH decoding
    * failed
+   * @param num_threads   number of threads for the terms of the sum (0 means
+   * all hardware threads)
    * @return              "times 2 bound" for the failure probability
    */
   static double failureProbabilityUB(size_t d, double delta, size_t n, size_t r,
-                                     size_t t, size_t c) {
+                                     size_t t, size_t c,
+                                     unsigned num_threads = 1) {
     auto g = (double)d / delta;
     // added @2020-07-17, since stats::dbinom reuqires g >= 1
     if (g < 1) g = 1;
     size_t m = std::min(MAX_BALLS, n - 1);
-    auto mr_md = computeMultiRoundProbabilityMatrix(m, n, t, r);
+    auto mr_md = multiRoundProbabilityMatrix(m, n, t, r);
     double prob_fail_one_group = 0;
-    double p = 0, prob_tail = 1.0;
-
-    for (size_t i = 0; i < t; ++i) {
-      p = stats::dbinom(i, d, 1.0 / g);
-      prob_fail_one_group += p * mr_md(i + 1, r);
-      prob_tail -= p;
-    }
+    double prob_tail = 1.0;
 
-    for (size_t i = t; i < m; ++i) {
-      p = stats::dbinom(i, d, 1.0 / g);
-      prob_fail_one_group +=
-          p * computeFailureProbabilityBound(mr_md, i, c, t, r - 1);
-      prob_tail -= p;
+    // the terms are computed in parallel and added up in order, so that the
+    // sum does not depend on the number of threads
+    size_t num_terms = std::max(t, m);
+    std::vector<double> probs(num_terms), terms(num_terms);
+    libpbs::utils::ParallelFor(
+        num_terms, num_threads, 16, [&](size_t first, size_t last) {
+          for (size_t i = first; i < last; ++i) {
+            double p = stats::dbinom(i, d, 1.0 / g);
+            probs[i] = p;
+            terms[i] = i < t ? p * mr_md(i + 1, r)
+                             : p * computeFailureProbabilityBound(mr_md, i, c,
+                                                                  t, r - 1);
+          }
+        });
+    for (size_t i = 0; i < num_terms; ++i) {
+      prob_fail_one_group += terms[i];
+      prob_tail -= probs[i];
     }
 
     prob_fail_one_group += prob_tail;
@@ -272,41 +529,129 @@ class PbsParam {
    */
   static Mat computeMultiRoundProbabilityMatrix(size_t m, size_t n, size_t t,
                                                 size_t r) {
-    {  // loading cache
-      if (memcache_check({m, n, t, r})) return memcache_fetch({m, n, t, r});
+    return multiRoundProbabilityMatrix(m, n, t, r);
+  }
 
-      Mat cached_mat;
-      if (load_cache({m, n, t, r}, cached_mat)) {
-        memcache_write({m, n, t, r}, cached_mat);
-        return cached_mat;
-      }
-    }
+  /**
+   * @brief The transition probability for multi-round operations in PBS, as
+   * a view into the disk cache (computed and cached if it is not there yet)
+   *
+   * @param m          number of balls
+   * @param n          number of bins
+   * @param t          decoding capacity
+   * @param r          number of rounds
+   * @return           the transition probability (valid until the process
+   * exits)
+   */
+  static MappedMatrixStore::view_t multiRoundProbabilityMatrix(size_t m,
+                                                               size_t n,
+                                                               size_t t,
+                                                               size_t r) {
+    if (auto cached = disk_cache_find({m, n, t, r})) return *cached;
 
     Mat mr_m2d = Mat::Zero(m, r);
-    auto m2d = computeTransitionProbabilityMatrix(m, n, t);
-    Mat trans_mat_reform = Mat::Zero(m + 1, m + 1);
-    trans_mat_reform.block(1, 0, m, m + 1) = m2d.block(1, 1, m, m + 1);
-    trans_mat_reform(0, 0) = 1.0;
-    Mat temp = trans_mat_reform;
+    Mat trans_mat_reform = computeRoundTransitionMatrix(m, n, t);
+    // column 0 of trans_mat_reform^(i + 1): one (triangular) matrix-vector
+    // product per round instead of a matrix-matrix one
+    Eigen::VectorXd temp = trans_mat_reform.col(0);
     for (size_t i = 0; i < r; ++i) {
-      mr_m2d.col(i) = temp.block(1, 0, m, 1);
-      temp = temp * trans_mat_reform;
+      mr_m2d.col(i) = temp.segment(1, m);
+      if (i + 1 < r)
+        temp = trans_mat_reform.triangularView<Eigen::Lower>() * temp;
     }
     Mat mr_m2d_matlab = Mat::Zero(m + 1, r + 1);
     mr_m2d_matlab.block(1, 1, m, r) = Mat::Ones(m, r) - mr_m2d;
 
-    {
-      // caching
-      memcache_write({m, n, t, r}, mr_m2d_matlab);
-      save_cache({m, n, t, r}, mr_m2d_matlab);
+    // another thread may have cached it meanwhile, the first one is kept
+    return save_cache({m, n, t, r}, mr_m2d_matlab);
+  }
+
+  /**
+   * @brief The transition matrix of one round of PBS
+   *
+   * Entry (i, j) is the probability that j of i distinct elements are left
+   * after one more round. Since elements are never added back, the matrix is
+   * lower triangular.
+   *
+   * @param m          number of balls
+   * @param n          number of bins
+   * @param t          decoding capacity
+   * @return           the (m + 1) x (m + 1) transition matrix
+   */
+  static Mat computeRoundTransitionMatrix(size_t m, size_t n, size_t t) {
+    auto m2d = computeTransitionProbabilityMatrix(m, n, t);
+    Mat trans_mat_reform = Mat::Zero(m + 1, m + 1);
+    trans_mat_reform.block(1, 0, m, m + 1) = m2d.block(1, 1, m, m + 1);
+    trans_mat_reform(0, 0) = 1.0;
+    return trans_mat_reform;
+  }
+
+  /**
+   * @brief Power of a lower triangular matrix (by repeated squaring)
+   *
+   * @param lower      lower triangular matrix (entries above the diagonal are
+   * ignored)
+   * @param k          exponent
+   * @return           lower^k
+   */
+  static Mat lowerTriangularPower(const Mat &lower, size_t k) {
+    Mat result = Mat::Identity(lower.rows(), lower.cols());
+    Mat base = lower.triangularView<Eigen::Lower>();
+    for (bool first = true; k > 0; k >>= 1u) {
+      if (k & 1u) {
+        if (first)
+          result = base;
+        else
+          result = result.triangularView<Eigen::Lower>() * base;
+        first = false;
+      }
+      if (k > 1) base = base.triangularView<Eigen::Lower>() * base;
     }
+    return result;
+  }
 
-    return mr_m2d_matlab;
+  /**
+   * @brief Failure probabilities after exactly r rounds (column r of
+   * computeMultiRoundProbabilityMatrix(), without the other columns)
+   *
+   * Cheap for any r: depending on which costs less, the rounds are applied
+   * one (triangular) matrix-vector product at a time, or the transition
+   * matrix is raised to the r-th power by repeated squaring. Nothing is
+   * cached, which suits what-if sweeps over the number of rounds.
+   *
+   * @param m          number of balls
+   * @param n          number of bins
+   * @param t          decoding capacity
+   * @param r          number of rounds
+   * @return           entry i is the probability that not all of i distinct
+   * elements are reconciled within r rounds
+   */
+  static Eigen::VectorXd computeFailureProbabilityAfterRounds(size_t m,
+                                                              size_t n,
+                                                              size_t t,
+                                                              size_t r) {
+    Mat trans = computeRoundTransitionMatrix(m, n, t);
+    Eigen::VectorXd reached = Eigen::VectorXd::Unit(m + 1, 0);
+    size_t log_r = 0;
+    while ((size_t(1) << log_r) <= r && log_r < 63) ++log_r;
+    if (r <= log_r * (m + 1)) {  // r products of m^2 / 2 multiplications
+      for (size_t i = 0; i < r; ++i)
+        reached = trans.triangularView<Eigen::Lower>() * reached;
+    } else {  // log(r) products of m^3 / 2 multiplications
+      reached = lowerTriangularPower(trans, r).col(0);
+    }
+    Eigen::VectorXd failure = Eigen::VectorXd::Ones(m + 1) - reached;
+    failure(0) = 0;
+    return failure;
   }
 
   /**
    * @brief Compute transition probability matrix
    *
+   * Row i only needs the i-th slice of the probability tensor (see
+   * computeProbabilityMatrix3D()), so it is filled in as the slices are
+   * streamed, without ever holding the whole tensor.
+   *
    * @param m             number of balls
    * @param n             number of bins
    * @param t             error-correcting capacity
@@ -314,13 +659,13 @@ class PbsParam {
    */
   static Mat computeTransitionProbabilityMatrix(size_t m, size_t n, size_t t) {
     Mat m2d = Mat::Zero(m + 1, m + 2);
-    auto m3d = computeProbabilityMatrix3D(m, n);
-
-    for (size_t i = 1; i <= m; ++i) {
-      for (size_t j = 0; j <= i; ++j) {
-        m2d(i, j + 1) = m3d[i].block(n - t, i - j + 1, t + 1, 1).sum();
-      }
-    }
+    // rows n - t .. n of the slices, rows below n - m are all zero
+    size_t first_row = m - std::min(t, m);
+    size_t num_rows = m + 1 - first_row;
+    forEachProbabilitySlice(m, n, [&](size_t i, const Mat &slice) {
+      for (size_t j = 0; j <= i; ++j)
+        m2d(i, j + 1) = slice.block(first_row, i - j + 1, num_rows, 1).sum();
+    });
 
     for (size_t i = t + 1; i <= m; ++i)
       m2d(i, i + 1) = 1 - m2d.block(i, 1, 1, i).sum();
@@ -334,6 +679,8 @@ class PbsParam {
    * n bins results in that j bins are empty and (k - 1) bins contain exact one
    * ball.
    *
+   * The whole tensor takes (m + 1) x (n + 1) x (m + 2) doubles, callers that
+   * only need one slice at a time should use forEachProbabilitySlice().
    *
    * @param m         number of balls
    * @param n         number of bins
@@ -342,29 +689,118 @@ class PbsParam {
   static std::vector<Mat> computeProbabilityMatrix3D(size_t m, size_t n) {
     assert(m < n);
     std::vector<Mat> m3d(m + 1, Mat::Zero(n + 1, m + 2));
-    m3d[1](n - 1, 2) = 1.0;
+    forEachProbabilitySlice(m, n, [&](size_t i, const Mat &slice) {
+      m3d[i].block(n - m, 0, m + 1, m + 2) = slice;
+    });
+    return m3d;
+  }
+
+  /**
+   * @brief Stream the slices of the probability tensor (see
+   * computeProbabilityMatrix3D())
+   *
+   * Slice i only depends on slice i - 1, and only its rows n - m .. n can be
+   * non-zero, so two banded slices of (m + 1) x (m + 2) doubles are enough:
+   * row k of a banded slice is row n - m + k of the full one.
+   *
+   * @tparam Fn       callable with signature void(size_t i, const Mat &slice)
+   * @param m         number of balls
+   * @param n         number of bins
+   * @param fn        called for i = 1, ..., m in turn (the slice is only
+   * valid during the call)
+   */
+  template <typename Fn>
+  static void forEachProbabilitySlice(size_t m, size_t n, Fn &&fn) {
+    assert(m < n);
+    if (m == 0) return;
+    // full row a is banded row a - base
+    const size_t base = n - m;
+    Mat prev = Mat::Zero(m + 1, m + 2), cur = Mat::Zero(m + 1, m + 2);
+    prev(m - 1, 2) = 1.0;  // (n - 1, 2) of slice 1
+    fn(1, prev);
     for (size_t x = 2; x <= m; ++x) {
       for (size_t a = n - m; a < n; ++a) {
+        size_t k = a - base;
         for (size_t b = 1; b <= x + 1; ++b) {
           if (b == 1)
-            m3d[x](a, b) =
-                m3d[x - 1](a, b + 1) * static_cast<double>(b) / n +
-                m3d[x - 1](a, b) * static_cast<double>(n - a - b + 1) / n;
+            cur(k, b) = prev(k, b + 1) * static_cast<double>(b) / n +
+                        prev(k, b) * static_cast<double>(n - a - b + 1) / n;
           else if (b == m + 1)
-            m3d[x](a, b) =
-                m3d[x - 1](a + 1, b - 1) * static_cast<double>(a + 1) / n +
-                m3d[x - 1](a, b) * static_cast<double>(n - a - b + 1) / n;
+            cur(k, b) =
+                prev(k + 1, b - 1) * static_cast<double>(a + 1) / n +
+                prev(k, b) * static_cast<double>(n - a - b + 1) / n;
           else
-            m3d[x](a, b) =
-                m3d[x - 1](a + 1, b - 1) * static_cast<double>(a + 1) / n +
-                m3d[x - 1](a, b + 1) * static_cast<double>(b) / n +
-                m3d[x - 1](a, b) * static_cast<double>(n - a - b + 1) / n;
+            cur(k, b) =
+                prev(k + 1, b - 1) * static_cast<double>(a + 1) / n +
+                prev(k, b + 1) * static_cast<double>(b) / n +
+                prev(k, b) * static_cast<double>(n - a - b + 1) / n;
         }
       }
+      fn(x, cur);
+      std::swap(prev, cur);
     }
-    return m3d;
   }
 
+ private:
+  // best capacity for one field size
+  struct Candidate_ {
+    bool feasible = false;
+    size_t t = 0;
+    double failure_prob_ub = -1.0;
+  };
+
+  /**
+   * @brief Binary search of the smallest capacity reaching targetProb for
+   * field size i
+   */
+  static Candidate_ searchCapacity_(size_t d, double delta, size_t r, size_t c,
+                                    double targetProb, size_t i,
+                                    unsigned num_threads) {
+    Candidate_ candidate;
+    auto t_min = i;
+    auto t_max = std::min(
+        MAX_BALLS, std::min((1lu << i) - 2lu, size_t(std::ceil(5 * delta))));
+    auto j = (1lu << i) - 1;
+    auto p_min =
+        1 - failureProbabilityUB(d, delta, j, r, t_min, c, num_threads);
+    auto p_max =
+        1 - failureProbabilityUB(d, delta, j, r, t_max, c, num_threads);
+
+    if (p_min >= targetProb) {
+      candidate.feasible = true;
+      candidate.t = t_min;
+      candidate.failure_prob_ub = 1 - p_min;
+    } else if (p_max >= targetProb) {
+      size_t t_mid = 0;
+      while (t_max - t_min > 1u) {
+        t_mid = t_min + (t_max - t_min) / 2;
+        auto p =
+            1 - failureProbabilityUB(d, delta, j, r, t_mid, c, num_threads);
+        if (p >= targetProb)
+          t_max = t_mid;
+        else
+          t_min = t_mid;
+      }
+      auto p =
+          1 - failureProbabilityUB(d, delta, j, r, t_min, c, num_threads);
+      size_t t_tmp = 0;
+      if (p >= targetProb)
+        t_tmp = t_min;
+      else {
+        t_tmp = t_max;
+        p = 1 - failureProbabilityUB(d, delta, j, r, t_max, c, num_threads);
+      }
+      candidate.feasible = true;
+      candidate.t = t_tmp;
+      candidate.failure_prob_ub = 1 - p;
+    }
+    return candidate;
+  }
+
+  static std::atomic<unsigned> &searchThreads_() {
+    static std::atomic<unsigned> num_threads{0};
+    return num_threads;
+  }
 };  // PbsParam
 }  // namespace pbsutils
 
@@ -0,0 +1,615 @@
+/**
+ * @file pbs_round_frame.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Single-frame wire format for a whole round of PBS
+ * @version 0.1
+ * @date 2020-08-03
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef PBS_ROUND_FRAME_H_
+#define PBS_ROUND_FRAME_H_
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "bit_utils.h"
+#include "pbs_message.h"
+
+namespace libpbs {
+constexpr char PBS_FRAME_MAGIC[4] = {'P', 'B', 'S', 'R'};
+constexpr uint16_t PBS_FRAME_VERSION = 1;
+// every section starts at a multiple of this (relative to the frame)
+constexpr size_t PBS_FRAME_ALIGNMENT = 8;
+
+/**
+ * @brief Sections of a round frame
+ *
+ * New sections are only ever appended, so readers skip the sections they do
+ * not know about.
+ */
+enum class PbsFrameSection : uint32_t {
+  ENCODING = 0,   // PbsEncodingMessage
+  ENCODING_HINT,  // PbsEncodingHintMessage
+  DECODING,       // PbsDecodingMessage
+  XORS,           // XORs of the bins pinpointed by BCH decoding
+  CHECKSUMS,      // checksums of the groups decoded successfully
+  MISSING_KEYS,   // keys the sender asks for
+  PUSHED_KEYS,    // keys the sender pushes
+  PUSHED_VALUES,  // values of the pushed keys
+  NUM_SECTIONS
+};
+
+namespace frame_internal {
+// fixed part of the header (before the section table)
+constexpr size_t HEADER_BYTES = 48;
+// one entry of the section table: offset, bytes, element width, reserved
+constexpr size_t SECTION_ENTRY_BYTES = 24;
+constexpr size_t NUM_SECTIONS =
+    static_cast<size_t>(PbsFrameSection::NUM_SECTIONS);
+
+constexpr size_t Align(size_t offset) {
+  return (offset + PBS_FRAME_ALIGNMENT - 1) / PBS_FRAME_ALIGNMENT *
+         PBS_FRAME_ALIGNMENT;
+}
+
+template <typename UInteger>
+inline void Store(uint8_t *to, UInteger val) {
+  val = utils::ToLittleEndian(val);
+  std::memcpy(to, &val, sizeof(val));
+}
+
+template <typename UInteger>
+inline UInteger Load(const uint8_t *from) {
+  UInteger val;
+  std::memcpy(&val, from, sizeof(val));
+  return utils::ToLittleEndian(val);
+}
+}  // namespace frame_internal
+
+/**
+ * @brief Read-only view of a little-endian array inside a frame
+ *
+ * Elements are loaded one by one, so the array does not have to be aligned.
+ * When it is aligned and the host is little-endian (the usual case, since
+ * sections are 8-byte aligned within the frame), data() points directly into
+ * the frame.
+ *
+ * @tparam UInteger   element type
+ */
+template <typename UInteger>
+class LittleEndianArray {
+  static_assert(std::is_unsigned_v<UInteger>, "UInteger must be unsigned");
+
+ public:
+  LittleEndianArray() = default;
+
+  LittleEndianArray(const uint8_t *data, size_t size)
+      : data_(data), size_(size) {}
+
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+
+  [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
+
+  UInteger operator[](size_t i) const {
+    return frame_internal::Load<UInteger>(data_ + i * sizeof(UInteger));
+  }
+
+  // whether the elements can be used in place
+  [[nodiscard]] bool inPlace() const noexcept {
+    return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ &&
+           reinterpret_cast<uintptr_t>(data_) % alignof(UInteger) == 0;
+  }
+
+  /**
+   * @brief Pointer to the elements
+   *
+   * @param scratch     where to copy the elements if they cannot be used in
+   *                    place (untouched otherwise)
+   * @return            pointer to size() elements
+   */
+  const UInteger *data(std::vector<UInteger> &scratch) const {
+    if (inPlace()) return reinterpret_cast<const UInteger *>(data_);
+    scratch.resize(size_);
+    for (size_t i = 0; i < size_; ++i) scratch[i] = (*this)[i];
+    return scratch.data();
+  }
+
+ private:
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/**
+ * @brief Read-only view of a list of byte strings inside a frame
+ *
+ * Layout: count (uint64), count + 1 offsets (uint64, relative to the first
+ * byte after the offsets), then the concatenated strings.
+ */
+class FrameStrings {
+ public:
+  FrameStrings() = default;
+
+  FrameStrings(const uint8_t *data, size_t bytes) {
+    if (bytes == 0) return;
+    if (bytes < sizeof(uint64_t))
+      throw std::runtime_error("Corrupted PBS frame: bad string list");
+    size_ = frame_internal::Load<uint64_t>(data);
+    if (size_ >= (bytes - sizeof(uint64_t)) / sizeof(uint64_t))
+      throw std::runtime_error("Corrupted PBS frame: bad string list");
+    offsets_ = data + sizeof(uint64_t);
+    chars_ = offsets_ + (size_ + 1) * sizeof(uint64_t);
+    size_t num_chars = data + bytes - chars_;
+    uint64_t prev = 0;
+    for (size_t i = 0; i <= size_; ++i) {
+      uint64_t offset = offset_(i);
+      if (offset < prev || offset > num_chars)
+        throw std::runtime_error("Corrupted PBS frame: bad string list");
+      prev = offset;
+    }
+  }
+
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+
+  [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
+
+  std::string_view operator[](size_t i) const {
+    uint64_t first = offset_(i);
+    return std::string_view(reinterpret_cast<const char *>(chars_) + first,
+                            offset_(i + 1) - first);
+  }
+
+  // bytes needed to store the strings in [first, last)
+  template <typename Iterator>
+  static size_t SerializedSize(Iterator first, Iterator last) {
+    size_t count = 0, num_chars = 0;
+    for (auto it = first; it != last; ++it, ++count) num_chars += it->size();
+    return (count + 2) * sizeof(uint64_t) + num_chars;
+  }
+
+  // write the strings in [first, last), returns the bytes written
+  template <typename Iterator>
+  static size_t Write(Iterator first, Iterator last, uint8_t *to) {
+    size_t count = std::distance(first, last);
+    frame_internal::Store<uint64_t>(to, count);
+    uint8_t *offsets = to + sizeof(uint64_t);
+    uint8_t *chars = offsets + (count + 1) * sizeof(uint64_t);
+    uint64_t offset = 0;
+    size_t i = 0;
+    for (auto it = first; it != last; ++it, ++i) {
+      frame_internal::Store<uint64_t>(offsets + i * sizeof(uint64_t), offset);
+      std::memcpy(chars + offset, it->data(), it->size());
+      offset += it->size();
+    }
+    frame_internal::Store<uint64_t>(offsets + count * sizeof(uint64_t),
+                                    offset);
+    return chars + offset - to;
+  }
+
+ private:
+  [[nodiscard]] uint64_t offset_(size_t i) const {
+    return frame_internal::Load<uint64_t>(offsets_ + i * sizeof(uint64_t));
+  }
+
+  size_t size_ = 0;
+  const uint8_t *offsets_ = nullptr;
+  const uint8_t *chars_ = nullptr;
+};
+
+/**
+ * @brief Header fields of a round frame
+ */
+struct PbsFrameHeader {
+  uint16_t version = PBS_FRAME_VERSION;
+  // BCH parameters
+  uint32_t bch_m = 0;
+  uint32_t bch_t = 0;
+  // round (starting from 1)
+  uint32_t round = 0;
+  // number of groups in this round
+  uint64_t num_groups = 0;
+  // number of groups in the previous round (range of the ids in the hint)
+  uint64_t hint_max_range = 0;
+  // PbsDecodingFormat of the decoding message
+  uint8_t decoding_format = 0;
+  // width of the checksums in bits (0 -- full width)
+  uint8_t checksum_bits = 0;
+};
+
+/**
+ * @brief Writer of a round frame
+ *
+ * Layout (all integers little-endian):
+ *   - header (48 bytes): magic "PBSR", version (16 bits), m (8 bits),
+ *     decoding format (8 bits), t, round (32 bits each), number of groups,
+ *     hint range, total bytes of the frame (64 bits each), number of sections
+ *     (32 bits), checksum width (8 bits) and 24 reserved bits
+ *   - section table: offset, bytes (64 bits each), element width and 32
+ *     reserved bits for each section; absent sections have zero bytes
+ *   - sections, each starting at a multiple of 8 bytes
+ *
+ * PBS messages are written directly into the frame and arrays are stored with
+ * their full width, so 64-bit XORs and checksums are never truncated. The
+ * sources have to stay alive until write() returns.
+ */
+class PbsRoundFrameWriter {
+ public:
+  explicit PbsRoundFrameWriter(const PbsFrameHeader &header)
+      : header_(header) {}
+
+  /**
+   * @brief Add a PBS message (the section is chosen by its type)
+   *
+   * @param msg         message (could be null, which adds nothing)
+   */
+  void addMessage(const PbsMessage *msg) {
+    if (msg == nullptr) return;
+    PbsFrameSection section;
+    switch (msg->type) {
+      case PbsMessageType::ENCODING:
+        section = PbsFrameSection::ENCODING;
+        break;
+      case PbsMessageType::ENCODING_HINT:
+        section = PbsFrameSection::ENCODING_HINT;
+        break;
+      case PbsMessageType::DECODING:
+        section = PbsFrameSection::DECODING;
+        break;
+      default:
+        throw std::invalid_argument("Unknown PBS message type");
+    }
+    ssize_t bytes = msg->serializedSize();
+    if (bytes < 0)
+      throw std::invalid_argument("PBS message cannot be serialized");
+    setSection_(
+        section, bytes, 1, [msg](uint8_t *to) { msg->write(to); },
+        [msg](utils::ScatterWriter &sink) { msg->writeScattered(sink); });
+  }
+
+  /**
+   * @brief Add an array of unsigned integers
+   *
+   * @param section         section to add
+   * @param values          the array
+   * @param n               number of elements
+   * @param element_bytes   bytes to store for each element (only the lowest
+   *                        ones are kept if fewer than sizeof(UInteger))
+   */
+  template <typename UInteger>
+  void addArray(PbsFrameSection section, const UInteger *values, size_t n,
+                uint32_t element_bytes = sizeof(UInteger)) {
+    static_assert(std::is_unsigned_v<UInteger>, "UInteger must be unsigned");
+    if (element_bytes == 0 || element_bytes > sizeof(UInteger))
+      throw std::invalid_argument("Invalid element width");
+    setSection_(section, n * element_bytes, element_bytes,
+                [values, n, element_bytes](uint8_t *to) {
+                  if (element_bytes < sizeof(UInteger)) {
+                    for (size_t i = 0; i < n; ++i, to += element_bytes) {
+                      uint64_t val = values[i];
+                      for (uint32_t b = 0; b < element_bytes; ++b, val >>= 8u)
+                        to[b] = static_cast<uint8_t>(val);
+                    }
+                  } else if constexpr (sizeof(UInteger) == 1 ||
+                                       __BYTE_ORDER__ ==
+                                           __ORDER_LITTLE_ENDIAN__) {
+                    if (n > 0) std::memcpy(to, values, n * sizeof(UInteger));
+                  } else {
+                    for (size_t i = 0; i < n; ++i)
+                      frame_internal::Store(to + i * sizeof(UInteger),
+                                            values[i]);
+                  }
+                });
+  }
+
+  template <typename UInteger>
+  void addArray(PbsFrameSection section, const std::vector<UInteger> &values,
+                uint32_t element_bytes = sizeof(UInteger)) {
+    addArray(section, values.data(), values.size(), element_bytes);
+  }
+
+  /**
+   * @brief Add a list of byte strings (see FrameStrings)
+   *
+   * @param section         section to add
+   * @param first, last     range of strings (anything with data() and size())
+   */
+  template <typename Iterator>
+  void addStrings(PbsFrameSection section, Iterator first, Iterator last) {
+    setSection_(section, FrameStrings::SerializedSize(first, last), 1,
+                [first, last](uint8_t *to) {
+                  FrameStrings::Write(first, last, to);
+                });
+  }
+
+  // size of the frame (in bytes)
+  [[nodiscard]] size_t serializedSize() const {
+    size_t offset = frame_internal::Align(
+        frame_internal::HEADER_BYTES +
+        frame_internal::NUM_SECTIONS * frame_internal::SECTION_ENTRY_BYTES);
+    for (const auto &section : sections_)
+      if (section.bytes > 0) offset = frame_internal::Align(offset + section.bytes);
+    return offset;
+  }
+
+  /**
+   * @brief Write the frame
+   *
+   * @param to      buffer to write (serializedSize() bytes)
+   * @return        bytes written
+   */
+  size_t write(uint8_t *to) const {
+    using namespace frame_internal;
+    size_t total = serializedSize();
+    std::memset(to, 0, total);
+    writeHead_(to, total);
+    size_t offset = HEAD_BYTES_;
+    for (const auto &section : sections_) {
+      if (section.bytes == 0) continue;
+      section.write(to + offset);
+      offset = Align(offset + section.bytes);
+    }
+    return total;
+  }
+
+  /**
+   * @brief Write the frame to a chain of buffers (e.g., socket buffers),
+   * byte for byte the same as write(uint8_t *)
+   *
+   * PBS messages go through PbsMessage::writeScattered(), other sections are
+   * written in place when they do not span two buffers.
+   *
+   * @param sink    buffers to write (at least serializedSize() bytes)
+   * @return        bytes written
+   */
+  size_t write(utils::ScatterWriter &sink) const {
+    using namespace frame_internal;
+    size_t total = serializedSize();
+    if (total > sink.Remaining())
+      throw std::length_error("Buffers too small for the PBS frame");
+    uint8_t head[HEAD_BYTES_] = {};
+    writeHead_(head, total);
+    sink.Put(head, HEAD_BYTES_);
+    std::vector<uint8_t> buf;
+    for (const auto &section : sections_) {
+      if (section.bytes == 0) continue;
+      size_t padding = Align(section.bytes) - section.bytes;
+      if (section.scatter) {
+        section.scatter(sink);
+      } else if (uint8_t *window = sink.Window(section.bytes)) {
+        section.write(window);
+        sink.Advance(section.bytes);
+      } else {
+        buf.resize(section.bytes);
+        section.write(buf.data());
+        sink.Put(buf.data(), section.bytes);
+      }
+      sink.Put(nullptr, padding);
+    }
+    return total;
+  }
+
+  // write the frame to a string (e.g., a protobuf bytes field)
+  void writeTo(std::string &out) const {
+    out.resize(serializedSize());
+    write(reinterpret_cast<uint8_t *>(&out[0]));
+  }
+
+ private:
+  // header and section table
+  static constexpr size_t HEAD_BYTES_ =
+      frame_internal::Align(frame_internal::HEADER_BYTES +
+                            frame_internal::NUM_SECTIONS *
+                                frame_internal::SECTION_ENTRY_BYTES);
+
+  struct Section {
+    size_t bytes = 0;
+    uint32_t element_bytes = 0;
+    std::function<void(uint8_t *)> write;
+    // writes to a chain of buffers (optional)
+    std::function<void(utils::ScatterWriter &)> scatter;
+  };
+
+  void setSection_(PbsFrameSection section, size_t bytes,
+                   uint32_t element_bytes,
+                   std::function<void(uint8_t *)> write,
+                   std::function<void(utils::ScatterWriter &)> scatter = {}) {
+    auto &entry = sections_.at(static_cast<size_t>(section));
+    entry.bytes = bytes;
+    entry.element_bytes = element_bytes;
+    entry.write = std::move(write);
+    entry.scatter = std::move(scatter);
+  }
+
+  // write the header and the section table (HEAD_BYTES_ zeroed bytes)
+  void writeHead_(uint8_t *to, size_t total) const {
+    using namespace frame_internal;
+    std::memcpy(to, PBS_FRAME_MAGIC, sizeof(PBS_FRAME_MAGIC));
+    Store<uint16_t>(to + 4, header_.version);
+    to[6] = static_cast<uint8_t>(header_.bch_m);
+    to[7] = header_.decoding_format;
+    Store<uint32_t>(to + 8, header_.bch_t);
+    Store<uint32_t>(to + 12, header_.round);
+    Store<uint64_t>(to + 16, header_.num_groups);
+    Store<uint64_t>(to + 24, header_.hint_max_range);
+    Store<uint64_t>(to + 32, total);
+    Store<uint32_t>(to + 40, NUM_SECTIONS);
+    to[44] = header_.checksum_bits;
+
+    size_t offset = HEAD_BYTES_;
+    for (size_t i = 0; i < NUM_SECTIONS; ++i) {
+      const auto &section = sections_[i];
+      if (section.bytes == 0) continue;
+      uint8_t *entry = to + HEADER_BYTES + i * SECTION_ENTRY_BYTES;
+      Store<uint64_t>(entry, offset);
+      Store<uint64_t>(entry + 8, section.bytes);
+      Store<uint32_t>(entry + 16, section.element_bytes);
+      offset = Align(offset + section.bytes);
+    }
+  }
+
+  PbsFrameHeader header_;
+  std::array<Section, frame_internal::NUM_SECTIONS> sections_;
+};
+
+/**
+ * @brief Zero-copy reader of a round frame
+ *
+ * The frame is validated once on construction (std::runtime_error is thrown
+ * if it is malformed); after that, sections are handed out as views into the
+ * buffer, which has to outlive the view. Frames from newer writers are read
+ * as long as the major layout (version) matches; unknown sections are
+ * ignored.
+ */
+class PbsRoundFrameView {
+ public:
+  PbsRoundFrameView(const uint8_t *data, size_t size) : data_(data) {
+    using namespace frame_internal;
+    if (size < HEADER_BYTES ||
+        std::memcmp(data, PBS_FRAME_MAGIC, sizeof(PBS_FRAME_MAGIC)) != 0)
+      throw std::runtime_error("Not a PBS frame");
+    header_.version = Load<uint16_t>(data + 4);
+    if (header_.version != PBS_FRAME_VERSION)
+      throw std::runtime_error("Unsupported PBS frame version: " +
+                               std::to_string(header_.version));
+    header_.bch_m = data[6];
+    header_.decoding_format = data[7];
+    header_.bch_t = Load<uint32_t>(data + 8);
+    header_.round = Load<uint32_t>(data + 12);
+    header_.num_groups = Load<uint64_t>(data + 16);
+    header_.hint_max_range = Load<uint64_t>(data + 24);
+    size_ = Load<uint64_t>(data + 32);
+    if (size_ > size) throw std::runtime_error("Truncated PBS frame");
+    if (size_ < HEADER_BYTES)
+      throw std::runtime_error("Corrupted PBS frame: bad size");
+    uint32_t num_sections = Load<uint32_t>(data + 40);
+    header_.checksum_bits = data[44];
+    if (num_sections > (size_ - HEADER_BYTES) / SECTION_ENTRY_BYTES)
+      throw std::runtime_error("Corrupted PBS frame: bad section table");
+
+    for (size_t i = 0; i < std::min<size_t>(num_sections, NUM_SECTIONS);
+         ++i) {
+      const uint8_t *entry = data + HEADER_BYTES + i * SECTION_ENTRY_BYTES;
+      uint64_t offset = Load<uint64_t>(entry);
+      uint64_t bytes = Load<uint64_t>(entry + 8);
+      uint32_t element_bytes = Load<uint32_t>(entry + 16);
+      if (bytes == 0) continue;
+      if (offset % PBS_FRAME_ALIGNMENT != 0 || offset > size_ ||
+          bytes > size_ - offset || element_bytes == 0 ||
+          bytes % element_bytes != 0)
+        throw std::runtime_error("Corrupted PBS frame: bad section " +
+                                 std::to_string(i));
+      sections_[i] = {offset, bytes, element_bytes};
+    }
+  }
+
+  explicit PbsRoundFrameView(const std::string &bytes)
+      : PbsRoundFrameView(reinterpret_cast<const uint8_t *>(bytes.data()),
+                          bytes.size()) {}
+
+  [[nodiscard]] const PbsFrameHeader &header() const noexcept {
+    return header_;
+  }
+
+  // size of the frame (in bytes)
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+
+  [[nodiscard]] bool has(PbsFrameSection section) const {
+    return sections_.at(static_cast<size_t>(section)).bytes > 0;
+  }
+
+  // raw bytes of a section (empty if absent)
+  [[nodiscard]] std::pair<const uint8_t *, size_t> bytes(
+      PbsFrameSection section) const {
+    const auto &entry = sections_.at(static_cast<size_t>(section));
+    return {data_ + entry.offset, entry.bytes};
+  }
+
+  /**
+   * @brief Parse a PBS message stored in a section
+   *
+   * @param section     section to parse
+   * @param msg         message to parse into (already constructed with the
+   *                    right parameters, e.g., from header())
+   * @return            whether the whole section was parsed
+   */
+  bool parse(PbsFrameSection section, PbsMessage &msg) const {
+    auto [from, n] = bytes(section);
+    return msg.parse(from, n) == static_cast<ssize_t>(n);
+  }
+
+  /**
+   * @brief View of an array section
+   *
+   * @tparam UInteger   element type (must have the width it was written with)
+   * @param section     section to view
+   * @return            the array (empty if absent)
+   */
+  template <typename UInteger>
+  LittleEndianArray<UInteger> array(PbsFrameSection section) const {
+    const auto &entry = sections_.at(static_cast<size_t>(section));
+    if (entry.bytes > 0 && entry.element_bytes != sizeof(UInteger))
+      throw std::runtime_error(
+          "PBS frame: element width mismatched in section " +
+          std::to_string(static_cast<size_t>(section)));
+    return {data_ + entry.offset, entry.bytes / sizeof(UInteger)};
+  }
+
+  /**
+   * @brief Copy an array section, widening narrower elements
+   *
+   * Unlike array(), this accepts elements stored with fewer bytes than
+   * UInteger (see PbsRoundFrameWriter::addArray()).
+   *
+   * @param section     section to copy
+   * @param out         the elements (empty if absent)
+   */
+  template <typename UInteger>
+  void copyArray(PbsFrameSection section, std::vector<UInteger> &out) const {
+    const auto &entry = sections_.at(static_cast<size_t>(section));
+    out.clear();
+    if (entry.bytes == 0) return;
+    if (entry.element_bytes > sizeof(UInteger))
+      throw std::runtime_error(
+          "PBS frame: elements too wide in section " +
+          std::to_string(static_cast<size_t>(section)));
+    out.resize(entry.bytes / entry.element_bytes);
+    const uint8_t *from = data_ + entry.offset;
+    for (auto &val : out) {
+      uint64_t wide = 0;
+      for (uint32_t b = 0; b < entry.element_bytes; ++b)
+        wide |= static_cast<uint64_t>(*from++) << (8u * b);
+      val = static_cast<UInteger>(wide);
+    }
+  }
+
+  // view of a string list section
+  [[nodiscard]] FrameStrings strings(PbsFrameSection section) const {
+    auto [from, n] = bytes(section);
+    return {from, n};
+  }
+
+ private:
+  struct Entry {
+    uint64_t offset = 0;
+    uint64_t bytes = 0;
+    uint32_t element_bytes = 0;
+  };
+
+  const uint8_t *data_;
+  size_t size_ = 0;
+  PbsFrameHeader header_;
+  std::array<Entry, frame_internal::NUM_SECTIONS> sections_{};
+};
+}  // namespace libpbs
+
+#endif  // PBS_ROUND_FRAME_H_
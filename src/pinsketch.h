@@ -3,11 +3,13 @@
 
 #include <minisketch.h>
 
+#include "sketch_pool.h"
+
 class PinSketch {
  public:
   PinSketch() : sketch_(nullptr) {}
-  PinSketch(size_t m, size_t t) : sketch_(minisketch_create(m, 0, t)) {
-  }
+  PinSketch(size_t m, size_t t)
+      : sketch_(libpbs::utils::SketchPool::Global().acquire(m, t)) {}
 
   std::string name() const {
     return "PinSketch";
@@ -54,20 +56,21 @@ class PinSketch {
   bool decode(unsigned char *other,
               std::vector<uint64_t> &differences) const {
     assert(sketch_ != nullptr);
-    minisketch *sketch_other = minisketch_create(bits(), 0, capacity());
+    auto &pool = libpbs::utils::SketchPool::Global();
+    minisketch *sketch_other = pool.acquire(bits(), capacity(), false);
     minisketch_deserialize(sketch_other, other); //
     minisketch_merge(sketch_other, sketch_);
 
     differences.resize(minisketch_capacity(sketch_), 0);
     ssize_t num_differences = minisketch_decode(sketch_other, capacity(), &differences[0]);
-    minisketch_destroy(sketch_other);
+    pool.release(sketch_other);
     if (num_differences == -1) return false;
     differences.resize(num_differences);
     return true;
   }
 
   ~PinSketch() {
-    if (sketch_ != nullptr) minisketch_destroy(sketch_);
+    libpbs::utils::SketchPool::Global().release(sketch_);
   }
 
  private:
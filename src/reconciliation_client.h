@@ -23,6 +23,7 @@
 #include "bench_utils.h"
 #include "constants.h"
 #include "pbs.h"
+#include "pbs_round_frame.h"
 #include "pinsketch.h"
 #include "reconciliation.grpc.pb.h"
 
@@ -561,16 +562,21 @@ class ReconciliationClient {
       scaled_d = ESTIMATE_SM99(est);
     }
 
-    auto _pbs = std::make_unique<libpbs::ParityBitmapSketch>(scaled_d);
+    // XORs are sent at the width of the keys and checksums as short hashes
+    using Pbs = libpbs::BasicParityBitmapSketch<Key>;
+    auto _pbs = std::make_unique<Pbs>(scaled_d);
+    _pbs->setChecksumBitsWithin(PBS_CHECKSUM_FAILURE_SHARE);
 
     for (const auto &kv : key_value_pairs) _pbs->add(kv.first);
 
     bool completed = false, syn_completed = false;
 
-    std::vector<uint64_t> res;
+    std::vector<Pbs::word_t> res;
 
     do {
-      std::vector<uint64_t> xors, checksums, missing;
+      std::vector<Pbs::word_t> xors;
+      std::vector<Pbs::checksum_t> checksums;
+      std::vector<uint64_t> missing;
 
       if (completed) {
         // set reconciliation completed
@@ -598,26 +604,39 @@ class ReconciliationClient {
 
       auto [enc, hint] = _pbs->encode();
 
-      PbsRequest request;
-      request.mutable_encoding_msg()->resize(enc->serializedSize(), 0);
-      enc->write((uint8_t *)&(*request.mutable_encoding_msg())[0]);
-
-      if (hint != nullptr) {
-        request.mutable_encoding_hint()->resize(hint->serializedSize(), 0);
-        hint->write((uint8_t *)&(*request.mutable_encoding_hint())[0]);
-      }
-
-      if (!res.empty()) {
-        for (const auto &k : res) {
-          if (key_value_pairs.contains(k)) {
-            auto kv = request.mutable_pushed_key_values()->Add();
-            kv->set_key(k);
-            kv->set_value(key_value_pairs[k]);
-          } else {
-            *(request.mutable_missing_keys()->Add()) = k;
-          }
+      // the whole round travels in one frame (pbs_round_frame.h)
+      using Section = libpbs::PbsFrameSection;
+      libpbs::PbsFrameHeader header;
+      header.bch_m = enc->field_sz;
+      header.bch_t = enc->capacity;
+      header.round = _pbs->rounds() + 1;
+      header.num_groups = enc->num_groups;
+      header.hint_max_range = hint ? hint->max_range : 0;
+      header.decoding_format =
+          static_cast<uint8_t>(libpbs::PbsDecodingFormat::COMPACT);
+      header.checksum_bits = static_cast<uint8_t>(_pbs->checksumBits());
+      libpbs::PbsRoundFrameWriter writer(header);
+      writer.addMessage(enc.get());
+      writer.addMessage(hint.get());
+
+      std::vector<uint32_t> pushed_keys, missing_keys;
+      std::vector<std::string_view> pushed_values;
+      for (const auto &k : res) {
+        auto it = key_value_pairs.find(k);
+        if (it != key_value_pairs.end()) {
+          pushed_keys.push_back(static_cast<uint32_t>(k));
+          pushed_values.push_back(it->second);
+        } else {
+          missing_keys.push_back(static_cast<uint32_t>(k));
         }
       }
+      writer.addArray(Section::PUSHED_KEYS, pushed_keys);
+      writer.addStrings(Section::PUSHED_VALUES, pushed_values.cbegin(),
+                        pushed_values.cend());
+      writer.addArray(Section::MISSING_KEYS, missing_keys);
+
+      PbsRequest request;
+      writer.writeTo(*request.mutable_round_frame());
 
       PbsReply reply;
       ClientContext context;
@@ -634,30 +653,55 @@ class ReconciliationClient {
         return false;
       }
 
-      for (const auto &kv : reply.pushed_key_values()) {
-        if (key_value_pairs.contains(kv.key())) return false;
-        key_value_pairs.insert({kv.key(), kv.value()});
+      std::unique_ptr<libpbs::PbsRoundFrameView> frame;
+      try {
+        frame = std::make_unique<libpbs::PbsRoundFrameView>(reply.round_frame());
+      } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+      }
+      const auto &reply_header = frame->header();
+      if (reply_header.bch_m != header.bch_m ||
+          reply_header.bch_t != header.bch_t ||
+          reply_header.round != header.round ||
+          reply_header.num_groups != header.num_groups) {
+        std::cerr << "PBS: server replied for another round" << std::endl;
+        return false;
       }
 
       libpbs::PbsDecodingMessage decoding_message(
-          _pbs->bchParameterM(), _pbs->bchParameterT(), _pbs->numberOfGroups());
+          _pbs->bchParameterM(), _pbs->bchParameterT(), _pbs->numberOfGroups(),
+          static_cast<libpbs::PbsDecodingFormat>(reply_header.decoding_format));
+      try {
+        auto received_keys = frame->array<uint32_t>(Section::PUSHED_KEYS);
+        auto received_values = frame->strings(Section::PUSHED_VALUES);
+        if (received_keys.size() != received_values.size()) return false;
+        for (size_t i = 0; i < received_keys.size(); ++i) {
+          Key key = static_cast<Key>(received_keys[i]);
+          if (key_value_pairs.contains(key)) return false;
+          key_value_pairs.insert({key, Value(received_values[i])});
+        }
 
-      decoding_message.parse((const uint8_t *)reply.decoding_msg().c_str(),
-                             reply.decoding_msg().size());
+        if (!frame->parse(Section::DECODING, decoding_message)) {
+          std::cerr << "PBS: malformed decoding message" << std::endl;
+          return false;
+        }
 
-      if (!reply.xors().empty()) xors.insert(xors.end(), reply.xors().cbegin(), reply.xors().cend());
-      if (!reply.checksum().empty()) checksums.insert(checksums.end(), reply.checksum().cbegin(),
-                       reply.checksum().cend());
+        // XORs are used in place (copied only if misaligned), checksums are
+        // widened from the bytes actually sent
+        auto xors_view = frame->array<Pbs::word_t>(Section::XORS);
+        const Pbs::word_t *xors_data = xors_view.data(xors);
+        frame->copyArray(Section::CHECKSUMS, checksums);
 
-      try {
-        completed = _pbs->decodeCheck(decoding_message, xors, checksums);
+        completed = _pbs->decodeCheck(decoding_message, xors_data,
+                                      xors_view.size(), checksums.data(),
+                                      checksums.size());
       } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
         fmt::print("DumpInfo: m {}, t {}, est_d {}, number of groups {}, # of rounds: {}, response: {}\n",
                    _pbs->bchParameterM(), _pbs->bchParameterT(), scaled_d,
                    _pbs->numberOfGroups(), _pbs->rounds(),
-                   fmt::join(reply.checksum().cbegin(), reply.checksum().cend(),
-                             " "));
+                   fmt::join(checksums.cbegin(), checksums.cend(), " "));
         return false;
       }
       res = _pbs->differencesLastRound();
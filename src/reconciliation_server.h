@@ -18,6 +18,7 @@
 
 #include "bench_utils.h"
 #include "pbs.h"
+#include "pbs_round_frame.h"
 #include "pinsketch.h"
 #include "reconciliation.grpc.pb.h"
 #include "tow.h"
@@ -351,74 +352,115 @@ class EstimationServiceImpl final : public Estimation::Service {
     if (_key_value_pairs == nullptr)
       return Status(StatusCode::UNAVAILABLE, "Server seems not ready yet");
 
-    std::vector<uint64_t> xors, checksums;
+    // the whole round travels in one frame (pbs_round_frame.h)
+    std::unique_ptr<libpbs::PbsRoundFrameView> frame;
+    try {
+      frame =
+          std::make_unique<libpbs::PbsRoundFrameView>(request->round_frame());
+    } catch (const std::runtime_error &e) {
+      return Status(StatusCode::INVALID_ARGUMENT, e.what());
+    }
+    using Section = libpbs::PbsFrameSection;
+    const auto &header = frame->header();
+    if (header.round != (_pbs == nullptr ? 1 : _pbs->rounds() + 1))
+      return Status(StatusCode::INVALID_ARGUMENT, "PBS: unexpected round");
+    auto [hint_bytes, hint_sz] = frame->bytes(Section::ENCODING_HINT);
+    auto [enc_bytes, enc_sz] = frame->bytes(Section::ENCODING);
+
+    std::vector<Pbs::word_t> xors;
+    std::vector<Pbs::checksum_t> checksums;
     std::shared_ptr<libpbs::PbsEncodingMessage> my_enc;
 
     if (_pbs == nullptr) {
-      _pbs = std::make_unique<libpbs::ParityBitmapSketch>(_estimated_diff);
+      if (hint_sz != 0)
+        return Status(StatusCode::INVALID_ARGUMENT,
+                      "encoding hint in the first round should be empty!!");
+      _pbs = std::make_unique<Pbs>(_estimated_diff);
+      // the client states the checksum width it expects (0 -- full width)
+      if (header.checksum_bits != 0) {
+        try {
+          _pbs->setChecksumBits(header.checksum_bits);
+        } catch (const std::invalid_argument &e) {
+          _pbs = nullptr;
+          return Status(StatusCode::INVALID_ARGUMENT, e.what());
+        }
+      }
       for (const auto &kv : *_key_value_pairs) {
         _pbs->add(kv.first);
       }
-      if (!request->encoding_hint().empty()) {
-        throw std::runtime_error(
-            "encoding hint in the first round should be empty!!");
-      }
       auto [my_enc_tmp, dummy] = _pbs->encode();
       (void)dummy;  // avoid unused variable warning
       my_enc = my_enc_tmp;
     } else {
+      if (hint_sz != 0 && header.hint_max_range != _pbs->hint_max_range())
+        return Status(StatusCode::INVALID_ARGUMENT,
+                      "PBS: mismatched encoding hint");
       libpbs::PbsEncodingHintMessage hint(_pbs->hint_max_range());
-      hint.parse((const uint8_t *)request->encoding_hint().c_str(),
-                 request->encoding_hint().size());
+      if (hint.parse(hint_bytes, hint_sz) != static_cast<ssize_t>(hint_sz))
+        return Status(StatusCode::INVALID_ARGUMENT,
+                      "PBS: malformed encoding hint");
       my_enc = _pbs->encodeWithHint(hint);
     }
 
+    // both hosts have to agree on the parameters of this round
+    if (header.bch_m != my_enc->field_sz || header.bch_t != my_enc->capacity ||
+        header.num_groups != my_enc->num_groups) {
+      if (_pbs->rounds() == 0) _pbs = nullptr;
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "PBS: mismatched parameters of the round");
+    }
     libpbs::PbsEncodingMessage other_enc(my_enc->field_sz, my_enc->capacity,
                                          my_enc->num_groups);
-    other_enc.parse((const uint8_t *)request->encoding_msg().c_str(),
-                    request->encoding_msg().size());
+    if (other_enc.parse(enc_bytes, enc_sz) != static_cast<ssize_t>(enc_sz)) {
+      if (_pbs->rounds() == 0) _pbs = nullptr;
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "PBS: malformed encoding message");
+    }
     auto decoding_msg = _pbs->decode(other_enc, xors, checksums);
-
-    auto ssz = decoding_msg->serializedSize();
-    response->mutable_decoding_msg()->resize(ssz, 0);
-
-    decoding_msg->write((uint8_t *)&(*response->mutable_decoding_msg())[0]);
-
-    for (auto xor_each : xors) *(response->mutable_xors()->Add()) = xor_each;
-    for (auto checksum : checksums)
-      *(response->mutable_checksum()->Add()) = checksum;
-
-//    if (decoding_msg->num_groups == 1) {
-//      fmt::print(
-//          "decoding message:\n\t# of diffs: {}\n\tdiffs: {}\n\tchecksum: "
-//          "{}\n\tresponse: {}\n",
-//          fmt::join(decoding_msg->decoded_num_differences.cbegin(),
-//                    decoding_msg->decoded_num_differences.end(), " "),
-//          fmt::join(decoding_msg->decoded_differences.cbegin(),
-//                    decoding_msg->decoded_differences.cend(), " "),
-//          fmt::join(checksums.cbegin(), checksums.cend(), " "),
-//          fmt::join(response->checksum().cbegin(), response->checksum().cend(),
-//                    " "));
-//    }
-
-    if (!request->pushed_key_values().empty()) {
-      for (const auto &kv : request->pushed_key_values()) {
-        if (_key_value_pairs->contains(kv.key()))
+    if (header.decoding_format ==
+        static_cast<uint8_t>(libpbs::PbsDecodingFormat::COMPACT))
+      decoding_msg->format = libpbs::PbsDecodingFormat::COMPACT;
+
+    std::vector<uint32_t> keys;
+    std::vector<std::string_view> values;
+    try {
+      auto pushed_keys = frame->array<uint32_t>(Section::PUSHED_KEYS);
+      auto pushed_values = frame->strings(Section::PUSHED_VALUES);
+      if (pushed_keys.size() != pushed_values.size())
+        return Status(StatusCode::INVALID_ARGUMENT,
+                      "pushed keys and values mismatched");
+      for (size_t i = 0; i < pushed_keys.size(); ++i) {
+        Key key = static_cast<Key>(pushed_keys[i]);
+        if (_key_value_pairs->contains(key))
           return Status(StatusCode::ALREADY_EXISTS, "duplications");
-        _key_value_pairs->insert({kv.key(), kv.value()});
+        _key_value_pairs->insert({key, Value(pushed_values[i])});
       }
-    }
 
-    if (!request->missing_keys().empty()) {
-      for (auto k : request->missing_keys()) {
-        if (!_key_value_pairs->contains(k))
+      auto missing_keys = frame->array<uint32_t>(Section::MISSING_KEYS);
+      keys.resize(missing_keys.size());
+      values.resize(missing_keys.size());
+      for (size_t i = 0; i < missing_keys.size(); ++i) {
+        Key key = static_cast<Key>(missing_keys[i]);
+        if (!_key_value_pairs->contains(key))
           return Status(StatusCode::NOT_FOUND, "fake");
-        auto kv = response->mutable_pushed_key_values()->Add();
-        kv->set_key(k);
-        kv->set_value(_key_value_pairs->at(k));
+        keys[i] = missing_keys[i];
+        values[i] = _key_value_pairs->at(key);
       }
+    } catch (const std::runtime_error &e) {
+      return Status(StatusCode::INVALID_ARGUMENT, e.what());
     }
 
+    libpbs::PbsFrameHeader reply_header = header;
+    reply_header.decoding_format = static_cast<uint8_t>(decoding_msg->format);
+    libpbs::PbsRoundFrameWriter writer(reply_header);
+    writer.addMessage(decoding_msg.get());
+    writer.addArray(Section::XORS, xors);
+    writer.addArray(Section::CHECKSUMS, checksums,
+                    libpbs::utils::Bits2Bytes(_pbs->checksumBits()));
+    writer.addArray(Section::PUSHED_KEYS, keys);
+    writer.addStrings(Section::PUSHED_VALUES, values.cbegin(), values.cend());
+    writer.writeTo(*response->mutable_round_frame());
+
     return Status::OK;
   }
 
@@ -459,7 +501,9 @@ class EstimationServiceImpl final : public Estimation::Service {
   ssize_t _estimated_diff;
   std::shared_ptr<tsl::ordered_map<Key, Value>> _key_value_pairs;
 
-  std::unique_ptr<libpbs::ParityBitmapSketch> _pbs{};
+  // XORs are sent at the width of the keys
+  using Pbs = libpbs::BasicParityBitmapSketch<Key>;
+  std::unique_ptr<Pbs> _pbs{};
 };
 
 #endif  // RECONCILIATION_SERVER_H_
\ No newline at end of file
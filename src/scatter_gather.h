@@ -0,0 +1,280 @@
+/**
+ * @file scatter_gather.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Cursors over chains of caller-owned buffers (iovecs)
+ * @version 0.1
+ * @date 2020-08-04
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef SCATTER_GATHER_H_
+#define SCATTER_GATHER_H_
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace libpbs::utils {
+/**
+ * @brief Sequential writer over a chain of buffers
+ *
+ * Messages are written into the buffers in order, e.g., socket buffers
+ * handed to writev() or the blocks of a protobuf Cord, so a message never
+ * has to be laid out in one full-size buffer first. Besides copying bytes
+ * (Put()), a writer hands out the contiguous part of the current buffer
+ * (Window()/Advance()) to serializers that write in place, and packs bits
+ * LSB-first the same way as BitPacker.
+ *
+ * A writer is a cursor: copying it gives a second cursor into the same
+ * chain (e.g., for a section whose offset is known in advance). The chain
+ * itself (the iovec array) has to outlive the writer.
+ */
+class ScatterWriter {
+ public:
+  /**
+   * @brief Constructor
+   *
+   * @param iov         buffers to write
+   * @param iovcnt      number of buffers
+   */
+  ScatterWriter(const struct iovec *iov, size_t iovcnt)
+      : iov_(iov), end_(iov + iovcnt) {
+    for (size_t i = 0; i < iovcnt; ++i) remaining_ += iov[i].iov_len;
+    skipEmpty_();
+  }
+
+  // bytes left in the chain
+  [[nodiscard]] size_t Remaining() const noexcept { return remaining_; }
+
+  // bytes written (or skipped) so far
+  [[nodiscard]] size_t BytesWritten() const noexcept { return written_; }
+
+  /**
+   * @brief The next `n` bytes, if they are contiguous
+   *
+   * @param n       number of bytes
+   * @return        pointer to them, or nullptr if they span buffers
+   */
+  [[nodiscard]] uint8_t *Window(size_t n) const noexcept {
+    if (iov_ == end_ || iov_->iov_len - offset_ < n) return nullptr;
+    return static_cast<uint8_t *>(iov_->iov_base) + offset_;
+  }
+
+  /**
+   * @brief Move past `n` bytes (written through Window() or to be written
+   * by another cursor)
+   *
+   * @param n       number of bytes
+   */
+  void Advance(size_t n) {
+    if (n > remaining_) throw std::length_error("ScatterWriter: chain full");
+    remaining_ -= n;
+    written_ += n;
+    while (n > 0) {
+      size_t step = std::min(n, iov_->iov_len - offset_);
+      offset_ += step;
+      n -= step;
+      skipEmpty_();
+    }
+  }
+
+  /**
+   * @brief Copy `n` bytes
+   *
+   * @param data    bytes to copy (nullptr writes zeros)
+   * @param n       number of bytes
+   */
+  void Put(const void *data, size_t n) {
+    if (n > remaining_) throw std::length_error("ScatterWriter: chain full");
+    auto *from = static_cast<const uint8_t *>(data);
+    while (n > 0) {
+      size_t step = std::min(n, iov_->iov_len - offset_);
+      uint8_t *to = static_cast<uint8_t *>(iov_->iov_base) + offset_;
+      if (from != nullptr) {
+        std::memcpy(to, from, step);
+        from += step;
+      } else {
+        std::memset(to, 0, step);
+      }
+      Advance(step);
+      n -= step;
+    }
+  }
+
+  /**
+   * @brief Append the lowest `bits` bits of `val` (LSB-first)
+   *
+   * @param val     value to write
+   * @param bits    number of bits (0 .. 64)
+   */
+  void WriteBits(uint64_t val, unsigned bits) {
+    if (bits == 0) return;
+    if (bits < 64) val &= (uint64_t(1) << bits) - 1;
+    acc_ |= val << num_bits_;
+    num_bits_ += bits;
+    if (num_bits_ >= 64) {
+      putWord_(acc_, 8);
+      num_bits_ -= 64;
+      acc_ = num_bits_ > 0 ? val >> (bits - num_bits_) : 0;
+    }
+  }
+
+  /**
+   * @brief Write out the pending bits (the last byte is zero-padded)
+   */
+  void FlushBits() {
+    putWord_(acc_, (num_bits_ + 7) / 8);
+    acc_ = 0;
+    num_bits_ = 0;
+  }
+
+ private:
+  void skipEmpty_() noexcept {
+    while (iov_ != end_ && offset_ == iov_->iov_len) {
+      ++iov_;
+      offset_ = 0;
+    }
+  }
+
+  void putWord_(uint64_t word, size_t bytes) {
+    uint8_t le[8];
+    for (size_t i = 0; i < bytes; ++i) le[i] = uint8_t(word >> (8 * i));
+    Put(le, bytes);
+  }
+
+  const struct iovec *iov_;
+  const struct iovec *end_;
+  size_t offset_ = 0;
+  size_t remaining_ = 0;
+  size_t written_ = 0;
+  uint64_t acc_ = 0;
+  unsigned num_bits_ = 0;
+};
+
+/**
+ * @brief Sequential reader over a chain of buffers (the counterpart of
+ * ScatterWriter)
+ *
+ * Reading past the end of the chain throws std::length_error, except for
+ * ReadBits(), which reads zeros like BitUnpacker.
+ */
+class GatherReader {
+ public:
+  /**
+   * @brief Constructor
+   *
+   * @param iov         buffers to read
+   * @param iovcnt      number of buffers
+   */
+  GatherReader(const struct iovec *iov, size_t iovcnt)
+      : iov_(iov), end_(iov + iovcnt) {
+    for (size_t i = 0; i < iovcnt; ++i) remaining_ += iov[i].iov_len;
+    skipEmpty_();
+  }
+
+  // bytes left in the chain
+  [[nodiscard]] size_t Remaining() const noexcept { return remaining_; }
+
+  // bytes read (or skipped) so far
+  [[nodiscard]] size_t BytesRead() const noexcept { return read_; }
+
+  /**
+   * @brief The next `n` bytes, if they are contiguous
+   *
+   * @param n       number of bytes
+   * @return        pointer to them, or nullptr if they span buffers
+   */
+  [[nodiscard]] const uint8_t *Window(size_t n) const noexcept {
+    if (iov_ == end_ || iov_->iov_len - offset_ < n) return nullptr;
+    return static_cast<const uint8_t *>(iov_->iov_base) + offset_;
+  }
+
+  // the rest of the current buffer
+  [[nodiscard]] size_t ContiguousBytes() const noexcept {
+    return iov_ == end_ ? 0 : iov_->iov_len - offset_;
+  }
+
+  /**
+   * @brief Move past `n` bytes
+   *
+   * @param n       number of bytes
+   */
+  void Skip(size_t n) {
+    if (n > remaining_) throw std::length_error("GatherReader: chain ended");
+    remaining_ -= n;
+    read_ += n;
+    while (n > 0) {
+      size_t step = std::min(n, iov_->iov_len - offset_);
+      offset_ += step;
+      n -= step;
+      skipEmpty_();
+    }
+  }
+
+  /**
+   * @brief Copy the next `n` bytes
+   *
+   * @param data    where to copy to
+   * @param n       number of bytes
+   */
+  void Get(void *data, size_t n) {
+    if (n > remaining_) throw std::length_error("GatherReader: chain ended");
+    auto *to = static_cast<uint8_t *>(data);
+    while (n > 0) {
+      size_t step = std::min(n, iov_->iov_len - offset_);
+      std::memcpy(to, static_cast<const uint8_t *>(iov_->iov_base) + offset_,
+                  step);
+      to += step;
+      Skip(step);
+      n -= step;
+    }
+  }
+
+  /**
+   * @brief Read the next `bits` bits (LSB-first)
+   *
+   * @param bits    number of bits (0 .. 64)
+   * @return        the value
+   */
+  uint64_t ReadBits(unsigned bits) {
+    uint64_t val = 0;
+    for (unsigned done = 0; done < bits;) {
+      if (num_bits_ == 0) {
+        if (remaining_ == 0) return val;
+        uint8_t byte;
+        Get(&byte, 1);
+        acc_ = byte;
+        num_bits_ = 8;
+      }
+      unsigned step = std::min(bits - done, num_bits_);
+      val |= (acc_ & ((1u << step) - 1)) << done;
+      acc_ >>= step;
+      num_bits_ -= step;
+      done += step;
+    }
+    return val;
+  }
+
+ private:
+  void skipEmpty_() noexcept {
+    while (iov_ != end_ && offset_ == iov_->iov_len) {
+      ++iov_;
+      offset_ = 0;
+    }
+  }
+
+  const struct iovec *iov_;
+  const struct iovec *end_;
+  size_t offset_ = 0;
+  size_t remaining_ = 0;
+  size_t read_ = 0;
+  uint64_t acc_ = 0;
+  unsigned num_bits_ = 0;
+};
+}  // namespace libpbs::utils
+
+#endif  // SCATTER_GATHER_H_
@@ -0,0 +1,219 @@
+/**
+ * @file sketch_pool.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief A pool of reusable minisketch objects
+ * @version 0.1
+ * @date 2020-07-30
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef SKETCH_POOL_H_
+#define SKETCH_POOL_H_
+
+#include <minisketch.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace libpbs::utils {
+/**
+ * @brief A pool of minisketch objects keyed by (field size, capacity)
+ *
+ * Every round of PBS needs one sketch per group, both for encoding and for
+ * parsing the other side's encoding. Instead of creating and destroying them
+ * each time, messages borrow sketches from the pool and return them when they
+ * are done, so that after the first few rounds no sketch is created at all.
+ *
+ * Sketches handed out are either all-zero (ready to add elements to) or
+ * left with arbitrary contents, for callers that overwrite them anyway (e.g.,
+ * by deserializing). The pool is thread-safe; borrowing and returning a whole
+ * range takes the lock only once.
+ *
+ * At most maxIdlePerKey() sketches are kept for each (field size, capacity);
+ * sketches returned beyond that are destroyed, so a long-running process
+ * that has seen many parameters, or one huge round, does not keep them all.
+ */
+class SketchPool {
+ public:
+  // default of maxIdlePerKey(), enough for the groups of a few messages
+  static constexpr size_t DEFAULT_MAX_IDLE_PER_KEY = 1u << 16u;
+
+  /**
+   * @brief Constructor
+   *
+   * @param max_idle_per_key    at most how many idle sketches are kept for
+   * each (field size, capacity)
+   */
+  explicit SketchPool(size_t max_idle_per_key = DEFAULT_MAX_IDLE_PER_KEY)
+      : max_idle_per_key_(max_idle_per_key) {}
+
+  ~SketchPool() { trim(); }
+
+  SketchPool(const SketchPool &) = delete;
+  SketchPool &operator=(const SketchPool &) = delete;
+
+  /**
+   * @brief The pool shared by all PBS messages
+   *
+   * It is never destroyed, so messages with static storage duration can still
+   * return their sketches at exit.
+   *
+   * @return    the global pool
+   */
+  static SketchPool &Global() {
+    static auto *pool = new SketchPool();
+    return *pool;
+  }
+
+  /**
+   * @brief Borrow `n` sketches
+   *
+   * @param m           field size
+   * @param t           capacity
+   * @param n           number of sketches
+   * @param out         where to store the sketches (room for `n` pointers)
+   * @param zeroed      whether the sketches must be all-zero
+   */
+  void acquire(uint32_t m, uint32_t t, size_t n, minisketch **out,
+               bool zeroed = true) {
+    size_t reused = 0;
+    const unsigned char *zeros = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &bucket = buckets_[Key_(m, t)];
+      reused = std::min(n, bucket.idle.size());
+      std::copy(bucket.idle.end() - reused, bucket.idle.end(), out);
+      bucket.idle.resize(bucket.idle.size() - reused);
+      if (zeroed && reused > 0) {
+        if (bucket.zeros.empty())
+          bucket.zeros.resize(minisketch_serialized_size(out[0]), 0);
+        // buckets are never erased, so this stays valid without the lock
+        zeros = bucket.zeros.data();
+      }
+    }
+    if (zeros != nullptr)
+      for (size_t i = 0; i < reused; ++i) minisketch_deserialize(out[i], zeros);
+    for (size_t i = reused; i < n; ++i) out[i] = minisketch_create(m, 0, t);
+    num_created_ += n - reused;
+  }
+
+  /**
+   * @brief Borrow a single sketch
+   *
+   * @param m           field size
+   * @param t           capacity
+   * @param zeroed      whether the sketch must be all-zero
+   * @return            the sketch
+   */
+  minisketch *acquire(uint32_t m, uint32_t t, bool zeroed = true) {
+    minisketch *sketch = nullptr;
+    acquire(m, t, 1, &sketch, zeroed);
+    return sketch;
+  }
+
+  /**
+   * @brief Return sketches to the pool
+   *
+   * @param sketches    sketches to return (null pointers are skipped)
+   * @param n           number of sketches
+   */
+  void release(minisketch *const *sketches, size_t n) {
+    std::vector<minisketch *> surplus;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 0; i < n; ++i) {
+        if (sketches[i] == nullptr) continue;
+        auto &idle = buckets_[Key_(minisketch_bits(sketches[i]),
+                                   minisketch_capacity(sketches[i]))]
+                         .idle;
+        if (idle.size() < max_idle_per_key_)
+          idle.push_back(sketches[i]);
+        else
+          surplus.push_back(sketches[i]);
+      }
+    }
+    for (auto sketch : surplus) minisketch_destroy(sketch);
+  }
+
+  /**
+   * @brief Return a single sketch to the pool
+   *
+   * @param sketch      sketch to return (could be null)
+   */
+  void release(minisketch *sketch) { release(&sketch, 1); }
+
+  // at most how many idle sketches are kept for each (field size, capacity)
+  [[nodiscard]] size_t maxIdlePerKey() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return max_idle_per_key_;
+  }
+
+  /**
+   * @brief Set at most how many idle sketches are kept for each (field size,
+   * capacity), destroying the ones beyond
+   *
+   * @param max_idle_per_key    the limit (0 disables pooling)
+   */
+  void setMaxIdlePerKey(size_t max_idle_per_key) {
+    std::vector<minisketch *> surplus;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      max_idle_per_key_ = max_idle_per_key;
+      for (auto &[key, bucket] : buckets_) {
+        if (bucket.idle.size() <= max_idle_per_key) continue;
+        surplus.insert(surplus.end(), bucket.idle.begin() + max_idle_per_key,
+                       bucket.idle.end());
+        bucket.idle.resize(max_idle_per_key);
+      }
+    }
+    for (auto sketch : surplus) minisketch_destroy(sketch);
+  }
+
+  /**
+   * @brief Destroy all idle sketches
+   */
+  void trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &[key, bucket] : buckets_) {
+      for (auto sketch : bucket.idle) minisketch_destroy(sketch);
+      bucket.idle.clear();
+      bucket.idle.shrink_to_fit();
+    }
+  }
+
+  // number of sketches created by the pool so far
+  [[nodiscard]] size_t numCreated() const noexcept { return num_created_; }
+
+  // number of sketches waiting in the pool
+  [[nodiscard]] size_t numIdle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t total = 0;
+    for (const auto &[key, bucket] : buckets_) total += bucket.idle.size();
+    return total;
+  }
+
+ private:
+  struct Bucket {
+    // sketches ready to be borrowed
+    std::vector<minisketch *> idle;
+    // a serialized all-zero sketch, for clearing reused ones
+    std::vector<unsigned char> zeros;
+  };
+
+  static uint64_t Key_(uint32_t m, size_t t) noexcept {
+    return (static_cast<uint64_t>(m) << 32u) | static_cast<uint32_t>(t);
+  }
+
+  std::mutex mutex_;
+  size_t max_idle_per_key_;
+  std::unordered_map<uint64_t, Bucket> buckets_;
+  std::atomic<size_t> num_created_{0};
+};
+}  // namespace libpbs::utils
+
+#endif  // SKETCH_POOL_H_
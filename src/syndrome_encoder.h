@@ -0,0 +1,201 @@
+/**
+ * @file syndrome_encoder.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Batched BCH syndrome encoder for parity bitmaps
+ * @version 0.1
+ * @date 2020-07-31
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef SYNDROME_ENCODER_H_
+#define SYNDROME_ENCODER_H_
+
+#include <minisketch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace libpbs::utils {
+/**
+ * @brief Computes the BCH sketch (PinSketch) of a set of bins in one pass
+ *
+ * A sketch with capacity t over GF(2^m) consists of the odd power sums
+ * s_1, s_3, ..., s_{2t-1} of its elements. minisketch_add_uint64() updates
+ * all t of them per element with field multiplications; this encoder instead
+ * keeps log/antilog tables of the field, so that the successive odd powers of
+ * an element are t table lookups with one addition (mod 2^m - 1) each. For
+ * m <= 14 both tables fit in 64 KB.
+ *
+ * The field is the one minisketch uses for each field size (the same
+ * irreducible polynomial and the standard polynomial basis), and the sketch is
+ * serialized exactly like minisketch_serialize() does, so the result can be
+ * loaded into a minisketch with minisketch_deserialize().
+ */
+class SyndromeEncoder {
+ public:
+  SyndromeEncoder() = default;
+
+  /**
+   * @brief Constructor
+   *
+   * @param m     field size (see Supports())
+   * @param t     capacity
+   */
+  SyndromeEncoder(uint32_t m, uint32_t t)
+      : field_sz_(m), n_((1u << m) - 1u), capacity_(t) {
+    if (!Supports(m))
+      throw std::invalid_argument("Unsupported field size: " +
+                                  std::to_string(m));
+    buildTables_();
+  }
+
+  // whether fields of size `m` are supported
+  static constexpr bool Supports(uint32_t m) noexcept {
+    return m >= 2 && m <= 16;
+  }
+
+  [[nodiscard]] uint32_t fieldSize() const noexcept { return field_sz_; }
+
+  [[nodiscard]] uint32_t capacity() const noexcept { return capacity_; }
+
+  // size of a serialized sketch (in bytes)
+  [[nodiscard]] size_t serializedSize() const noexcept {
+    return (field_sz_ * capacity_ + 7) / 8;
+  }
+
+  /**
+   * @brief Compute the syndromes of all bins with odd parity
+   *
+   * @param bitmap        parity bitmap, one byte per bin (non-zero means odd)
+   * @param len           number of bins in `bitmap` (at most 2^m)
+   * @param syndromes     output, t syndromes
+   */
+  void encode(const uint8_t *bitmap, size_t len, uint16_t *syndromes) const {
+    std::fill(syndromes, syndromes + capacity_, 0);
+    size_t k = 0;
+    // skip runs of even bins eight at a time
+    for (; k + 8 <= len; k += 8) {
+      uint64_t word;
+      std::memcpy(&word, bitmap + k, sizeof(word));
+      if (word == 0) continue;
+      for (size_t i = k; i < k + 8; ++i)
+        if (bitmap[i]) accumulate_(i, syndromes);
+    }
+    for (; k < len; ++k)
+      if (bitmap[k]) accumulate_(k, syndromes);
+  }
+
+  /**
+   * @brief Compute the syndromes of a list of elements
+   *
+   * @tparam Iterator
+   * @param first, last   range of elements (each in [0, 2^m), 0 is ignored)
+   * @param syndromes     output, t syndromes
+   */
+  template <typename Iterator>
+  void encode(Iterator first, Iterator last, uint16_t *syndromes) const {
+    std::fill(syndromes, syndromes + capacity_, 0);
+    for (auto it = first; it != last; ++it)
+      accumulate_(static_cast<uint32_t>(*it), syndromes);
+  }
+
+  /**
+   * @brief Serialize syndromes the same way as minisketch_serialize()
+   *
+   * @param syndromes     t syndromes
+   * @param out           buffer to write (serializedSize() bytes)
+   */
+  void serialize(const uint16_t *syndromes, uint8_t *out) const {
+    uint64_t acc = 0;
+    uint32_t num_bits = 0;
+    for (uint32_t k = 0; k < capacity_; ++k) {
+      acc |= static_cast<uint64_t>(syndromes[k]) << num_bits;
+      num_bits += field_sz_;
+      for (; num_bits >= 8; num_bits -= 8, acc >>= 8u)
+        *out++ = static_cast<uint8_t>(acc);
+    }
+    if (num_bits > 0) *out = static_cast<uint8_t>(acc);
+  }
+
+  /**
+   * @brief Load syndromes into a minisketch (of the same m and t)
+   *
+   * @param syndromes     t syndromes
+   * @param buf           scratch buffer (serializedSize() bytes)
+   * @param sketch        sketch to overwrite
+   */
+  void load(const uint16_t *syndromes, uint8_t *buf,
+            minisketch *sketch) const {
+    serialize(syndromes, buf);
+    minisketch_deserialize(sketch, buf);
+  }
+
+ private:
+  /**
+   * @brief Add x, x^3, ..., x^{2t-1} to the syndromes
+   *
+   * @param x             field element
+   * @param syndromes     syndromes to update
+   */
+  inline void accumulate_(uint32_t x, uint16_t *syndromes) const {
+    if (x == 0) return;
+    uint32_t idx = log_[x];
+    uint32_t step = idx * 2 % n_;
+    for (uint32_t k = 0; k < capacity_; ++k) {
+      syndromes[k] ^= exp_[idx];
+      idx += step;
+      if (idx >= n_) idx -= n_;
+    }
+  }
+
+  // multiplication in GF(2^m) modulo minisketch's polynomial
+  [[nodiscard]] uint32_t multiply_(uint32_t a, uint32_t b) const noexcept {
+    uint32_t r = 0, top = 1u << field_sz_, mod = MODULI[field_sz_] | top;
+    for (; b != 0; b >>= 1u) {
+      if (b & 1u) r ^= a;
+      a <<= 1u;
+      if (a & top) a ^= mod;
+    }
+    return r;
+  }
+
+  /**
+   * @brief Build log/antilog tables for a generator of the field
+   *
+   * The polynomial x is not primitive for every modulus minisketch uses
+   * (e.g., m = 8), so the smallest element of full order is picked.
+   */
+  void buildTables_() {
+    exp_.assign(n_, 0);
+    log_.assign(n_ + 1, 0);
+    for (uint32_t g = 2; g <= n_; ++g) {
+      uint32_t x = 1, order = 0;
+      do {
+        exp_[order++] = x;
+        x = multiply_(x, g);
+      } while (x != 1 && order < n_);
+      if (x == 1 && order == n_) break;
+    }
+    for (uint32_t i = 0; i < n_; ++i) log_[exp_[i]] = i;
+  }
+
+  // lower bits of the irreducible polynomial minisketch uses for each field
+  // size (the leading x^m is implied)
+  static constexpr uint32_t MODULI[17] = {0, 0, 3, 3,  3, 5,  3,  3, 27,
+                                          3, 9, 5, 9, 27, 33, 3, 43};
+
+  uint32_t field_sz_ = 0;
+  uint32_t n_ = 0;
+  uint32_t capacity_ = 0;
+  // exp_[i] = g^i and log_[g^i] = i for the generator g
+  std::vector<uint16_t> exp_;
+  std::vector<uint16_t> log_;
+};
+}  // namespace libpbs::utils
+
+#endif  // SYNDROME_ENCODER_H_
@@ -0,0 +1,85 @@
+/**
+ * @file thread_utils.h
+ * @author Long Gong <long.github@gmail.com>
+ * @brief Small helpers for splitting independent per-group work across threads
+ * @version 0.1
+ * @date 2020-07-25
+ *
+ * @copyright Copyright (c) 2020
+ *
+ */
+#ifndef THREAD_UTILS_H_
+#define THREAD_UTILS_H_
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace libpbs::utils {
+/**
+ * @brief Resolve a requested number of threads
+ *
+ * @param num_threads     requested number of threads (0 means "use all
+ * hardware threads")
+ * @return                number of threads to use (at least 1)
+ */
+inline unsigned ResolveNumThreads(unsigned num_threads) {
+  if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+  return std::max(num_threads, 1u);
+}
+
+/**
+ * @brief Run `fn(first, last)` over a static partition of [0, n)
+ *
+ * The range is cut into at most `num_threads` contiguous chunks with at least
+ * `grain` items each. The last chunk runs on the calling thread. Since the
+ * partition only depends on `n`, `num_threads` and `grain`, callers that write
+ * to disjoint per-item slots get exactly the same result as running
+ * `fn(0, n)` serially.
+ *
+ * @tparam Fn               callable with signature void(size_t, size_t)
+ * @param n                 number of items
+ * @param num_threads       number of threads (0 means all hardware threads)
+ * @param grain             minimum number of items per chunk
+ * @param fn                work on the items in [first, last)
+ */
+template <typename Fn>
+inline void ParallelFor(size_t n, unsigned num_threads, size_t grain, Fn &&fn) {
+  grain = std::max<size_t>(grain, 1);
+  size_t chunks =
+      std::min<size_t>(ResolveNumThreads(num_threads), (n + grain - 1) / grain);
+  if (chunks <= 1) {
+    fn(size_t(0), n);
+    return;
+  }
+
+  std::exception_ptr error = nullptr;
+  std::mutex error_mutex;
+  auto guarded = [&](size_t first, size_t last) {
+    try {
+      fn(first, last);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(chunks - 1);
+  size_t step = n / chunks, extra = n % chunks, first = 0;
+  for (size_t c = 0; c < chunks; ++c) {
+    size_t last = first + step + (c < extra ? 1 : 0);
+    if (c + 1 == chunks)
+      guarded(first, last);
+    else
+      workers.emplace_back(guarded, first, last);
+    first = last;
+  }
+  for (auto &worker : workers) worker.join();
+  if (error) std::rethrow_exception(error);
+}
+}  // namespace libpbs::utils
+
+#endif  // THREAD_UTILS_H_
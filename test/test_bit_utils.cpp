@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "bit_utils.h"
+
+using namespace libpbs::utils;
+
+namespace {
+// random (width, value) pairs, width in [lo, hi]
+std::vector<std::pair<unsigned, uint64_t>> RandomFields(size_t n, unsigned lo,
+                                                        unsigned hi,
+                                                        unsigned seed) {
+  std::mt19937_64 gen(seed);
+  std::vector<std::pair<unsigned, uint64_t>> fields(n);
+  for (auto &[bits, val] : fields) {
+    bits = lo + gen() % (hi - lo + 1);
+    val = gen() & (bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1);
+  }
+  return fields;
+}
+}  // namespace
+
+TEST(BitUtilsTest, PackerMatchesBitWriter) {
+  // BitWriter handles up to 32 bits per call for 64-bit values
+  auto fields = RandomFields(10000, 0, 32, 1);
+  size_t total_bits = 0;
+  for (const auto &field : fields) total_bits += field.first;
+  size_t sz = Bits2Bytes(total_bits);
+
+  std::vector<uint8_t> expected(sz, 0), actual(sz, 0xff);
+  BitWriter writer(expected.data());
+  for (const auto &[bits, val] : fields) writer.Write<uint64_t>(val, bits);
+  writer.Flush();
+
+  BitPacker packer(actual.data(), actual.size());
+  for (const auto &[bits, val] : fields) packer.Write(val, bits);
+  packer.Flush();
+  EXPECT_EQ(packer.BytesWritten(), sz);
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(BitUtilsTest, UnpackerRoundTrip) {
+  auto fields = RandomFields(10000, 0, 64, 2);
+  size_t total_bits = 0;
+  for (const auto &field : fields) total_bits += field.first;
+  std::vector<uint8_t> buf(Bits2Bytes(total_bits));
+  BitPacker packer(buf.data(), buf.size());
+  for (const auto &[bits, val] : fields) packer.Write(val, bits);
+  packer.Flush();
+
+  BitUnpacker unpacker(buf.data(), buf.size());
+  for (const auto &[bits, val] : fields) ASSERT_EQ(unpacker.Read(bits), val);
+  EXPECT_EQ(unpacker.BitsRead(), total_bits);
+  // past the end reads as zero
+  EXPECT_EQ(unpacker.Read(17), 0u);
+}
+
+TEST(BitUtilsTest, BulkRoundTrip) {
+  std::mt19937_64 gen(3);
+  for (unsigned bits : {1u, 5u, 8u, 12u, 16u, 27u, 32u, 41u, 64u}) {
+    // a leading odd-sized field moves the bulk part off the byte boundary
+    for (unsigned lead : {0u, 3u}) {
+      std::vector<uint64_t> values(1001);
+      for (auto &val : values)
+        val = gen() & (bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1);
+      std::vector<uint8_t> buf(Bits2Bytes(lead + bits * values.size()));
+      BitPacker packer(buf.data(), buf.size());
+      packer.Write(5, lead);
+      packer.WriteN(values.data(), values.size(), bits);
+      packer.Flush();
+
+      std::vector<uint8_t> expected(buf.size());
+      BitPacker one_by_one(expected.data(), expected.size());
+      one_by_one.Write(5, lead);
+      for (auto val : values) one_by_one.Write(val, bits);
+      one_by_one.Flush();
+      EXPECT_EQ(expected, buf) << "bits = " << bits << ", lead = " << lead;
+
+      BitUnpacker unpacker(buf.data(), buf.size());
+      EXPECT_EQ(unpacker.Read(lead), lead ? 5u : 0u);
+      std::vector<uint64_t> parsed(values.size());
+      unpacker.ReadN(parsed.data(), parsed.size(), bits);
+      EXPECT_EQ(values, parsed) << "bits = " << bits << ", lead = " << lead;
+    }
+  }
+}
+
+TEST(BitUtilsTest, PackerStopsAtEndOfBuffer) {
+  std::vector<uint8_t> buf(4);
+  BitPacker packer(buf.data(), buf.size());
+  packer.Write(1, 30);
+  EXPECT_THROW(
+      {
+        packer.Write(1, 30);
+        packer.Write(1, 30);
+      },
+      std::length_error);
+}
+
+TEST(BitUtilsTest, RiceRoundTrip) {
+  std::mt19937_64 gen(4);
+  for (unsigned k : {0u, 3u, 9u}) {
+    std::vector<uint64_t> values(2000);
+    for (auto &val : values) val = gen() % (uint64_t(64) << k);
+    // quotients at and beyond the escape
+    values[10] = uint64_t(constants::RICE_ESCAPE) << k;
+    values[11] = ~uint64_t(0);
+    size_t total_bits = 0;
+    for (auto val : values) total_bits += BitPacker::RiceBits(val, k);
+    std::vector<uint8_t> buf(Bits2Bytes(total_bits));
+    BitPacker packer(buf.data(), buf.size());
+    for (auto val : values) packer.WriteRice(val, k);
+    packer.Flush();
+
+    BitUnpacker unpacker(buf.data(), buf.size());
+    for (auto val : values) ASSERT_EQ(unpacker.ReadRice(k), val);
+    EXPECT_EQ(unpacker.BitsRead(), total_bits);
+  }
+}
@@ -1,26 +1,11 @@
 #include <gtest/gtest.h>
 
-#include "cache_helper.h"
-
-TEST(CacheHelperTest, Memcache) {
-    std::array<size_t, 4> key{1,2,3,4};
-
-    auto exists = pbsutils::memcache_check(key);
-    EXPECT_FALSE(exists);
-
-    Eigen::MatrixXd mat(2,2);
-    mat << 1, 2, 3, 4;
-    pbsutils::memcache_write(key, mat);
-
-    auto mat_from_cache = pbsutils::memcache_fetch(key);
-    EXPECT_EQ(mat_from_cache, mat);
-
-    std::array<size_t, 4> n_key{2,3,3,3};
-    EXPECT_THROW(
-        pbsutils::memcache_fetch(n_key), stlcache::exception_invalid_key
-    );
-}
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "cache_helper.h"
 
 TEST(CacheHelperTest, FileCache) {
     std::array<size_t, 4> key{1,2,3,4};
@@ -39,6 +24,100 @@ TEST(CacheHelperTest, FileCache) {
     EXPECT_TRUE(exists);
 }
 
+TEST(CacheHelperTest, MappedMatrixStore) {
+    auto dir = boost::filesystem::temp_directory_path() /
+               boost::filesystem::unique_path("pbs-matrix-store-%%%%-%%%%");
+    std::string path = (dir / "matrices.cache").string();
+    Eigen::MatrixXd mat = Eigen::MatrixXd::Random(5, 3);
+    Eigen::MatrixXd other = Eigen::MatrixXd::Random(7, 2);
+    {
+        pbsutils::MappedMatrixStore store(path), second(path);
+        EXPECT_FALSE(store.find({1, 2, 3, 4}));
+        auto view = store.insert({1, 2, 3, 4}, mat);
+        EXPECT_EQ(mat, view);
+        // the same bytes (in the mapping) on every lookup
+        auto found = store.find({1, 2, 3, 4});
+        ASSERT_TRUE(found);
+        EXPECT_EQ(view.data(), found->data());
+        // the first one is kept
+        EXPECT_EQ(mat, store.insert({1, 2, 3, 4}, other));
+
+        // appended by another store (as another process would)
+        second.insert({2, 2, 3, 4}, other);
+        ASSERT_TRUE(store.find({2, 2, 3, 4}));
+        EXPECT_EQ(other, *store.find({2, 2, 3, 4}));
+        ASSERT_TRUE(second.find({1, 2, 3, 4}));
+
+        // views stay valid when the index is dropped
+        store.reopen();
+        EXPECT_EQ(mat, view);
+        EXPECT_EQ(other, *store.find({2, 2, 3, 4}));
+    }
+
+    // a half-written record is skipped, then overwritten
+    auto size = boost::filesystem::file_size(path);
+    {
+        std::ofstream ofp(path, std::ios::binary | std::ios::app);
+        std::vector<char> garbage(100, 0x5a);
+        ofp.write(garbage.data(), garbage.size());
+    }
+    {
+        pbsutils::MappedMatrixStore store(path);
+        EXPECT_EQ(mat, *store.find({1, 2, 3, 4}));
+        EXPECT_FALSE(store.find({3, 2, 3, 4}));
+        store.insert({3, 2, 3, 4}, mat);
+    }
+    EXPECT_EQ(size + 56 + mat.size() * sizeof(double),
+              boost::filesystem::file_size(path));
+    {
+        pbsutils::MappedMatrixStore store(path);
+        EXPECT_EQ(mat, *store.find({3, 2, 3, 4}));
+    }
+    boost::filesystem::remove_all(dir);
+
+    // many threads of two stores appending and looking up
+    {
+        pbsutils::MappedMatrixStore first(path), second(path);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < 8; ++i)
+            threads.emplace_back([&, i]() {
+                auto &store = i % 2 ? first : second;
+                for (size_t k = 0; k < 200; ++k) {
+                    size_t rows = k % 7 + 1;
+                    Eigen::MatrixXd val =
+                        Eigen::MatrixXd::Constant(rows, 2, double(k));
+                    EXPECT_EQ(val, store.insert({k, rows, 2, 0}, val));
+                    auto found = store.find({(k * 7 + i) % 200, 0, 0, 0});
+                    EXPECT_FALSE(found);
+                }
+            });
+        for (auto &thread : threads) thread.join();
+
+        // the records went into the windows mapped up front
+        std::ifstream maps("/proc/self/maps");
+        size_t num_mappings = 0;
+        for (std::string line; std::getline(maps, line);)
+            if (line.find(path) != std::string::npos) ++num_mappings;
+        EXPECT_LE(num_mappings, 2u);
+    }
+    {
+        pbsutils::MappedMatrixStore store(path);
+        for (size_t k = 0; k < 200; ++k) {
+            auto found = store.find({k, k % 7 + 1, 2, 0});
+            ASSERT_TRUE(found);
+            EXPECT_EQ(Eigen::MatrixXd::Constant(k % 7 + 1, 2, double(k)),
+                      *found);
+        }
+    }
+    boost::filesystem::remove_all(dir);
+
+    // without a usable file, matrices are still kept in memory
+    pbsutils::MappedMatrixStore store("/proc/no-such-dir/matrices.cache");
+    store.insert({1, 2, 3, 4}, mat);
+    ASSERT_TRUE(store.find({1, 2, 3, 4}));
+    EXPECT_EQ(mat, *store.find({1, 2, 3, 4}));
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -1,10 +1,15 @@
 #include <gtest/gtest.h>
 
+#include <cstdio>
+#include <fstream>
 #include <random>
+#include <set>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <tsl/ordered_map.h>
 
+#include "incremental_pbs.h"
 #include "pbs.h"
 #include "test_helper.h"
 
@@ -77,6 +82,465 @@ TEST(PbsTest, AdversarialCases) {
   DoAdversarialTests(5, true);
 }
 
+TEST(PbsTest, MultiThreadedEncodingIsBitIdentical) {
+  size_t d = 10000;
+  auto keys = GenerateSet<uint32_t>(10 * d);
+  std::vector<std::string> serialized;
+  for (unsigned num_threads : {1u, 2u, 3u, 8u}) {
+    ParityBitmapSketch pbs(d);
+    pbs.setNumThreads(num_threads);
+    pbs.add(keys.begin(), keys.end());
+    auto [enc, hint] = pbs.encode();
+    EXPECT_EQ(nullptr, hint);
+    std::string buffer(enc->serializedSize(), 0);
+    enc->write((uint8_t *)&buffer[0]);
+    serialized.push_back(buffer);
+  }
+  for (const auto &buffer : serialized) EXPECT_EQ(serialized.front(), buffer);
+}
+
+TEST(PbsTest, ConcurrentConstruction) {
+  // one sketch per peer, all built at once: the defaults come from the
+  // precomputed tables, two rounds from the parameter search and its caches
+  std::vector<std::pair<size_t, unsigned>> configs;
+  for (size_t d : {5, 42, 79, 300, 1005, 1300, 2222, 5000})
+    for (unsigned r : {2u, DEFAULT_MAX_ROUNDS}) configs.emplace_back(d, r);
+
+  const size_t num_threads = 16;
+  std::vector<std::vector<std::pair<size_t, size_t>>> built(num_threads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i)
+    threads.emplace_back([i, &configs, &built]() {
+      for (size_t j = 0; j < configs.size(); ++j) {
+        auto [d, r] = configs[(i + j) % configs.size()];
+        ParityBitmapSketch pbs(d, DEFAULT_AVG_DIFFS_PER_GROUP,
+                               DEFAULT_TARGET_SUCCESS_PROB, r);
+        pbs.add(uint32_t(i * 100 + j));
+        pbs.encode();
+        built[i].emplace_back(pbs.bchParameterM(), pbs.bchParameterT());
+      }
+    });
+  for (auto &thread : threads) thread.join();
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    ASSERT_EQ(configs.size(), built[i].size());
+    for (size_t j = 0; j < configs.size(); ++j) {
+      auto [d, r] = configs[(i + j) % configs.size()];
+      pbsutils::BestBchParam param{};
+      pbsutils::PbsParam::bestBchParam(d, DEFAULT_AVG_DIFFS_PER_GROUP, r,
+                                       DEFAULT_NUM_GROUPS_WHEN_BCH_FAIL,
+                                       DEFAULT_TARGET_SUCCESS_PROB, param);
+      EXPECT_EQ(param.m, built[i][j].first) << "d " << d << ", r " << r;
+      EXPECT_EQ(param.t, built[i][j].second) << "d " << d << ", r " << r;
+    }
+  }
+}
+
+TEST(PbsTest, NoHintIsAnEmptyHint) {
+  // Alice sends no hint when the groups of a round had no exceptions
+  size_t d = 1000;
+  auto [sa, sb] = GenerateRandomSetPair(d, 0.5);
+  ParityBitmapSketch alice(d);
+  alice.add(sa.begin(), sa.end());
+  auto [encoding_msg, hint_msg] = alice.encode();
+  EXPECT_EQ(nullptr, hint_msg);
+
+  std::vector<std::string> serialized;
+  for (int empty_hint = 0; empty_hint < 2; ++empty_hint) {
+    ParityBitmapSketch bob(d);
+    bob.add(sb.begin(), sb.end());
+    bob.encode();
+    std::vector<uint64_t> xors, checksums;
+    bob.decode(*encoding_msg, xors, checksums);
+    std::shared_ptr<PbsEncodingMessage> enc;
+    if (empty_hint) {
+      PbsEncodingHintMessage hint(bob.hint_max_range());
+      enc = bob.encodeWithHint(hint);
+    } else {
+      enc = bob.encodeWithHint(hint_msg.get());
+    }
+    // (nothing to write when every group succeeded)
+    std::string buffer(std::max<ssize_t>(enc->serializedSize(), 0), 0);
+    if (!buffer.empty()) enc->write((uint8_t *)&buffer[0]);
+    serialized.push_back(std::to_string(enc->num_groups) + ":" + buffer);
+  }
+  EXPECT_EQ(serialized[0], serialized[1]);
+}
+
+TEST(PbsTest, BulkAddMatchesSingleAdd) {
+  // 200 groups go through the direct scatter, 20000 through the radix passes
+  for (size_t d : {1000, 100000}) {
+    auto keys32 = GenerateSet<uint32_t>(3 * d);
+    std::vector<uint64_t> keys(keys32.begin(), keys32.end());
+    std::vector<std::string> serialized;
+    for (int bulk = 0; bulk < 2; ++bulk) {
+      ParityBitmapSketch pbs(d);
+      if (bulk)
+        pbs.add(keys.data(), keys.size());
+      else
+        for (auto key : keys) pbs.add(key);
+      auto [enc, hint] = pbs.encode();
+      EXPECT_EQ(nullptr, hint);
+      std::string buffer(enc->serializedSize(), 0);
+      enc->write((uint8_t *)&buffer[0]);
+      serialized.push_back(buffer);
+    }
+    EXPECT_EQ(serialized[0], serialized[1]);
+  }
+}
+
+TEST(PbsTest, IncrementalEncodingMatchesFromScratch) {
+  size_t d = 1000;
+  auto keys = GenerateSet<uint32_t>(20 * d);
+  // the first half is inserted, then every fourth element of it is erased
+  // and the second half inserted
+  size_t half = keys.size() / 2;
+  IncrementalParityBitmapSketch incremental(d);
+  incremental.insert(keys.begin(), keys.begin() + half);
+  std::vector<uint32_t> final_set;
+  for (size_t i = 0; i < half; ++i) {
+    if (i % 4 == 0)
+      incremental.erase(keys[i]);
+    else
+      final_set.push_back(keys[i]);
+  }
+  incremental.insert(keys.begin() + half, keys.end());
+  final_set.insert(final_set.end(), keys.begin() + half, keys.end());
+  EXPECT_EQ(final_set.size(), incremental.size());
+  // erase and insert are the same toggle
+  EXPECT_FALSE(incremental.contains(keys[0]));
+  incremental.erase(keys[0]);
+  EXPECT_TRUE(incremental.contains(keys[0]));
+  incremental.insert(keys[0]);
+  EXPECT_FALSE(incremental.contains(keys[0]));
+  EXPECT_EQ(final_set.size(), incremental.size());
+
+  ParityBitmapSketch scratch(d);
+  scratch.add(final_set.begin(), final_set.end());
+  auto [scratch_enc, scratch_hint] = scratch.encode();
+  EXPECT_EQ(nullptr, scratch_hint);
+  auto [pbs, enc] = incremental.encode();
+  ASSERT_EQ(scratch_enc->serializedSize(), enc->serializedSize());
+  std::string expected(scratch_enc->serializedSize(), 0),
+      actual(enc->serializedSize(), 0);
+  scratch_enc->write((uint8_t *)&expected[0]);
+  enc->write((uint8_t *)&actual[0]);
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(PbsTest, IncrementalReconciles) {
+  size_t d = 1000;
+  auto [sa, sb] = GenerateRandomSetPair(d, 0.5, 10 * d);
+  std::unordered_set<uint64_t> expected;
+  for (auto e : sa) expected.insert(e);
+  for (auto e : sb)
+    if (!expected.erase(e)) expected.insert(e);
+
+  // Alice keeps incremental state, Bob builds from scratch each time
+  IncrementalParityBitmapSketch alice_state(d);
+  alice_state.insert(sa.begin(), sa.end());
+  auto [alice, encoding_msg] = alice_state.encode();
+  ParityBitmapSketch bob(d);
+  bob.add(sb.begin(), sb.end());
+  bob.encode();
+  std::vector<uint64_t> xors, checksums;
+  auto decoding_msg = bob.decode(*encoding_msg, xors, checksums);
+  // an element recovered an even number of times was a fake
+  std::unordered_set<uint64_t> result;
+  auto collect = [&result](const std::vector<uint64_t> &recovered) {
+    for (auto elm : recovered)
+      if (!result.erase(elm)) result.insert(elm);
+  };
+  while (!alice->decodeCheck(*decoding_msg, xors, checksums)) {
+    collect(alice->differencesLastRound());
+    auto [enc, hint] = alice->encode();
+    bob.encodeWithHint(hint.get());
+    decoding_msg = bob.decode(*enc, xors, checksums);
+  }
+  collect(alice->differencesLastRound());
+  EXPECT_EQ(expected, result);
+  EXPECT_EQ(alice->rounds(), bob.rounds());
+}
+
+TEST(PbsTest, IncrementalReconcilesNarrowKeys) {
+  using Pbs32 = BasicParityBitmapSketch<uint32_t>;
+  size_t d = 1000;
+  const std::string path = "incremental_pbs_snapshot_test.bin";
+  auto [sa, sb] = GenerateRandomSetPair(d, 0.5, 10 * d);
+  // Alice also had every third element of sb, and erased them again
+  BasicIncrementalParityBitmapSketch<uint32_t> alice_state(d);
+  alice_state.setChecksumBits(20);
+  alice_state.insert(sa.begin(), sa.end());
+  for (size_t i = 0; i < sb.size(); i += 3) alice_state.insert(sb[i]);
+  for (size_t i = 0; i < sb.size(); i += 3) alice_state.erase(sb[i]);
+  EXPECT_EQ(sa.size(), alice_state.size());
+  std::unordered_set<uint32_t> expected(sa.begin(), sa.end());
+  for (auto e : sb)
+    if (!expected.erase(e)) expected.insert(e);
+
+  // once through the sketch returned, once through a snapshot of it (which
+  // holds its own copy of the groups)
+  for (bool restore : {false, true}) {
+    auto [returned, encoding_msg] = alice_state.encode();
+    EXPECT_EQ(20u, returned->checksumBits());
+    std::unique_ptr<Pbs32> alice = std::move(returned);
+    if (restore) {
+      alice->save(path);
+      alice = std::make_unique<Pbs32>(Pbs32::load(path));
+    }
+    Pbs32 bob(d);
+    bob.setChecksumBits(20);
+    bob.add(sb.begin(), sb.end());
+    bob.encode();
+    std::vector<uint32_t> xors, checksums;
+    auto decoding_msg = bob.decode(*encoding_msg, xors, checksums);
+    std::unordered_set<uint32_t> result;
+    auto collect = [&result](const std::vector<uint32_t> &recovered) {
+      for (auto elm : recovered)
+        if (!result.erase(elm)) result.insert(elm);
+    };
+    while (!alice->decodeCheck(*decoding_msg, xors, checksums)) {
+      collect(alice->differencesLastRound());
+      auto [enc, hint] = alice->encode();
+      bob.encodeWithHint(hint.get());
+      decoding_msg = bob.decode(*enc, xors, checksums);
+    }
+    collect(alice->differencesLastRound());
+    EXPECT_EQ(expected, result);
+  }
+  std::remove(path.c_str());
+}
+
+TEST(PbsTest, SnapshotRestoresState) {
+  size_t d = 1000;
+  const std::string path = "pbs_snapshot_test.bin";
+  auto [sa, sb] = GenerateRandomSetPair(d, 0.5, 10 * d);
+  std::unordered_set<uint64_t> expected;
+  for (auto e : sa) expected.insert(e);
+  for (auto e : sb)
+    if (!expected.erase(e)) expected.insert(e);
+
+  auto serialize = [](const PbsEncodingMessage &msg) {
+    std::string buffer(msg.serializedSize(), 0);
+    msg.write((uint8_t *)&buffer[0]);
+    return buffer;
+  };
+  ParityBitmapSketch fresh(d);
+  fresh.add(sa.begin(), sa.end());
+  auto fresh_encoding = serialize(*fresh.encode().first);
+
+  // snapshots taken before and after encoding
+  for (bool encode_first : {false, true}) {
+    {
+      ParityBitmapSketch alice(d);
+      alice.add(sa.begin(), sa.end());
+      if (encode_first) alice.encode();
+      alice.save(path);
+    }
+    auto alice = ParityBitmapSketch::load(path);
+    EXPECT_EQ(d, alice.numberOfGroups() * DEFAULT_AVG_DIFFS_PER_GROUP);
+    auto [encoding_msg, hint_msg] = alice.encode();
+    EXPECT_EQ(nullptr, hint_msg);
+    EXPECT_EQ(fresh_encoding, serialize(*encoding_msg));
+
+    ParityBitmapSketch bob(d);
+    bob.add(sb.begin(), sb.end());
+    bob.encode();
+    std::vector<uint64_t> xors, checksums;
+    auto decoding_msg = bob.decode(*encoding_msg, xors, checksums);
+    std::unordered_set<uint64_t> result;
+    auto collect = [&result](const std::vector<uint64_t> &recovered) {
+      for (auto elm : recovered)
+        if (!result.erase(elm)) result.insert(elm);
+    };
+    while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
+      collect(alice.differencesLastRound());
+      auto [enc, hint] = alice.encode();
+      bob.encodeWithHint(hint.get());
+      decoding_msg = bob.decode(*enc, xors, checksums);
+    }
+    collect(alice.differencesLastRound());
+    EXPECT_EQ(expected, result);
+    EXPECT_THROW(alice.save(path), std::logic_error);
+  }
+
+  // fields out of range or inconsistent, and group offsets that are not
+  // monotone
+  auto corrupt = [&](auto patch) {
+    {
+      ParityBitmapSketch alice(d);
+      alice.add(sa.begin(), sa.end());
+      alice.save(path);
+    }
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    patch(file);
+  };
+  auto read_u64 = [](std::fstream &file, size_t pos) {
+    uint64_t val = 0;
+    file.seekg(pos);
+    file.read((char *)&val, sizeof(val));
+    return val;
+  };
+  auto write_u64 = [](std::fstream &file, size_t pos, uint64_t val) {
+    file.seekp(pos);
+    file.write((const char *)&val, sizeof(val));
+  };
+  auto write_u32 = [](std::fstream &file, size_t pos, uint32_t val) {
+    file.seekp(pos);
+    file.write((const char *)&val, sizeof(val));
+  };
+  // bch_m, bch_t and round_count are the 32-bit fields at bytes 44, 48 and 52
+  // of the header
+  for (auto [pos, val] : std::vector<std::pair<size_t, uint32_t>>{
+           {44, 40}, {48, 0}, {48, pbsutils::MAX_BALLS + 1}, {52, 1}}) {
+    corrupt([&](std::fstream &file) { write_u32(file, pos, val); });
+    EXPECT_THROW(ParityBitmapSketch::load(path), std::runtime_error);
+  }
+  // num_groups, num_groups_remaining and hint_max_range are the 64-bit fields
+  // at bytes 80, 88 and 96 of the header
+  for (size_t pos : {80, 88, 96}) {
+    corrupt([&](std::fstream &file) {
+      write_u64(file, pos, read_u64(file, pos) + 1);
+    });
+    EXPECT_THROW(ParityBitmapSketch::load(path), std::runtime_error);
+  }
+  // num_diffs (at byte 16), so the number of groups no longer follows from it
+  corrupt([&](std::fstream &file) {
+    write_u64(file, 16, read_u64(file, 16) * 2);
+  });
+  EXPECT_THROW(ParityBitmapSketch::load(path), std::runtime_error);
+  // the offset of the group offsets section is at byte 104 + 8 of the header
+  corrupt([&](std::fstream &file) {
+    uint64_t offsets = read_u64(file, 112);
+    write_u64(file, offsets + 8, read_u64(file, offsets + 16) + 1);
+  });
+  EXPECT_THROW(ParityBitmapSketch::load(path), std::runtime_error);
+
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << "definitely not a snapshot";
+  }
+  EXPECT_THROW(ParityBitmapSketch::load(path), std::runtime_error);
+  std::remove(path.c_str());
+  EXPECT_THROW(ParityBitmapSketch::load(path), std::runtime_error);
+}
+
+template <typename Key>
+void DoKeyTypeTest(const std::vector<Key> &keys, size_t d) {
+  // Alice holds the first d / 2 keys only, Bob the next d / 2 keys only, and
+  // both hold the rest
+  std::vector<Key> sa(keys.begin(), keys.begin() + d / 2),
+      sb(keys.begin() + d / 2, keys.begin() + d);
+  sa.insert(sa.end(), keys.begin() + d, keys.end());
+  sb.insert(sb.end(), keys.begin() + d, keys.end());
+
+  BasicParityBitmapSketch<Key> alice(d), bob(d);
+  alice.add(sa.begin(), sa.end());
+  bob.add(sb.begin(), sb.end());
+  auto [encoding_msg, hint_msg] = alice.encode();
+  EXPECT_EQ(nullptr, hint_msg);
+  bob.encode();
+  using word_t = typename BasicParityBitmapSketch<Key>::word_t;
+  using checksum_t = typename BasicParityBitmapSketch<Key>::checksum_t;
+  std::vector<word_t> xors;
+  std::vector<checksum_t> checksums;
+  auto decoding_msg = bob.decode(*encoding_msg, xors, checksums);
+  std::unordered_set<word_t> words;
+  auto collect = [&words](const std::vector<word_t> &recovered) {
+    for (auto word : recovered)
+      if (!words.erase(word)) words.insert(word);
+  };
+  while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
+    collect(alice.differencesLastRound());
+    auto [enc, hint] = alice.encode();
+    bob.encodeWithHint(hint.get());
+    decoding_msg = bob.decode(*enc, xors, checksums);
+  }
+  collect(alice.differencesLastRound());
+
+  // with fingerprints, every reconciled word maps back to a key on exactly
+  // one side
+  std::vector<Key> alice_only, bob_only;
+  for (auto word : words) {
+    Key key;
+    bool in_alice = alice.findKey(word, key);
+    if (in_alice) alice_only.push_back(key);
+    bool in_bob = bob.findKey(word, key);
+    if (in_bob) bob_only.push_back(key);
+    if constexpr (KeyTraits<Key>::is_fingerprint) {
+      EXPECT_NE(in_alice, in_bob);
+    }
+  }
+  if constexpr (!KeyTraits<Key>::is_fingerprint) {
+    // integer keys are the words themselves, so each side "finds" all of them
+    std::vector<Key> expected(keys.begin(), keys.begin() + d);
+    std::sort(expected.begin(), expected.end());
+    std::sort(alice_only.begin(), alice_only.end());
+    EXPECT_EQ(expected, alice_only);
+  } else {
+    std::sort(alice_only.begin(), alice_only.end());
+    std::sort(bob_only.begin(), bob_only.end());
+    std::vector<Key> expected_a(keys.begin(), keys.begin() + d / 2),
+        expected_b(keys.begin() + d / 2, keys.begin() + d);
+    std::sort(expected_a.begin(), expected_a.end());
+    std::sort(expected_b.begin(), expected_b.end());
+    EXPECT_EQ(expected_a, alice_only);
+    EXPECT_EQ(expected_b, bob_only);
+  }
+}
+
+TEST(PbsTest, KeyTypes) {
+  size_t d = 200, common = 2000;
+  auto keys32 = GenerateSet<uint32_t>(d + common);
+  DoKeyTypeTest(keys32, d);
+
+  std::vector<unsigned __int128> keys128;
+  std::vector<std::string> strings;
+  for (auto key : keys32) {
+    keys128.push_back(((unsigned __int128)key << 64) | (key * 2654435761u));
+    strings.push_back("content/" + std::to_string(key));
+  }
+  DoKeyTypeTest(keys128, d);
+  DoKeyTypeTest(strings, d);
+}
+
+TEST(PbsTest, TruncatedChecksums) {
+  size_t d = 200, common = 2000;
+  auto keys = GenerateSet<uint32_t>(d + common);
+  std::vector<uint32_t> sa(keys.begin(), keys.begin() + d / 2),
+      sb(keys.begin() + d / 2, keys.begin() + d);
+  sa.insert(sa.end(), keys.begin() + d, keys.end());
+  sb.insert(sb.end(), keys.begin() + d, keys.end());
+
+  BasicParityBitmapSketch<uint32_t> alice(d), bob(d);
+  alice.setChecksumBitsWithin(0.1);
+  bob.setChecksumBitsWithin(0.1);
+  ASSERT_LT(alice.checksumBits(), 32u);
+  ASSERT_EQ(alice.checksumBits(), bob.checksumBits());
+  alice.add(sa.begin(), sa.end());
+  bob.add(sb.begin(), sb.end());
+
+  auto [encoding_msg, hint_msg] = alice.encode();
+  EXPECT_THROW(alice.setChecksumBits(16), std::logic_error);
+  bob.encode();
+  std::vector<uint32_t> xors, checksums;
+  auto decoding_msg = bob.decode(*encoding_msg, xors, checksums);
+  std::set<uint32_t> recovered;
+  for (size_t round = 1;; ++round) {
+    for (auto checksum : checksums)
+      EXPECT_EQ(0u, checksum >> alice.checksumBits());
+    bool done = alice.decodeCheck(*decoding_msg, xors, checksums);
+    recovered.insert(alice.differencesLastRound().begin(),
+                     alice.differencesLastRound().end());
+    if (done) break;
+    ASSERT_LT(round, 10u);
+    auto [enc, hint] = alice.encode();
+    bob.encodeWithHint(hint.get());
+    decoding_msg = bob.decode(*enc, xors, checksums);
+  }
+  EXPECT_EQ(std::set<uint32_t>(keys.begin(), keys.begin() + d), recovered);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -114,8 +578,7 @@ void DoAdversarialTests(size_t d, bool fail_me, int verbose) {
 
     while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
       auto[enc, hint] = alice.encode();
-      bob.encodeWithHint(hint->groups_with_exceptions.begin(),
-                         hint->groups_with_exceptions.end());
+      bob.encodeWithHint(hint.get());
       xors.clear();
       checksums.clear();
       decoding_msg = bob.decode(*enc, xors, checksums);
@@ -281,8 +744,7 @@ void DoRandomAllInOne(size_t d, float ratio_a, size_t intersection_sz,
 
     while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
       auto[enc, hint] = alice.encode();
-      bob.encodeWithHint(hint->groups_with_exceptions.begin(),
-                         hint->groups_with_exceptions.end());
+      bob.encodeWithHint(hint.get());
       xors.clear();
       checksums.clear();
       decoding_msg = bob.decode(*enc, xors, checksums);
@@ -344,8 +806,7 @@ void DoRandomMore(size_t d, size_t scaled_d, size_t union_sz, unsigned seed,
 
     while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
       auto[enc, hint] = alice.encode();
-      bob.encodeWithHint(hint->groups_with_exceptions.begin(),
-                         hint->groups_with_exceptions.end());
+      bob.encodeWithHint(hint.get());
       xors.clear();
       checksums.clear();
       decoding_msg = bob.decode(*enc, xors, checksums);
@@ -398,8 +859,7 @@ void DoDeterministicBothNotEmpty(size_t d, float ratio_a,
 
     while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
       auto[enc, hint] = alice.encode();
-      bob.encodeWithHint(hint->groups_with_exceptions.begin(),
-                         hint->groups_with_exceptions.end());
+      bob.encodeWithHint(hint.get());
       xors.clear();
       checksums.clear();
       decoding_msg = bob.decode(*enc, xors, checksums);
@@ -448,8 +908,7 @@ void DoDeterministicBobIsEmpty(size_t d, int verbose) {
 
     while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
       auto[enc, hint] = alice.encode();
-      bob.encodeWithHint(hint->groups_with_exceptions.begin(),
-                         hint->groups_with_exceptions.end());
+      bob.encodeWithHint(hint.get());
       xors.clear();
       checksums.clear();
       decoding_msg = bob.decode(*enc, xors, checksums);
@@ -500,8 +959,7 @@ void DoDeterministicAliceIsEmpty(size_t d, int verbose) {
 
     while (!alice.decodeCheck(*decoding_msg, xors, checksums)) {
       auto[enc, hint] = alice.encode();
-      bob.encodeWithHint(hint->groups_with_exceptions.begin(),
-                         hint->groups_with_exceptions.end());
+      bob.encodeWithHint(hint.get());
       xors.clear();
       checksums.clear();
       decoding_msg = bob.decode(*enc, xors, checksums);
@@ -2,14 +2,57 @@
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <numeric>
 #include <random>
 
 #include "pbs_decoding_message.h"
 #include "pbs_encoding_hint_message.h"
 #include "pbs_encoding_message.h"
+#include "scatter_gather.h"
 
 using namespace libpbs;
 
+namespace {
+// cut `buf` into pieces of 1 .. max_piece bytes (some of them empty)
+std::vector<struct iovec> Fragment(std::vector<uint8_t> &buf, size_t max_piece,
+                                   std::mt19937_64 &gen) {
+  std::vector<struct iovec> iov;
+  for (size_t pos = 0; pos < buf.size();) {
+    size_t len = std::min(buf.size() - pos, 1 + gen() % max_piece);
+    if (gen() % 8 == 0) iov.push_back({buf.data() + pos, 0});
+    iov.push_back({buf.data() + pos, len});
+    pos += len;
+  }
+  return iov;
+}
+
+// write `message` into fragments of a buffer (surrounded by other bytes) and
+// parse it back into `parsed`, which should then write the same bytes
+void ScatterGatherRoundTrip(const PbsMessage &message, PbsMessage &parsed,
+                            std::mt19937_64 &gen) {
+  std::vector<uint8_t> expected(message.serializedSize());
+  ASSERT_EQ(message.write(expected.data()), (ssize_t)expected.size());
+  for (size_t max_piece : {1, 3, 8, 64, 1 << 20}) {
+    std::vector<uint8_t> buf(expected.size() + 10, 0xa5);
+    auto iov = Fragment(buf, max_piece, gen);
+    utils::ScatterWriter sink(iov.data(), iov.size());
+    sink.Put("head", 4);
+    ASSERT_EQ(message.writeScattered(sink), (ssize_t)expected.size());
+    sink.Put("tail!!", 6);
+    ASSERT_EQ(0u, sink.Remaining());
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), buf.begin() + 4));
+
+    utils::GatherReader source(iov.data(), iov.size());
+    source.Skip(4);
+    ASSERT_EQ(parsed.parseGathered(source), (ssize_t)expected.size());
+    ASSERT_EQ(6u, source.Remaining());
+    std::vector<uint8_t> rewritten(expected.size());
+    ASSERT_EQ(parsed.write(rewritten.data()), (ssize_t)expected.size());
+    ASSERT_EQ(expected, rewritten);
+  }
+}
+}  // namespace
+
 /**
  *  EncodingMessage: "good cases" -- bch_m * bch_t * num_groups % 8 == 0
  */
@@ -143,6 +186,106 @@ TEST(PbsMessagesTest, EncodingMessageMultipleGroupBadCase) {
   }
 }
 
+/**
+ *  EncodingMessage: sketches written in place (into a dirty buffer) keep the
+ *  layout of whole bytes first and the remaining bits of every sketch packed
+ *  at the end
+ */
+TEST(PbsMessagesTest, EncodingMessageBadCaseLayout) {
+  std::mt19937_64 gen(20200803);
+  for (size_t bch_m : {7, 9, 11, 13}) {
+    for (size_t bch_t : {7, 13, 25}) {
+      for (size_t num_groups : {1, 2, 9}) {
+        if (bch_m * bch_t % 8 == 0) continue;
+        PbsEncodingMessage message(bch_m, bch_t, num_groups);
+        for (size_t g = 0; g < num_groups; ++g)
+          for (int i = 0; i < 5; ++i)
+            minisketch_add_uint64(message.getSketch(g),
+                                  1 + gen() % ((1u << bch_m) - 1));
+
+        size_t sketch_bytes = bch_m * bch_t / 8, remainder = bch_m * bch_t % 8;
+        std::vector<uint8_t> expected(message.serializedSize(), 0),
+            buf(sketch_bytes + 1);
+        utils::BitWriter writer(&expected[sketch_bytes * num_groups]);
+        for (size_t g = 0; g < num_groups; ++g) {
+          minisketch_serialize(message.getSketch(g), buf.data());
+          std::copy(buf.begin(), buf.begin() + sketch_bytes,
+                    expected.begin() + g * sketch_bytes);
+          writer.Write<uint8_t>(buf[sketch_bytes], remainder);
+        }
+        writer.Flush();
+
+        std::vector<uint8_t> written(expected.size(), 0xa5);
+        EXPECT_EQ(message.write(written.data()), (ssize_t)written.size());
+        EXPECT_EQ(expected, written);
+
+        PbsEncodingMessage parsed(bch_m, bch_t, num_groups);
+        EXPECT_EQ(parsed.parse(written.data(), written.size()),
+                  (ssize_t)written.size());
+        std::vector<uint8_t> rewritten(expected.size());
+        parsed.write(rewritten.data());
+        EXPECT_EQ(expected, rewritten);
+      }
+    }
+  }
+}
+
+/**
+ *  EncodingMessage: sketches are borrowed from the pool, so encoding and
+ *  parsing again with the same parameters creates no new sketch
+ */
+TEST(PbsMessagesTest, EncodingMessageReusesPooledSketches) {
+  size_t bch_m = 11, bch_t = 6, num_groups = 20;
+  auto &pool = utils::SketchPool::Global();
+  std::string buffer;
+  {
+    PbsEncodingMessage message(bch_m, bch_t, num_groups);
+    for (size_t g = 0; g < num_groups; ++g)
+      minisketch_add_uint64(message.getSketch(g), g + 1);
+    buffer.resize(message.serializedSize());
+    message.write((uint8_t *)&buffer[0]);
+    PbsEncodingMessage parsed(bch_m, bch_t, num_groups);
+    parsed.parse((const uint8_t *)&buffer[0], buffer.size());
+  }
+
+  auto created = pool.numCreated();
+  for (int round = 0; round < 3; ++round) {
+    PbsEncodingMessage message(bch_m, bch_t, num_groups);
+    // reused sketches must come back all-zero
+    std::string zeros(message.serializedSize(), 0), written(zeros);
+    message.write((uint8_t *)&written[0]);
+    EXPECT_EQ(written, zeros);
+
+    PbsEncodingMessage parsed(bch_m, bch_t, num_groups);
+    EXPECT_EQ(parsed.parse((const uint8_t *)&buffer[0], buffer.size()),
+              buffer.size());
+    std::string rewritten(buffer.size(), 0);
+    parsed.write((uint8_t *)&rewritten[0]);
+    EXPECT_EQ(rewritten, buffer);
+  }
+  EXPECT_EQ(pool.numCreated(), created);
+}
+
+TEST(PbsMessagesTest, SketchPoolKeepsAtMostTheLimit) {
+  utils::SketchPool pool(8);
+  std::vector<minisketch *> sketches(20);
+  pool.acquire(10, 5, sketches.size(), sketches.data());
+  EXPECT_EQ(20u, pool.numCreated());
+  // the ones beyond the limit are destroyed
+  pool.release(sketches.data(), sketches.size());
+  EXPECT_EQ(8u, pool.numIdle());
+  pool.acquire(12, 3, 4, sketches.data());
+  pool.release(sketches.data(), 4);
+  EXPECT_EQ(12u, pool.numIdle());
+
+  pool.acquire(10, 5, sketches.size(), sketches.data());
+  EXPECT_EQ(20u + 4 + 12, pool.numCreated());
+  pool.release(sketches.data(), sketches.size());
+  pool.setMaxIdlePerKey(2);
+  EXPECT_EQ(2u, pool.maxIdlePerKey());
+  EXPECT_EQ(4u, pool.numIdle());
+}
+
 TEST(PbsMessagesTest, DecodingMessageWriteThenParse) {
   size_t bch_m = 12, bch_t = 7, num_groups = 3;
   PbsDecodingMessage message(bch_m, bch_t, num_groups);
@@ -160,6 +303,80 @@ TEST(PbsMessagesTest, DecodingMessageWriteThenParse) {
   EXPECT_EQ(message1.decoded_differences, message.decoded_differences);
 }
 
+TEST(PbsMessagesTest, DecodingMessageCompactWriteThenParse) {
+  size_t bch_m = 12, bch_t = 7, num_groups = 4;
+  PbsDecodingMessage message(bch_m, bch_t, num_groups,
+                             PbsDecodingFormat::COMPACT);
+  message.decoded_num_differences = {3, 0, 2, -1};
+  message.decoded_differences = {1, 2, 3, 43, 4094};
+  size_t ss = message.serializedSize();
+  std::vector<uint8_t> buffer(ss);
+  EXPECT_EQ(message.write(&buffer[0]), ss);
+
+  PbsDecodingMessage message1(bch_m, bch_t, num_groups,
+                              PbsDecodingFormat::COMPACT);
+  EXPECT_EQ(message1.parse(&buffer[0], buffer.size()), ss);
+  EXPECT_EQ(message1.decoded_num_differences, message.decoded_num_differences);
+  EXPECT_EQ(message1.decoded_differences, message.decoded_differences);
+
+  // positions of a group have to be sorted
+  message.decoded_differences = {3, 1, 2, 43, 4094};
+  EXPECT_THROW(message.serializedSize(), std::invalid_argument);
+  message.decoded_differences = {1, 2, 3, 43, 4094};
+
+  // a truncated message is rejected
+  EXPECT_EQ(message1.parse(&buffer[0], buffer.size() - 1), -1);
+
+  // and so is a position outside GF(2^12)
+  message.decoded_num_differences = {0, 2, 0, 0};
+  message.decoded_differences = {4095, 4096};
+  buffer.resize(message.serializedSize());
+  message.write(&buffer[0]);
+  EXPECT_EQ(message1.parse(&buffer[0], buffer.size()), -1);
+  message.decoded_differences = {4094, 4095};
+  buffer.resize(message.serializedSize());
+  message.write(&buffer[0]);
+  EXPECT_EQ(message1.parse(&buffer[0], buffer.size()), buffer.size());
+}
+
+/**
+ * Counts around their mean and uniformly distributed positions (as after
+ * BCH decoding) cost fewer bits in the compact format.
+ */
+TEST(PbsMessagesTest, DecodingMessageCompactIsSmaller) {
+  size_t bch_m = 8, bch_t = 13, num_groups = 2000;
+  std::mt19937_64 gen(20200802u);
+  std::poisson_distribution<int> num_diffs(5);
+  PbsDecodingMessage fixed(bch_m, bch_t, num_groups);
+  fixed.decoded_differences.clear();
+  for (size_t g = 0; g < num_groups; ++g) {
+    auto &d = fixed.decoded_num_differences[g];
+    // one group failed BCH decoding
+    d = g == 7 ? -1 : std::min(num_diffs(gen), int(bch_t));
+    if (d < 0) continue;
+    std::vector<uint64_t> bins(255);
+    std::iota(bins.begin(), bins.end(), 1);
+    std::shuffle(bins.begin(), bins.end(), gen);
+    std::sort(bins.begin(), bins.begin() + d);
+    fixed.decoded_differences.insert(fixed.decoded_differences.end(),
+                                     bins.begin(), bins.begin() + d);
+  }
+
+  PbsDecodingMessage compact(bch_m, bch_t, num_groups,
+                             PbsDecodingFormat::COMPACT);
+  compact.decoded_num_differences = fixed.decoded_num_differences;
+  compact.decoded_differences = fixed.decoded_differences;
+  EXPECT_LT(compact.serializedSize(), fixed.serializedSize());
+
+  std::vector<uint8_t> buffer(compact.serializedSize());
+  compact.write(&buffer[0]);
+  PbsDecodingMessage parsed(bch_m, bch_t, num_groups,
+                            PbsDecodingFormat::COMPACT);
+  EXPECT_EQ(parsed.parse(&buffer[0], buffer.size()), buffer.size());
+  EXPECT_EQ(parsed.decoded_num_differences, fixed.decoded_num_differences);
+  EXPECT_EQ(parsed.decoded_differences, fixed.decoded_differences);
+}
+
 TEST(PbsMessagesTest, DecodingMessageSetWithSucceed) {
   size_t bch_m = 12, bch_t = 7, num_groups = 5;
   PbsDecodingMessage message(bch_m, bch_t, num_groups);
@@ -276,6 +493,37 @@ TEST(PbsMessagesTest, DecodingMessageSetWithMixed) {
   for (auto &sketch : sketches) minisketch_destroy(sketch);
 }
 
+TEST(PbsMessagesTest, DecodingMessageSetWithMultiThreaded) {
+  size_t bch_m = 10, bch_t = 8, num_groups = 200;
+  std::vector<minisketch *> sketches(num_groups * 2);
+  for (auto &sketch : sketches) sketch = minisketch_create(bch_m, 0, bch_t);
+
+  std::mt19937_64 gen(20200725);
+  std::uniform_int_distribution<> dist(0, bch_t + 2);
+  for (size_t g = 0; g < num_groups; ++g) {
+    size_t d = dist(gen);
+    for (size_t k = 0; k < d; ++k)
+      minisketch_add_uint64(sketches[g], 4 * g + k + 1);
+  }
+
+  std::vector<std::vector<uint8_t>> serialized;
+  for (unsigned num_threads : {1u, 2u, 5u}) {
+    std::vector<minisketch *> copies(num_groups);
+    for (size_t g = 0; g < num_groups; ++g)
+      copies[g] = minisketch_clone(sketches[g]);
+    PbsDecodingMessage message(bch_m, bch_t, num_groups);
+    message.setWith(copies.begin(), copies.end(),
+                    sketches.cbegin() + num_groups, num_threads);
+    std::vector<uint8_t> buffer(message.serializedSize());
+    message.write(&buffer[0]);
+    serialized.push_back(buffer);
+    for (auto &sketch : copies) minisketch_destroy(sketch);
+  }
+  for (const auto &buffer : serialized) EXPECT_EQ(serialized.front(), buffer);
+
+  for (auto &sketch : sketches) minisketch_destroy(sketch);
+}
+
 TEST(PbsMessagesTest, EncodingHintMessageOutOfRangeError) {
   size_t num_groups = 215;
   PbsEncodingHintMessage hint_message(num_groups);
@@ -284,6 +532,15 @@ TEST(PbsMessagesTest, EncodingHintMessageOutOfRangeError) {
   for (uint32_t gid : test_ids) hint_message.addGroupId(gid);
 
   EXPECT_THROW(hint_message.addGroupId(215), std::out_of_range);
+
+  // an id out of range on the wire fails the parse instead
+  PbsEncodingHintMessage wide_message(1000);
+  wide_message.addGroupId(5);
+  wide_message.addGroupId(900);
+  std::vector<uint8_t> buffer(wide_message.serializedSize(), 0);
+  wide_message.write(&buffer[0]);
+  PbsEncodingHintMessage narrow_message(800);  // same Rice parameter
+  EXPECT_EQ(-1, narrow_message.parse(&buffer[0], buffer.size()));
 }
 
 TEST(PbsMessagesTest, EncodingHintMessage) {
@@ -301,7 +558,7 @@ TEST(PbsMessagesTest, EncodingHintMessage) {
   PbsEncodingHintMessage hint_message1(num_groups);
   auto psz = hint_message1.parse(&buffer[0], buffer.size());
   EXPECT_EQ(buffer.size(), psz);
-  EXPECT_EQ(hint_message.groups_with_exceptions, test_ids);
+  EXPECT_EQ(hint_message1.groups_with_exceptions, test_ids);
 }
 
 TEST(PbsMessagesTest, EncodingHintMessageShortMessage) {
@@ -311,15 +568,112 @@ TEST(PbsMessagesTest, EncodingHintMessageShortMessage) {
   std::vector<uint32_t> test_ids = {0, 1, 6};
   for (uint32_t gid : test_ids) hint_message.addGroupId(gid);
 
+  // dense enough for the bitmap (1 + 7 bits)
   auto ss = hint_message.serializedSize();
-  EXPECT_EQ(ss, 2);
+  EXPECT_EQ(ss, 1);
   std::vector<uint8_t> buffer(ss, 0);
   hint_message.write(&buffer[0]);
 
   PbsEncodingHintMessage hint_message1(num_groups);
   auto psz = hint_message1.parse(&buffer[0], buffer.size());
   EXPECT_EQ(buffer.size(), psz);
-  EXPECT_EQ(hint_message.groups_with_exceptions, test_ids);
+  EXPECT_EQ(hint_message1.groups_with_exceptions, test_ids);
+}
+
+TEST(PbsMessagesTest, EncodingHintMessageIdsInIncreasingOrder) {
+  PbsEncodingHintMessage hint_message(100);
+  hint_message.addGroupId(5);
+  EXPECT_THROW(hint_message.addGroupId(5), std::invalid_argument);
+  EXPECT_THROW(hint_message.addGroupId(3), std::invalid_argument);
+}
+
+TEST(PbsMessagesTest, EncodingHintMessageGapsAndBitmap) {
+  std::mt19937_64 gen(20200803u);
+  size_t num_groups = 20000;
+  // sparse hints use gaps, dense ones the bitmap
+  for (double p : {0.0005, 0.04, 0.3, 0.9}) {
+    PbsEncodingHintMessage hint_message(num_groups);
+    std::bernoulli_distribution exception(p);
+    for (uint32_t gid = 0; gid < num_groups; ++gid)
+      if (exception(gen)) hint_message.addGroupId(gid);
+    size_t count = hint_message.groups_with_exceptions.size();
+
+    size_t ss = hint_message.serializedSize();
+    EXPECT_LE(ss, utils::Bits2Bytes(1 + num_groups));
+    if (p < 0.1) {
+      EXPECT_LT(ss, utils::Bits2Bytes(count * 15));
+    }
+    std::vector<uint8_t> buffer(ss, 0);
+    EXPECT_EQ(hint_message.write(&buffer[0]), ss);
+
+    PbsEncodingHintMessage hint_message1(num_groups);
+    EXPECT_EQ(hint_message1.parse(&buffer[0], buffer.size()), ss);
+    EXPECT_EQ(hint_message1.groups_with_exceptions,
+              hint_message.groups_with_exceptions);
+  }
+}
+
+TEST(PbsMessagesTest, ScatterWriterAndGatherReader) {
+  std::vector<uint8_t> buf(64);
+  std::mt19937_64 gen(20200804u);
+  auto iov = Fragment(buf, 3, gen);
+  utils::ScatterWriter sink(iov.data(), iov.size());
+  // bits are packed the same way as by BitPacker
+  std::vector<uint8_t> packed(buf.size());
+  utils::BitPacker packer(packed.data(), packed.size());
+  std::vector<std::pair<uint64_t, unsigned>> fields;
+  for (unsigned bits = 0; bits <= 64; bits += 5) {
+    fields.emplace_back(gen(), bits);
+    sink.WriteBits(fields.back().first, bits);
+    packer.Write(fields.back().first, bits);
+  }
+  sink.FlushBits();
+  packer.Flush();
+  EXPECT_EQ(packed, buf);
+  EXPECT_THROW(sink.Put(nullptr, sink.Remaining() + 1), std::length_error);
+
+  utils::GatherReader source(iov.data(), iov.size());
+  for (auto [val, bits] : fields)
+    EXPECT_EQ(bits == 64 ? val : val & ((uint64_t(1) << bits) - 1),
+              source.ReadBits(bits));
+  uint8_t rest[64];
+  EXPECT_THROW(source.Get(rest, source.Remaining() + 1), std::length_error);
+}
+
+TEST(PbsMessagesTest, EncodingMessageScatterGather) {
+  std::mt19937_64 gen(20200804u);
+  // good and bad cases
+  for (size_t bch_m : {8, 11}) {
+    for (size_t bch_t : {8, 13}) {
+      for (size_t num_groups : {1, 2, 9}) {
+        PbsEncodingMessage message(bch_m, bch_t, num_groups);
+        for (size_t g = 0; g < num_groups; ++g)
+          for (int i = 0; i < 5; ++i)
+            minisketch_add_uint64(message.getSketch(g),
+                                  1 + gen() % ((1u << bch_m) - 1));
+        PbsEncodingMessage parsed(bch_m, bch_t, num_groups);
+        ScatterGatherRoundTrip(message, parsed, gen);
+      }
+    }
+  }
+}
+
+TEST(PbsMessagesTest, DecodingAndHintMessagesScatterGather) {
+  std::mt19937_64 gen(20200804u);
+  for (auto format :
+       {PbsDecodingFormat::FIXED_WIDTH, PbsDecodingFormat::COMPACT}) {
+    PbsDecodingMessage message(12, 7, 4, format);
+    message.decoded_num_differences = {3, 0, 2, -1};
+    message.decoded_differences = {1, 2, 3, 43, 4094};
+    PbsDecodingMessage parsed(12, 7, 4, format);
+    ScatterGatherRoundTrip(message, parsed, gen);
+  }
+
+  PbsEncodingHintMessage hint_message(20000);
+  for (uint32_t gid = 0; gid < 20000; gid += 1 + gen() % 40)
+    hint_message.addGroupId(gid);
+  PbsEncodingHintMessage parsed(20000);
+  ScatterGatherRoundTrip(hint_message, parsed, gen);
 }
 
 int main(int argc, char **argv) {
@@ -1,4 +1,9 @@
 #include <gtest/gtest.h>
+
+#include <fstream>
+#include <thread>
+#include <vector>
+
 #include "pbs_params.h"
 
 TEST(PbsParamsTest, m3d) {
@@ -49,6 +54,24 @@ TEST(PbsParamsTest, m2d) {
   EXPECT_NEAR(mat(5, 6), 0.00000473, abs_err);
 }
 
+TEST(PbsParamsTest, m2d_streamed) {
+  // the streamed slices give exactly what the whole tensor gives
+  for (auto [m, n] : {std::pair<size_t, size_t>{1, 2}, {6, 8}, {30, 31},
+                      {40, 255}}) {
+    auto m3d = pbsutils::PbsParam::computeProbabilityMatrix3D(m, n);
+    for (size_t t : {size_t(1), m / 2, m, m + 1}) {
+      Eigen::MatrixXd expected = Eigen::MatrixXd::Zero(m + 1, m + 2);
+      for (size_t i = 1; i <= m; ++i)
+        for (size_t j = 0; j <= i; ++j)
+          expected(i, j + 1) = m3d[i].block(n - t, i - j + 1, t + 1, 1).sum();
+      for (size_t i = t + 1; i <= m; ++i)
+        expected(i, i + 1) = 1 - expected.block(i, 1, 1, i).sum();
+      auto mat = pbsutils::PbsParam::computeTransitionProbabilityMatrix(m, n, t);
+      EXPECT_EQ(expected, mat) << "m " << m << ", n " << n << ", t " << t;
+    }
+  }
+}
+
 TEST(PbsParamsTest, mrm2d) {
   size_t m = 5, n = 128, t= 5, r = 2;
   auto mat = pbsutils::PbsParam::computeMultiRoundProbabilityMatrix(m, n, t, r);
@@ -63,6 +86,35 @@ TEST(PbsParamsTest, mrm2d) {
   EXPECT_NEAR(mat(5, 2), 0.00063783, abs_err);
 }
 
+TEST(PbsParamsTest, rounds_by_squaring) {
+  size_t m = 30, n = 63, t = 7;
+  auto trans = pbsutils::PbsParam::computeRoundTransitionMatrix(m, n, t);
+  EXPECT_TRUE(trans.isApprox(
+      Eigen::MatrixXd(trans.triangularView<Eigen::Lower>()), 0));
+  Eigen::MatrixXd power = Eigen::MatrixXd::Identity(m + 1, m + 1);
+  for (size_t k = 0; k <= 40; ++k, power = power * trans)
+    EXPECT_TRUE(pbsutils::PbsParam::lowerTriangularPower(trans, k)
+                    .isApprox(power, 1e-12))
+        << "k " << k;
+
+  // the same as the columns of the multi-round matrix
+  size_t r = 6;
+  auto mat = pbsutils::PbsParam::computeMultiRoundProbabilityMatrix(m, n, t, r);
+  for (size_t k = 1; k <= r; ++k) {
+    auto failure =
+        pbsutils::PbsParam::computeFailureProbabilityAfterRounds(m, n, t, k);
+    EXPECT_TRUE(failure.isApprox(mat.col(k), 1e-12)) << "rounds " << k;
+  }
+
+  // many rounds (by squaring) against one round at a time
+  Eigen::VectorXd reached = Eigen::VectorXd::Unit(m + 1, 0);
+  for (size_t k = 0; k < 5000; ++k) reached = trans * reached;
+  auto failure =
+      pbsutils::PbsParam::computeFailureProbabilityAfterRounds(m, n, t, 5000);
+  EXPECT_NEAR(0.0, failure(0), 1e-15);
+  for (size_t i = 1; i <= m; ++i) EXPECT_NEAR(1 - reached(i), failure(i), 1e-12);
+}
+
 TEST(PbsParamsTest, failprobub) {
   size_t m = 5, n = 128, t= 5, r = 2;
   auto mat = pbsutils::PbsParam::computeMultiRoundProbabilityMatrix(m, n, t, r);
@@ -92,6 +144,219 @@ TEST(PbsParamsTest, best_param) {
   EXPECT_NEAR(0.009357799909271, ub, abs_err);
 }
 
+TEST(PbsParamsTest, short_checksums) {
+  size_t d = 20, r = 2, c = 3;
+  double delta = 5.0, obj_prob = 0.99;
+  EXPECT_EQ(0.0, pbsutils::PbsParam::checksumFailureUB(d, r, 0));
+  EXPECT_DOUBLE_EQ(40.0 / 65536, pbsutils::PbsParam::checksumFailureUB(d, r, 16));
+  EXPECT_EQ(16u, pbsutils::PbsParam::minChecksumBits(d, r, 0.001));
+
+  // false positives of the checksums come on top of the failure probability
+  // of BCH, whose parameter stays the same
+  pbsutils::BestBchParam full{}, truncated{};
+  auto ub_full = pbsutils::PbsParam::bestBchParam(d, delta, r, c, obj_prob, full);
+  auto ub = pbsutils::PbsParam::bestBchParam(d, delta, r, c, obj_prob,
+                                             truncated, 12);
+  EXPECT_DOUBLE_EQ(ub_full + pbsutils::PbsParam::checksumFailureUB(d, r, 12),
+                   ub);
+  EXPECT_EQ(full.m, truncated.m);
+  EXPECT_EQ(full.t, truncated.t);
+  EXPECT_THROW(pbsutils::PbsParam::bestBchParam(d, delta, r, c, obj_prob,
+                                                truncated, 8),
+               std::invalid_argument);
+}
+
+TEST(PbsParamsTest, param_table) {
+  size_t r = 3, c = 3;
+  double delta = 5.0, obj_prob = 0.99;
+  // only configurations with a table are served from it
+  EXPECT_EQ(nullptr, pbsutils::findInParamTable(20, delta, 2, c, obj_prob));
+  EXPECT_EQ(nullptr, pbsutils::findInParamTable(20, 4.0, r, c, obj_prob));
+  if (!PBS_HAS_PARAM_TABLE) GTEST_SKIP() << "no precomputed tables";
+
+  // the tables hold what the search returns
+  for (size_t d : {1, 20, 333}) {
+    const auto *entry = pbsutils::findInParamTable(d, delta, r, c, obj_prob);
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ(d, entry->d);
+    pbsutils::BestBchParam searched{}, looked_up{};
+    auto ub = pbsutils::PbsParam::searchBchParam(d, delta, r, c, obj_prob,
+                                                 searched);
+    EXPECT_EQ(searched.m, entry->m);
+    EXPECT_EQ(searched.t, entry->t);
+    // (up to how the matrices in the disk cache were multiplied out)
+    EXPECT_NEAR(ub, entry->failure_prob_ub, 1e-12);
+    EXPECT_NEAR(ub,
+                pbsutils::PbsParam::bestBchParam(d, delta, r, c, obj_prob,
+                                                 looked_up),
+                1e-12);
+    EXPECT_EQ(searched.m, looked_up.m);
+    EXPECT_EQ(searched.t, looked_up.t);
+    // short checksums are served from the table as well
+    pbsutils::BestBchParam truncated{};
+    pbsutils::PbsParam::bestBchParam(d, delta, r, c, obj_prob, truncated, 20);
+    EXPECT_EQ(entry->m, truncated.m);
+    EXPECT_EQ(entry->t, truncated.t);
+  }
+
+  // d between two grid points gets the next larger one
+  const auto *entry = pbsutils::findInParamTable(1001, delta, r, c, obj_prob);
+  ASSERT_NE(nullptr, entry);
+  EXPECT_LE(1001u, entry->d);
+  EXPECT_EQ(entry, pbsutils::findInParamTable(entry->d, delta, r, c, obj_prob));
+}
+
+TEST(PbsParamsTest, parallel_search_is_deterministic) {
+  size_t r = 2, c = 3;
+  double delta = 5.0, obj_prob = 0.99;
+  for (size_t d : {7, 20, 450}) {
+    pbsutils::BestBchParam serial{};
+    auto ub = pbsutils::PbsParam::searchBchParam(d, delta, r, c, obj_prob,
+                                                 serial, 1);
+    for (unsigned num_threads : {2u, 3u, 16u}) {
+      pbsutils::BestBchParam parallel{};
+      EXPECT_EQ(ub, pbsutils::PbsParam::searchBchParam(
+                        d, delta, r, c, obj_prob, parallel, num_threads));
+      EXPECT_EQ(serial.m, parallel.m);
+      EXPECT_EQ(serial.t, parallel.t);
+    }
+  }
+  for (unsigned num_threads : {2u, 7u})
+    EXPECT_EQ(
+        pbsutils::PbsParam::failureProbabilityUB(450, delta, 511, r, 12, c),
+        pbsutils::PbsParam::failureProbabilityUB(450, delta, 511, r, 12, c,
+                                                 num_threads));
+}
+
+TEST(PbsParamsTest, param_cache) {
+  auto dir = boost::filesystem::temp_directory_path() /
+             boost::filesystem::unique_path("pbs-param-cache-%%%%-%%%%");
+  std::string dir_str = dir.string() + "/";
+  pbsutils::BchParamCache::Config config{0.99, 5, 3, 3};
+  pbsutils::BchParamCache::Entry entry{8, 11, 0.009357799909271234};
+  {
+    pbsutils::BchParamCache cache(dir_str);
+    pbsutils::BchParamCache::Entry found;
+    EXPECT_FALSE(cache.find(config, 20, found));
+    cache.insert(config, 20, entry);
+    ASSERT_TRUE(cache.find(config, 20, found));
+    EXPECT_EQ(entry, found);
+    // other configurations have their own entries
+    for (pbsutils::BchParamCache::Config other :
+         {pbsutils::BchParamCache::Config{pbsutils::ONE_IN_240, 5, 3, 3},
+          pbsutils::BchParamCache::Config{0.999, 5, 3, 3},
+          pbsutils::BchParamCache::Config{0.99, 5.5, 3, 3},
+          pbsutils::BchParamCache::Config{0.99, 5, 2, 3},
+          pbsutils::BchParamCache::Config{0.99, 5, 3, 4}})
+      EXPECT_FALSE(cache.find(other, 20, found));
+    cache.insert({0.9999, 5, 3, 3}, 20, {9, 13, 9.9e-5});
+  }
+
+  // a half-written line (no newline) and garbage are skipped
+  {
+    std::ofstream ofp(dir_str + "best_bch_parameters.log", std::ios::app);
+    ofp << "not a line\n"
+        << "0x1p-1 0x1.4p+2 3 3 21 8 x 0.1\n"
+        << "0x1p-1 0x1.4p+2 3 3 21 8 1";
+  }
+  {
+    pbsutils::BchParamCache cache(dir_str);
+    pbsutils::BchParamCache::Entry found;
+    ASSERT_TRUE(cache.find(config, 20, found));
+    EXPECT_EQ(entry, found);  // doubles round-trip
+    ASSERT_TRUE(cache.find({0.9999, 5, 3, 3}, 20, found));
+    EXPECT_EQ(pbsutils::BchParamCache::Entry(9, 13, 9.9e-5), found);
+    EXPECT_FALSE(cache.find({0.5, 5, 3, 3}, 21, found));
+  }
+  boost::filesystem::remove_all(dir);
+
+  // two caches (as two processes would) appending from several threads
+  {
+    pbsutils::BchParamCache first(dir_str), second(dir_str);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 8; ++i)
+      threads.emplace_back([&, i]() {
+        auto &cache = i % 2 ? first : second;
+        for (size_t d = i; d < 800; d += 8)
+          cache.insert(config, d, {d % 9 + 6, d % 200, 1.0 / (d + 1)});
+      });
+    for (auto &thread : threads) thread.join();
+  }
+  {
+    pbsutils::BchParamCache cache(dir_str);
+    pbsutils::BchParamCache::Entry found;
+    for (size_t d = 0; d < 800; ++d) {
+      ASSERT_TRUE(cache.find(config, d, found));
+      EXPECT_EQ(pbsutils::BchParamCache::Entry(d % 9 + 6, d % 200,
+                                               1.0 / (d + 1)),
+                found);
+    }
+  }
+  boost::filesystem::remove_all(dir);
+
+  // without a usable directory, entries are still cached in memory
+  pbsutils::BchParamCache cache("/proc/no-such-dir/");
+  pbsutils::BchParamCache::Entry found;
+  cache.insert(config, 20, entry);
+  ASSERT_TRUE(cache.find(config, 20, found));
+  EXPECT_EQ(entry, found);
+}
+
+TEST(PbsParamsTest, any_target) {
+  // targets without a precomputed table are searched once, then cached
+  size_t d = 50, delta = 5, r = 3, c = 3;
+  for (double obj_prob : {0.999, 0.9999}) {
+    pbsutils::BestBchParam searched{}, param{};
+    double ub = pbsutils::PbsParam::searchBchParam(d, delta, r, c, obj_prob,
+                                                   searched);
+    EXPECT_LE(ub, 1 - obj_prob);
+    EXPECT_EQ(ub, pbsutils::PbsParam::bestBchParam(d, delta, r, c, obj_prob,
+                                                   param));
+    EXPECT_EQ(searched.m, param.m);
+    EXPECT_EQ(searched.t, param.t);
+    pbsutils::BchParamCache::Entry found;
+    ASSERT_TRUE(pbsutils::BchParamCache::Global().find(
+        {obj_prob, double(delta), r, c}, d, found));
+    EXPECT_EQ(pbsutils::BchParamCache::Entry(param.m, param.t, ub), found);
+  }
+  pbsutils::BestBchParam param{};
+  EXPECT_THROW(pbsutils::PbsParam::bestBchParam(d, delta, r, c, 1.0, param),
+               std::invalid_argument);
+  EXPECT_THROW(pbsutils::PbsParam::bestBchParam(d, delta, r, c, 0.0, param),
+               std::invalid_argument);
+}
+
+TEST(PbsParamsTest, concurrent_matrices) {
+  // small matrices computed, cached and reloaded by many threads
+  std::vector<std::array<size_t, 4>> keys;
+  for (size_t n : {31, 63, 127})
+    for (size_t t : {2, 5, 9})
+      for (size_t r : {1, 2, 3}) keys.push_back({n - 1, n, t, r});
+  std::vector<std::vector<Eigen::MatrixXd>> results(16);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < results.size(); ++i)
+    threads.emplace_back([i, &keys, &results]() {
+      for (size_t j = 0; j < keys.size(); ++j) {
+        const auto &key = keys[(i + j) % keys.size()];
+        results[i].push_back(
+            pbsutils::PbsParam::computeMultiRoundProbabilityMatrix(
+                key[0], key[1], key[2], key[3]));
+        if (j % 7 == i % 7) pbsutils::get_disk_cache().reopen();
+      }
+    });
+  for (auto &thread : threads) thread.join();
+
+  pbsutils::get_disk_cache().reopen();
+  for (size_t i = 0; i < results.size(); ++i) {
+    for (size_t j = 0; j < keys.size(); ++j) {
+      const auto &key = keys[(i + j) % keys.size()];
+      auto expected = pbsutils::PbsParam::computeMultiRoundProbabilityMatrix(
+          key[0], key[1], key[2], key[3]);
+      EXPECT_TRUE(expected.isApprox(results[i][j], 1e-12));
+    }
+  }
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
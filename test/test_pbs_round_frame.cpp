@@ -0,0 +1,259 @@
+#include <dlfcn.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pbs.h"
+#include "pbs_round_frame.h"
+#include "scatter_gather.h"
+
+using namespace libpbs;
+
+/**
+ * minisketch returns the roots in no particular order. Within this test
+ * binary, minisketch_decode() shuffles them on top of whatever order the
+ * library uses, so that nothing here can depend on it.
+ */
+extern "C" ssize_t minisketch_decode(const minisketch *sketch,
+                                     size_t max_elements, uint64_t *output) {
+  using decode_t = ssize_t (*)(const minisketch *, size_t, uint64_t *);
+  static auto real =
+      reinterpret_cast<decode_t>(dlsym(RTLD_NEXT, "minisketch_decode"));
+  static std::mutex mutex;
+  static std::mt19937_64 gen(20200809u);
+  ssize_t n = real(sketch, max_elements, output);
+  if (n > 1) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shuffle(output, output + n, gen);
+  }
+  return n;
+}
+
+namespace {
+// keys of two sets with `d` differences (half of them on each side)
+void GenerateSets(size_t common_sz, size_t d, unsigned seed,
+                  std::vector<uint64_t> &alice, std::vector<uint64_t> &bob,
+                  std::set<uint64_t> &diffs) {
+  std::mt19937_64 gen(seed);
+  std::set<uint64_t> unique;
+  while (unique.size() < common_sz + d) unique.insert(gen());
+  auto it = unique.begin();
+  for (size_t i = 0; i < common_sz; ++i, ++it) {
+    alice.push_back(*it);
+    bob.push_back(*it);
+  }
+  for (size_t i = 0; i < d; ++i, ++it) {
+    (i % 2 ? alice : bob).push_back(*it);
+    diffs.insert(*it);
+  }
+}
+}  // namespace
+
+TEST(PbsRoundFrameTest, ReconcileThroughFrames) {
+  std::vector<uint64_t> alice_keys, bob_keys;
+  std::set<uint64_t> diffs;
+  GenerateSets(10000, 200, 1, alice_keys, bob_keys, diffs);
+  ParityBitmapSketch alice(diffs.size()), bob(diffs.size());
+  alice.add(alice_keys.data(), alice_keys.size());
+  bob.add(bob_keys.data(), bob_keys.size());
+
+  std::string request, reply;
+  std::vector<uint64_t> xors, checksums, scratch;
+  std::set<uint64_t> recovered;
+  bool done = false;
+  for (uint32_t round = 1; !done && round <= 10; ++round) {
+    // Alice -> Bob
+    auto [enc, hint] = alice.encode();
+    PbsFrameHeader header;
+    header.bch_m = enc->field_sz;
+    header.bch_t = enc->capacity;
+    header.round = round;
+    header.num_groups = enc->num_groups;
+    header.hint_max_range = hint ? hint->max_range : 0;
+    PbsRoundFrameWriter alice_writer(header);
+    alice_writer.addMessage(enc.get());
+    alice_writer.addMessage(hint.get());
+    alice_writer.writeTo(request);
+
+    PbsRoundFrameView bob_view(request);
+    ASSERT_EQ(request.size(), bob_view.size());
+    ASSERT_EQ(round, bob_view.header().round);
+    if (round == 1) {
+      ASSERT_FALSE(bob_view.has(PbsFrameSection::ENCODING_HINT));
+      bob.encode();
+    } else {
+      PbsEncodingHintMessage received_hint(bob_view.header().hint_max_range);
+      ASSERT_TRUE(bob_view.parse(PbsFrameSection::ENCODING_HINT,
+                                 received_hint) ||
+                  !bob_view.has(PbsFrameSection::ENCODING_HINT));
+      bob.encodeWithHint(received_hint);
+    }
+    PbsEncodingMessage received_enc(bob_view.header().bch_m,
+                                    bob_view.header().bch_t,
+                                    bob_view.header().num_groups);
+    ASSERT_TRUE(bob_view.parse(PbsFrameSection::ENCODING, received_enc));
+
+    // Bob -> Alice
+    auto dec = bob.decode(received_enc, xors, checksums);
+    dec->format = PbsDecodingFormat::COMPACT;
+    header.decoding_format = static_cast<uint8_t>(dec->format);
+    header.hint_max_range = 0;
+    PbsRoundFrameWriter bob_writer(header);
+    bob_writer.addMessage(dec.get());
+    bob_writer.addArray(PbsFrameSection::XORS, xors);
+    bob_writer.addArray(PbsFrameSection::CHECKSUMS, checksums);
+    bob_writer.writeTo(reply);
+
+    PbsRoundFrameView alice_view(reply);
+    PbsDecodingMessage received_dec(
+        alice_view.header().bch_m, alice_view.header().bch_t,
+        alice_view.header().num_groups,
+        static_cast<PbsDecodingFormat>(alice_view.header().decoding_format));
+    ASSERT_TRUE(alice_view.parse(PbsFrameSection::DECODING, received_dec));
+    auto xors_view = alice_view.array<uint64_t>(PbsFrameSection::XORS);
+    auto checksums_view =
+        alice_view.array<uint64_t>(PbsFrameSection::CHECKSUMS);
+    ASSERT_EQ(xors.size(), xors_view.size());
+    ASSERT_EQ(checksums.size(), checksums_view.size());
+    // sections are aligned within the frame, so nothing is copied
+    ASSERT_TRUE(xors_view.inPlace());
+    const uint64_t *xors_data = xors_view.data(scratch);
+    ASSERT_TRUE(scratch.empty());
+    done = alice.decodeCheck(received_dec, xors_data, xors_view.size(),
+                             checksums_view.data(scratch),
+                             checksums_view.size());
+    recovered.insert(alice.differencesLastRound().begin(),
+                     alice.differencesLastRound().end());
+  }
+  ASSERT_TRUE(done);
+  ASSERT_EQ(diffs, recovered);
+}
+
+TEST(PbsRoundFrameTest, KeysAndValues) {
+  std::vector<uint64_t> missing{1, 1ull << 40, ~0ull};
+  std::vector<uint32_t> pushed{7, 8};
+  std::vector<std::string> values{"seven", ""};
+  PbsFrameHeader header;
+  header.round = 3;
+  header.checksum_bits = 17;
+  PbsRoundFrameWriter writer(header);
+  writer.addArray(PbsFrameSection::MISSING_KEYS, missing);
+  writer.addArray(PbsFrameSection::PUSHED_KEYS, pushed);
+  writer.addStrings(PbsFrameSection::PUSHED_VALUES, values.begin(),
+                    values.end());
+
+  // an odd offset, so the arrays cannot be used in place
+  std::vector<uint8_t> buffer(writer.serializedSize() + 1);
+  ASSERT_EQ(writer.serializedSize(), writer.write(buffer.data() + 1));
+  PbsRoundFrameView view(buffer.data() + 1, buffer.size() - 1);
+  ASSERT_EQ(3u, view.header().round);
+  ASSERT_EQ(17u, view.header().checksum_bits);
+  ASSERT_FALSE(view.has(PbsFrameSection::ENCODING));
+
+  auto missing_view = view.array<uint64_t>(PbsFrameSection::MISSING_KEYS);
+  ASSERT_FALSE(missing_view.inPlace());
+  std::vector<uint64_t> scratch;
+  const uint64_t *missing_data = missing_view.data(scratch);
+  ASSERT_EQ(missing, std::vector<uint64_t>(missing_data,
+                                           missing_data + missing.size()));
+  auto pushed_view = view.array<uint32_t>(PbsFrameSection::PUSHED_KEYS);
+  ASSERT_EQ(2u, pushed_view.size());
+  ASSERT_EQ(7u, pushed_view[0]);
+  ASSERT_EQ(8u, pushed_view[1]);
+  ASSERT_THROW(view.array<uint64_t>(PbsFrameSection::PUSHED_KEYS),
+               std::runtime_error);
+
+  // narrower elements are widened on copy
+  std::vector<uint64_t> widened;
+  view.copyArray(PbsFrameSection::PUSHED_KEYS, widened);
+  ASSERT_EQ(std::vector<uint64_t>({7, 8}), widened);
+
+  auto values_view = view.strings(PbsFrameSection::PUSHED_VALUES);
+  ASSERT_EQ(2u, values_view.size());
+  ASSERT_EQ("seven", values_view[0]);
+  ASSERT_EQ("", values_view[1]);
+}
+
+TEST(PbsRoundFrameTest, NarrowedArrays) {
+  std::vector<uint32_t> checksums{0, 0xabcdef, 0xffffff, 0x123456};
+  PbsRoundFrameWriter writer(PbsFrameHeader{});
+  writer.addArray(PbsFrameSection::CHECKSUMS, checksums, 3);
+  std::string frame;
+  writer.writeTo(frame);
+  PbsRoundFrameView view(frame);
+  ASSERT_EQ(12u, view.bytes(PbsFrameSection::CHECKSUMS).second);
+  ASSERT_THROW(view.array<uint32_t>(PbsFrameSection::CHECKSUMS),
+               std::runtime_error);
+  std::vector<uint32_t> copied;
+  view.copyArray(PbsFrameSection::CHECKSUMS, copied);
+  ASSERT_EQ(checksums, copied);
+  std::vector<uint16_t> narrower;
+  ASSERT_THROW(view.copyArray(PbsFrameSection::CHECKSUMS, narrower),
+               std::runtime_error);
+}
+
+TEST(PbsRoundFrameTest, ScatteredFrame) {
+  PbsEncodingMessage enc(11, 13, 9);
+  std::mt19937_64 gen(20200804u);
+  for (auto sketch : enc.getSketches())
+    for (int i = 0; i < 5; ++i) minisketch_add_uint64(sketch, 1 + gen() % 2047);
+  std::vector<uint64_t> xors{1, 2, 3};
+  std::vector<std::string> values{"one", "three"};
+  PbsFrameHeader header;
+  header.bch_m = 11;
+  header.bch_t = 13;
+  header.num_groups = 9;
+  PbsRoundFrameWriter writer(header);
+  writer.addMessage(&enc);
+  writer.addArray(PbsFrameSection::XORS, xors);
+  writer.addStrings(PbsFrameSection::PUSHED_VALUES, values.begin(),
+                    values.end());
+  std::string expected;
+  writer.writeTo(expected);
+
+  for (size_t piece : {1, 5, 64, 4096}) {
+    std::vector<uint8_t> buf(expected.size(), 0xa5);
+    std::vector<struct iovec> iov;
+    for (size_t pos = 0; pos < buf.size(); pos += piece)
+      iov.push_back({buf.data() + pos, std::min(piece, buf.size() - pos)});
+    utils::ScatterWriter sink(iov.data(), iov.size());
+    ASSERT_EQ(expected.size(), writer.write(sink));
+    ASSERT_EQ(0u, sink.Remaining());
+    ASSERT_EQ(expected, std::string(buf.begin(), buf.end()));
+  }
+  utils::ScatterWriter small(nullptr, 0);
+  ASSERT_THROW(writer.write(small), std::length_error);
+}
+
+TEST(PbsRoundFrameTest, MalformedFrames) {
+  std::vector<uint64_t> keys{1, 2, 3};
+  PbsRoundFrameWriter writer(PbsFrameHeader{});
+  writer.addArray(PbsFrameSection::MISSING_KEYS, keys);
+  std::string frame;
+  writer.writeTo(frame);
+  ASSERT_NO_THROW(PbsRoundFrameView{frame});
+
+  // truncated
+  ASSERT_THROW(PbsRoundFrameView(frame.substr(0, frame.size() - 1)),
+               std::runtime_error);
+  ASSERT_THROW(PbsRoundFrameView(frame.substr(0, 10)), std::runtime_error);
+  // wrong magic
+  std::string bad = frame;
+  bad[0] = 'X';
+  ASSERT_THROW(PbsRoundFrameView{bad}, std::runtime_error);
+  // unsupported version
+  bad = frame;
+  bad[4] = 0x7f;
+  ASSERT_THROW(PbsRoundFrameView{bad}, std::runtime_error);
+  // section out of the frame
+  bad = frame;
+  size_t entry = 48 + 24 * static_cast<size_t>(PbsFrameSection::MISSING_KEYS);
+  bad[entry + 8] = 0x7f;
+  ASSERT_THROW(PbsRoundFrameView{bad}, std::runtime_error);
+}
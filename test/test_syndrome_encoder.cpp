@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+#include "syndrome_encoder.h"
+
+using namespace libpbs::utils;
+
+/**
+ * The encoder must produce byte-for-byte the serialization of a minisketch
+ * with the same elements added one by one.
+ */
+TEST(SyndromeEncoderTest, MatchesMinisketch) {
+  std::mt19937_64 gen(20200731u);
+  for (uint32_t m = 2; m <= 16; ++m) {
+    uint32_t n = (1u << m) - 1u;
+    for (uint32_t t : {1u, 3u, 7u, 13u}) {
+      SyndromeEncoder encoder(m, t);
+      std::vector<uint8_t> bitmap(n, 0);
+      std::vector<uint32_t> elements;
+      for (int k = 0; k < 40; ++k) {
+        uint32_t x = gen() % n;
+        bitmap[x] ^= 1u;
+        elements.push_back(x);
+      }
+
+      minisketch *sketch = minisketch_create(m, 0, t);
+      for (uint32_t x = 1; x < n; ++x)
+        if (bitmap[x]) minisketch_add_uint64(sketch, x);
+      std::vector<uint8_t> expected(minisketch_serialized_size(sketch));
+      minisketch_serialize(sketch, expected.data());
+      ASSERT_EQ(encoder.serializedSize(), expected.size());
+
+      std::vector<uint16_t> syndromes(t);
+      std::vector<uint8_t> actual(expected.size());
+      encoder.encode(bitmap.data(), bitmap.size(), syndromes.data());
+      encoder.serialize(syndromes.data(), actual.data());
+      EXPECT_EQ(expected, actual) << "m = " << m << ", t = " << t;
+
+      // elements appearing twice cancel out, as in the bitmap
+      encoder.encode(elements.begin(), elements.end(), syndromes.data());
+      encoder.serialize(syndromes.data(), actual.data());
+      EXPECT_EQ(expected, actual) << "m = " << m << ", t = " << t;
+
+      // and loading into a sketch gives the same sketch
+      minisketch *loaded = minisketch_create(m, 0, t);
+      encoder.load(syndromes.data(), actual.data(), loaded);
+      std::vector<uint8_t> reserialized(expected.size());
+      minisketch_serialize(loaded, reserialized.data());
+      EXPECT_EQ(expected, reserialized);
+      minisketch_destroy(loaded);
+      minisketch_destroy(sketch);
+    }
+  }
+}